@@ -0,0 +1,559 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* sbig-bench - time each phase of the snap pipeline
+ *
+ * Loops start_exposure -> status polling -> end_exposure -> readout
+ * -> color convert -> FITS write, and reports latency percentiles
+ * and throughput for each phase.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/color.h"
+#include "src/common/libutil/cpu.h"
+#include "src/common/libsbig/sbfits.h"
+#include "src/common/libini/ini.h"
+
+typedef enum {
+    PHASE_START,
+    PHASE_WAIT,
+    PHASE_END,
+    PHASE_READOUT,
+    PHASE_COLOR,
+    PHASE_STATS,
+    PHASE_FITS,
+    PHASE_TOTAL,
+    PHASE_COUNT,
+} phase_t;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "start", "wait", "end", "readout", "color", "stats", "fits", "total",
+};
+
+struct options {
+    CCD_REQUEST chip;
+    READOUT_BINNING_MODE readout_mode;
+    double partial;
+    double t;
+    int count;
+    char *imagedir;
+    char *color_convert;
+    bool dark;
+    bool keep;
+    bool color_kernels;
+    int threads;
+    bool readout_stats;
+    bool no_mmap;
+    sbfits_compress_t compress;
+};
+
+struct phase_stats {
+    double *samples;            /* seconds, one per iteration */
+    int n;
+    double bytes;               /* total bytes moved, if meaningful */
+};
+
+static bool interrupted = false;
+static const double exposure_timeout = 60.0; /* seconds past exposure end */
+
+#define OPTIONS "ht:n:C:r:p:d:x:DkKj:sMz:"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"exposure-time", required_argument,     0, 't'},
+    {"count",         required_argument,     0, 'n'},
+    {"chip",          required_argument,     0, 'C'},
+    {"resolution",    required_argument,     0, 'r'},
+    {"partial",       required_argument,     0, 'p'},
+    {"image-directory", required_argument,   0, 'd'},
+    {"color-convert", required_argument,     0, 'x'},
+    {"dark",          no_argument,           0, 'D'},
+    {"keep",          no_argument,           0, 'k'},
+    {"color-kernels", no_argument,           0, 'K'},
+    {"threads",       required_argument,     0, 'j'},
+    {"readout-stats", no_argument,           0, 's'},
+    {"no-mmap",       no_argument,           0, 'M'},
+    {"compress",      required_argument,     0, 'z'},
+    {0, 0, 0, 0},
+};
+
+void bench (sbig_t *sb, struct options *opt);
+void bench_color (struct options *opt);
+int config_cb (void *user, const char *section, const char *name,
+               const char *value);
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-bench [OPTIONS]\n"
+"  -t, --exposure-time SEC    exposure time in seconds (default 0.2)\n"
+"  -n, --count N              number of iterations (default 10)\n"
+"  -C, --ccd-chip CHIP        use imaging, tracking, or ext-tracking\n"
+"  -r, --resolution RES       select hi, med, or lo resolution\n"
+"  -p, --partial N            take centered partial frame (0 < N <= 1.0)\n"
+"  -d, --image-directory DIR  where to write FITS files (default /tmp)\n"
+"  -x, --color-convert=mono   time single shot color conversion\n"
+"  -j, --threads N            post-processing threads (default: all CPUs)\n"
+"  -s, --readout-stats        gather frame statistics during readout\n"
+"  -M, --no-mmap              write FITS through cfitsio, not mmap\n"
+"  -z, --compress TYPE        tile compress FITS: rice, hcompress, or gzip\n"
+"  -D, --dark                 take dark frames (shutter closed)\n"
+"  -k, --keep                 keep FITS files instead of removing them\n"
+"  -K, --color-kernels        compare color conversion kernels on 4Kx4K\n"
+"                             synthetic frames (no camera needed)\n"
+);
+    exit (1);
+}
+
+void handle_sigint (int signal)
+{
+    interrupted = true;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *sbig_udrv = getenv ("SBIG_UDRV");
+    const char *sbig_device = getenv ("SBIG_DEVICE");
+    const char *config_filename = getenv ("SBIG_CONFIG_FILE");
+    int e, ch;
+    sbig_t *sb;
+    struct options *opt;
+    CAMERA_TYPE type;
+    struct sigaction sa;
+
+    log_init ("sbig-bench");
+
+    opt = xzmalloc (sizeof (*opt));
+
+    /* Set default option values.
+     */
+    opt->chip = CCD_IMAGING;
+    opt->readout_mode = RM_1X1;
+    opt->imagedir = xstrdup ("/tmp");
+    opt->t = 0.2;
+    opt->count = 10;
+    opt->partial = 1.0;
+
+    if (config_filename)
+        (void)ini_parse (config_filename, config_cb, opt);
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 't': /* --exposure-time SEC */
+                opt->t = strtod (optarg, NULL);
+                if (opt->t < 0 || opt->t > 86400)
+                    msg_exit ("error parsing --exposure-time argument");
+                break;
+            case 'n': /* --count N */
+                opt->count = strtoul (optarg, NULL, 10);
+                if (opt->count < 1)
+                    msg_exit ("error parsing --count argument");
+                break;
+            case 'C': /* --ccd-chip CHIP */
+                if (!strcmp (optarg, "imaging"))
+                    opt->chip = CCD_IMAGING;
+                else if (!strcmp (optarg, "tracking"))
+                    opt->chip = CCD_TRACKING;
+                else if (!strcmp (optarg, "ext-tracking"))
+                    opt->chip = CCD_EXT_TRACKING;
+                else
+                    msg_exit ("error parsing --ccd-chip argument (imaging, tracking, ext-tracking)");
+                break;
+            case 'r': /* --resolution hi|med|lo */
+                if (!strcmp (optarg, "hi"))
+                    opt->readout_mode = RM_1X1;
+                else if (!strcmp (optarg, "med"))
+                    opt->readout_mode = RM_2X2;
+                else if (!strcmp (optarg, "lo"))
+                    opt->readout_mode = RM_3X3;
+                else
+                    msg_exit ("error parsing --resolution (hi, med, lo)");
+                break;
+            case 'p': /* --partial */
+                opt->partial = strtod (optarg, NULL);
+                if (opt->partial <= 0 || opt->partial > 1.0)
+                    usage ();
+                break;
+            case 'd': /* --image-directory DIR */
+                free (opt->imagedir);
+                opt->imagedir = xstrdup (optarg);
+                break;
+            case 'x': /* --color-convert=mono */
+                free (opt->color_convert);
+                opt->color_convert = xstrdup (optarg);
+                break;
+            case 'D': /* --dark */
+                opt->dark = true;
+                break;
+            case 'k': /* --keep */
+                opt->keep = true;
+                break;
+            case 'K': /* --color-kernels */
+                opt->color_kernels = true;
+                break;
+            case 'j': /* --threads N */
+                opt->threads = strtoul (optarg, NULL, 10);
+                break;
+            case 's': /* --readout-stats */
+                opt->readout_stats = true;
+                break;
+            case 'M': /* --no-mmap */
+                opt->no_mmap = true;
+                break;
+            case 'z': /* --compress TYPE */
+                if (sbfits_compress_parse (optarg, &opt->compress) < 0)
+                    msg_exit ("error parsing --compress argument");
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc)
+        usage ();
+
+    if (opt->color_kernels) {
+        bench_color (opt);
+        goto done;
+    }
+
+    if (!sbig_device)
+        msg_exit ("SBIG_DEVICE is not set");
+    if (!(sb = sbig_new ()))
+        err_exit ("sbig_new");
+    if (sbig_dlopen (sb, sbig_udrv) != 0)
+        msg_exit ("%s", dlerror ());
+    if ((e = sbig_open_driver (sb)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_driver: %s", sbig_get_error_string (sb, e));
+
+    sa.sa_handler = &handle_sigint;
+    sa.sa_flags = 0;
+    sigfillset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0)
+        err_exit ("sigaction");
+
+    if ((e = sbig_open_device (sb, sbig_device)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_device: %s: %s", sbig_device,
+                   sbig_get_error_string (sb, e));
+    if ((e = sbig_establish_link (sb, &type)) != CE_NO_ERROR)
+        msg_exit ("sbig_establish_link: %s", sbig_get_error_string (sb, e));
+    msg ("Link established to %s", sbig_strcam (type));
+
+    bench (sb, opt);
+
+    if ((e = sbig_close_device (sb)) != 0)
+        msg_exit ("sbig_close_device: %s", sbig_get_error_string (sb, e));
+    sbig_destroy (sb);
+done:
+    free (opt->imagedir);
+    free (opt->color_convert);
+    free (opt);
+
+    log_fini ();
+    return 0;
+}
+
+int config_cb (void *user, const char *section, const char *name,
+               const char *value)
+{
+    struct options *opt = user;
+
+    if (!strcmp (section, "system")) {
+        if (!strcmp (name, "imagedir")) {
+            free (opt->imagedir);
+            opt->imagedir = xstrdup (value);
+        }
+    }
+    return 0; /* 0=success, 1=error */
+}
+
+static double now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1E-9 * ts.tv_nsec;
+}
+
+static int cmp_double (const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/* Nearest-rank percentile of sorted samples.
+ */
+static double percentile (const double *v, int n, double p)
+{
+    int i = (int)(p / 100.0 * n + 0.5) - 1;
+
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return v[i];
+}
+
+static bool check_interrupted (void *arg)
+{
+    return interrupted;
+}
+
+static void write_fits (sbig_ccd_t *ccd, const sbig_frame_stats_t *st,
+                        const struct options *opt)
+{
+    sbfits_t *sbf = sbfits_create ();
+
+    if (sbfits_create_file (sbf, opt->imagedir, "BENCH") < 0)
+        msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                  sbfits_get_errstr (sbf));
+    sbfits_set_ccdinfo (sbf, ccd);
+    sbfits_set_stats (sbf, st);
+    sbfits_set_mmap (sbf, !opt->no_mmap);
+    sbfits_set_compress (sbf, opt->compress);
+    sbfits_set_imagetype (sbf, opt->dark ? SBFITS_TYPE_DF : SBFITS_TYPE_LF);
+    if (sbfits_write_file (sbf) < 0)
+        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+    if (sbfits_close_file (sbf) < 0)
+        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+    if (!opt->keep)
+        (void)unlink (sbfits_get_filename (sbf));
+    sbfits_destroy (sbf);
+}
+
+static void report (struct phase_stats *ps, int n)
+{
+    int i;
+
+    msg ("%-8s %10s %10s %10s %10s", "phase", "p50(ms)", "p99(ms)",
+         "max(ms)", "MB/s");
+    for (i = 0; i < PHASE_COUNT; i++) {
+        double sum = 0;
+        int j;
+
+        if (ps[i].n == 0)
+            continue;
+        for (j = 0; j < ps[i].n; j++)
+            sum += ps[i].samples[j];
+        qsort (ps[i].samples, ps[i].n, sizeof (double), cmp_double);
+        if (ps[i].bytes > 0 && sum > 0)
+            msg ("%-8s %10.2f %10.2f %10.2f %10.2f", phase_names[i],
+                 1E3 * percentile (ps[i].samples, ps[i].n, 50),
+                 1E3 * percentile (ps[i].samples, ps[i].n, 99),
+                 1E3 * ps[i].samples[ps[i].n - 1],
+                 ps[i].bytes / sum / (1024*1024));
+        else
+            msg ("%-8s %10.2f %10.2f %10.2f %10s", phase_names[i],
+                 1E3 * percentile (ps[i].samples, ps[i].n, 50),
+                 1E3 * percentile (ps[i].samples, ps[i].n, 99),
+                 1E3 * ps[i].samples[ps[i].n - 1], "-");
+    }
+    if (ps[PHASE_TOTAL].n > 0) {
+        double sum = 0;
+        for (i = 0; i < ps[PHASE_TOTAL].n; i++)
+            sum += ps[PHASE_TOTAL].samples[i];
+        msg ("%d frames in %.2fs (%.2f frames/s)", n, sum, n / sum);
+    }
+}
+
+void bench (sbig_t *sb, struct options *opt)
+{
+    struct phase_stats ps[PHASE_COUNT];
+    sbig_ccd_t *ccd;
+    ushort top, left, height, width;
+    sbig_frame_stats_t st;
+    double frame_bytes, overshoot = 0;
+    int e, i, n;
+
+    memset (ps, 0, sizeof (ps));
+    for (i = 0; i < PHASE_COUNT; i++)
+        ps[i].samples = xzmalloc (opt->count * sizeof (double));
+
+    if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_end_exposure (ccd, ABORT_DONT_END)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_set_readout_mode (ccd, opt->readout_mode)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+    if (opt->partial < 1.0) {
+        if ((e = sbig_ccd_set_partial_frame (ccd, opt->partial)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_set_partial_frame: %s",
+                      sbig_get_error_string (sb, e));
+    }
+    if ((e = sbig_ccd_set_threads (ccd, opt->threads)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_threads: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_set_readout_stats (ccd, opt->readout_stats)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_stats: %s",
+                  sbig_get_error_string (sb, e));
+    e = sbig_ccd_set_shutter_mode (ccd, opt->dark ? SC_CLOSE_SHUTTER
+                                                  : SC_OPEN_SHUTTER);
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_shutter_mode: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_window: %s", sbig_get_error_string (sb, e));
+    frame_bytes = (double)height * width * sizeof (ushort);
+
+    msg ("%d x %d, %.3fs exposures, %d iterations", width, height, opt->t,
+         opt->count);
+    msg ("pixel kernels: %s", cpu_level_name (cpu_level ()));
+
+    for (n = 0; n < opt->count && !interrupted; n++) {
+        double t[PHASE_COUNT + 1];
+
+        t[PHASE_START] = now ();
+        if ((e = sbig_ccd_start_exposure (ccd, 0, opt->t)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_start_exposure: %s",
+                      sbig_get_error_string (sb, e));
+        t[PHASE_WAIT] = now ();
+        e = sbig_ccd_wait_exposure (ccd, exposure_timeout,
+                                    check_interrupted, NULL);
+        if (e == CE_KBD_ESC) {
+            (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
+            break;
+        }
+        if (e != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_wait_exposure: %s",
+                      sbig_get_error_string (sb, e));
+        t[PHASE_END] = now ();
+        if ((e = sbig_ccd_end_exposure (ccd, 0)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_end_exposure: %s",
+                      sbig_get_error_string (sb, e));
+        t[PHASE_READOUT] = now ();
+        if ((e = sbig_ccd_readout (ccd)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_readout: %s", sbig_get_error_string (sb, e));
+        t[PHASE_COLOR] = now ();
+        if (opt->color_convert) {
+            e = sbig_ccd_color_convert (ccd, opt->color_convert);
+            if (e != CE_NO_ERROR)
+                msg_exit ("sbig_ccd_color_convert: %s",
+                          sbig_get_error_string (sb, e));
+        }
+        t[PHASE_STATS] = now ();
+        if ((e = sbig_ccd_get_stats (ccd, &st)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_stats: %s", sbig_get_error_string (sb, e));
+        t[PHASE_FITS] = now ();
+        write_fits (ccd, &st, opt);
+        t[PHASE_TOTAL] = now ();
+
+        for (i = PHASE_START; i < PHASE_TOTAL; i++) {
+            if (i == PHASE_COLOR && !opt->color_convert)
+                continue;
+            ps[i].samples[ps[i].n++] = t[i + 1] - t[i];
+        }
+        ps[PHASE_TOTAL].samples[ps[PHASE_TOTAL].n++] = t[PHASE_TOTAL]
+                                                     - t[PHASE_START];
+        overshoot += t[PHASE_END] - t[PHASE_WAIT] - opt->t;
+    }
+    if (n == 0)
+        msg_exit ("interrupted");
+
+    ps[PHASE_READOUT].bytes = frame_bytes * n;
+    if (opt->color_convert)
+        ps[PHASE_COLOR].bytes = frame_bytes * n;
+    ps[PHASE_STATS].bytes = frame_bytes * n;
+    ps[PHASE_FITS].bytes = frame_bytes * n;
+
+    report (ps, n);
+    msg ("wait: %.2fms mean past exposure time", 1E3 * overshoot / n);
+
+    for (i = 0; i < PHASE_COUNT; i++)
+        free (ps[i].samples);
+    sbig_ccd_destroy (ccd);
+}
+
+/* Time color_bayer_to_mono() with each supported interior kernel against
+ * the reference implementation, and verify the output is identical.
+ */
+void bench_color (struct options *opt)
+{
+    const char *names[] = { "avx2", "sse2", "scalar" };
+    const int width = 4096, height = 4096;
+    size_t npix = (size_t)width * height;
+    ushort *in = xzmalloc (npix * sizeof (ushort));
+    ushort *ref = xzmalloc (npix * sizeof (ushort));
+    ushort *out = xzmalloc (npix * sizeof (ushort));
+    double *samples = xzmalloc (opt->count * sizeof (double));
+    unsigned int seed = 1;
+    size_t j;
+    int i, k;
+
+    /* Full range noise exercises the largest sums.
+     */
+    for (j = 0; j < npix; j++)
+        in[j] = rand_r (&seed) & 0xffff;
+
+    msg ("%d x %d, %d iterations", width, height, opt->count);
+    msg ("pixel kernels: %s (auto)", cpu_level_name (cpu_level ()));
+    msg ("%-8s %10s %10s %10s", "kernel", "p50(ms)", "p99(ms)", "Mpix/s");
+    for (k = -1; k < (int)(sizeof (names) / sizeof (names[0])); k++) {
+        const char *name = k < 0 ? "ref" : names[k];
+
+        if (k >= 0 && color_set_kernel (name) < 0)
+            continue;
+        for (i = 0; i < opt->count && !interrupted; i++) {
+            double t0 = now ();
+            if (k < 0)
+                color_bayer_to_mono_ref (in, ref, width, height);
+            else
+                color_bayer_to_mono (in, out, width, height);
+            samples[i] = now () - t0;
+        }
+        if (i < opt->count)
+            break;
+        if (k >= 0 && memcmp (ref, out, npix * sizeof (ushort)) != 0)
+            msg_exit ("%s: output differs from reference", name);
+        qsort (samples, opt->count, sizeof (double), cmp_double);
+        msg ("%-8s %10.2f %10.2f %10.1f", name,
+             1E3 * percentile (samples, opt->count, 50),
+             1E3 * percentile (samples, opt->count, 99),
+             npix / percentile (samples, opt->count, 50) / 1E6);
+    }
+    (void)color_set_kernel ("auto");
+
+    free (samples);
+    free (out);
+    free (ref);
+    free (in);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -38,6 +38,7 @@
 
 void cfw_query (sbig_t *sb, int ac, char **av);
 void cfw_goto (sbig_t *sb, int ac, char **av);
+void cfw_sbigd (sbig_client_t *c, const char *cmd, int ac, char **av);
 
 #define OPTIONS "h"
 static const struct option longopts[] = {
@@ -63,6 +64,7 @@ int main (int argc, char *argv[])
     int ch;
     char *cmd;
     CAMERA_TYPE type;
+    sbig_client_t *c;
 
     log_init ("sbig-cfw");
 
@@ -77,6 +79,17 @@ int main (int argc, char *argv[])
         usage ();
     cmd = argv[optind++];
 
+    /* If sbigd has the camera, ask it.
+     */
+    if ((c = sbig_client_connect (NULL))) {
+        cfw_sbigd (c, cmd, argc - optind, argv + optind);
+        sbig_client_destroy (c);
+        log_fini ();
+        return 0;
+    }
+    if (errno != ENOENT && errno != ECONNREFUSED)
+        err_exit ("sbigd");
+
     if (!sbig_device)
         msg_exit ("SBIG_DEVICE is not set");
     if (!(sb = sbig_new ()))
@@ -146,6 +159,32 @@ void cfw_query (sbig_t *sb, int ac, char **av)
         msg ("position: %d", position);
 }
 
+void cfw_sbigd (sbig_client_t *c, const char *cmd, int ac, char **av)
+{
+    char reply[SBIG_CLIENT_LINE];
+    char status[16], position[16];
+    int rc;
+
+    if (!strcmp (cmd, "query") && ac == 0)
+        rc = sbig_client_request (c, reply, sizeof (reply), "cfw query");
+    else if (!strcmp (cmd, "goto") && ac == 1)
+        rc = sbig_client_request (c, reply, sizeof (reply), "cfw goto %lu",
+                                  strtoul (av[0], NULL, 10));
+    else
+        usage ();
+    if (rc < 0) {
+        if (errno == EREMOTEIO)
+            msg_exit ("sbigd: %s", reply);
+        err_exit ("sbigd");
+    }
+    if (sbig_client_get (reply, "status", status, sizeof (status)) == 0)
+        msg ("status:   %s", status);
+    if (sbig_client_get (reply, "position", position, sizeof (position)) < 0
+            || strtoul (position, NULL, 10) == CFWP_UNKNOWN)
+        msg ("position: unknown");
+    else
+        msg ("position: %s", position);
+}
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
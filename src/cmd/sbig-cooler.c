@@ -62,6 +62,8 @@ int main (int argc, char *argv[])
     double setpoint = 0;
     char *modestr = NULL;
     TEMPERATURE_REGULATION mode;
+    sbig_client_t *c;
+    char reply[SBIG_CLIENT_LINE];
 
     log_init ("sbig-cooler");
 
@@ -85,6 +87,25 @@ int main (int argc, char *argv[])
     if (optind < argc)
         setpoint = strtod (argv[optind++], NULL);
 
+    /* If sbigd has the camera, ask it.
+     */
+    if ((c = sbig_client_connect (NULL))) {
+        if ((mode == REGULATION_ON
+                ? sbig_client_request (c, reply, sizeof (reply),
+                                       "cooler on %.2f", setpoint)
+                : sbig_client_request (c, reply, sizeof (reply),
+                                       "cooler off")) < 0) {
+            if (errno == EREMOTEIO)
+                msg_exit ("sbigd: %s", reply);
+            err_exit ("sbigd");
+        }
+        sbig_client_destroy (c);
+        log_fini ();
+        return 0;
+    }
+    if (errno != ENOENT && errno != ECONNREFUSED)
+        err_exit ("sbigd");
+
     if (!sbig_device)
         msg_exit ("SBIG_DEVICE is not set");
     if (!(sb = sbig_new ()))
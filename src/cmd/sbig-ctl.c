@@ -0,0 +1,107 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Send a request to sbigd and print the reply.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+
+#define OPTIONS "+hs:"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"socket",        required_argument,     0, 's'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-ctl [OPTIONS] REQUEST [ARGS...]\n"
+"  -s, --socket PATH  connect to sbigd on PATH\n"
+"Requests:\n"
+"  status\n"
+"  cooler on SETPOINT | off\n"
+"  cfw query | goto N\n"
+"  expose time=SEC [type=lf|df] [res=hi|med|lo] [partial=N]\n"
+"  abort\n"
+);
+    exit (1);
+}
+
+int main (int argc, char *argv[])
+{
+    const char *path = NULL;
+    sbig_client_t *c;
+    char req[SBIG_CLIENT_LINE] = "";
+    char reply[SBIG_CLIENT_LINE];
+    int ch, n = 0;
+
+    log_init ("sbig-ctl");
+
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 's': /* --socket PATH */
+                path = optarg;
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind == argc)
+        usage ();
+    for (; optind < argc; optind++) {
+        n += snprintf (req + n, sizeof (req) - n, "%s%s", n > 0 ? " " : "",
+                       argv[optind]);
+        if (n >= sizeof (req))
+            msg_exit ("request is too long");
+    }
+
+    if (!(c = sbig_client_connect (path)))
+        err_exit ("sbigd");
+    if (sbig_client_request (c, reply, sizeof (reply), "%s", req) < 0) {
+        if (errno == EREMOTEIO)
+            msg_exit ("%s", reply);
+        err_exit ("sbigd");
+    }
+    if (*reply)
+        printf ("%s\n", reply);
+    sbig_client_destroy (c);
+    log_fini ();
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
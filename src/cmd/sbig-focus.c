@@ -35,9 +35,9 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <pwd.h>
 #include <time.h>
+#include <math.h>
 
 #include "src/common/libsbig/sbig.h"
 #include "src/common/libutil/log.h"
@@ -51,9 +51,11 @@ struct options {
     double t;
     bool verbose;
     char *color_convert;
+    bool preview;
+    int roi;                    /* with --auto-roi, box size in pixels */
 };
 
-#define OPTIONS "ht:C:r:p:x:"
+#define OPTIONS "ht:C:r:p:x:Na::"
 static const struct option longopts[] = {
     {"help",          no_argument,           0, 'h'},
     {"exposure-time", required_argument,     0, 't'},
@@ -61,10 +63,14 @@ static const struct option longopts[] = {
     {"resolution",    required_argument,     0, 'r'},
     {"partial",       required_argument,     0, 'p'},
     {"color-convert", required_argument,     0, 'x'},
+    {"no-preview",    no_argument,           0, 'N'},
+    {"auto-roi",      optional_argument,     0, 'a'},
     {0, 0, 0, 0},
 };
 
 static bool interrupted = false;
+static const double exposure_timeout = 60.0; /* seconds past exposure end */
+static const int default_roi = 100; /* --auto-roi box size, pixels */
 
 void snap_series (sbig_t *sb, const struct options *opt);
 
@@ -77,6 +83,10 @@ void usage (void)
 "  -r, --resolution RES      select hi, med, or lo resolution\n"
 "  -p, --partial N           take centered partial frame (0 < N <= 1.0)\n"
 "  -x, --color-convert=mono  convert raw single shot color to monochrome\n"
+"  -N, --no-preview          print focus metrics only, without ds9\n"
+"  -a, --auto-roi[=N]        find the brightest star in a lo resolution\n"
+"                            frame, then read out only an N pixel box\n"
+"                            around it (default 100)\n"
 );
     exit (1);
 }
@@ -107,6 +117,7 @@ int main (int argc, char *argv[])
     opt->t = 1.0;                    /* 1s exposure time */
     opt->verbose = true;
     opt->partial = 1.0;
+    opt->preview = true;
 
     optind = 0;
     while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
@@ -144,6 +155,14 @@ int main (int argc, char *argv[])
             case 'x': /* --color-convert=monochrome */
                 opt->color_convert = xstrdup (optarg);
                 break;
+            case 'N': /* --no-preview */
+                opt->preview = false;
+                break;
+            case 'a': /* --auto-roi[=N] */
+                opt->roi = optarg ? strtoul (optarg, NULL, 10) : default_roi;
+                if (opt->roi < 2 * SBIG_FOCUS_RADIUS + 1 || opt->roi > 4096)
+                    msg_exit ("error parsing --auto-roi argument");
+                break;
             case 'h': /* --help */
             default:
                 usage ();
@@ -151,6 +170,8 @@ int main (int argc, char *argv[])
     }
     if (optind != argc)
         usage ();
+    if (opt->roi && opt->partial < 1.0)
+        msg_exit ("--auto-roi cannot be used with --partial");
 
     /* Connect to driver
      */
@@ -168,6 +189,11 @@ int main (int argc, char *argv[])
     sigfillset (&sa.sa_mask);
     if (sigaction (SIGINT, &sa, NULL) < 0)
         err_exit ("sigaction");
+    /* A preview's xpaset may exit before reading the whole image.
+     */
+    sa.sa_handler = SIG_IGN;
+    if (sigaction (SIGPIPE, &sa, NULL) < 0)
+        err_exit ("sigaction");
 
     /* Open camera
      */
@@ -195,55 +221,71 @@ int main (int argc, char *argv[])
     return 0;
 }
 
+bool check_interrupted (void *arg)
+{
+    return interrupted;
+}
+
 bool exposure_wait (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
 {
-    PAR_COMMAND_STATUS status;
     int e;
 
-    usleep (1E6 * opt->t);
-    do {
-        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
-            msg_exit ("sbig_get_exposure_status: %s", sbig_get_error_string (sb, e));
-        if (status != CS_INTEGRATION_COMPLETE)
-            usleep (1E3 * 500); /* 500ms */
-    } while (status != CS_INTEGRATION_COMPLETE && !interrupted);
-    return !interrupted;
+    e = sbig_ccd_wait_exposure (ccd, exposure_timeout, check_interrupted, NULL);
+    if (e == CE_KBD_ESC)
+        return false;
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_wait_exposure: %s", sbig_get_error_string (sb, e));
+    return true;
 }
 
-void preview_ds9 (sbfits_t *sbf)
+/* Print star count, HFD, FWHM, and sharpness of the frame just read out.
+ */
+void print_metrics (sbig_t *sb, sbig_ccd_t *ccd, int seq,
+                    sbig_focus_metrics_t *mp)
 {
-    char *cmd;
-    int status;
-
-    if (asprintf (&cmd, "xpaset ds9 fits <%s", sbfits_get_filename (sbf))<0)
-        oom ();
-    if ((status = system (cmd)) < 0)
-        err ("preview");
-    else if (WIFEXITED (status)) {
-        if (WEXITSTATUS (status) != 0)
-            msg ("preview: xpaset exited with rc=%d", WEXITSTATUS (status));
-    } else if (WIFSIGNALED (status)) {
-        msg ("preview: killed by %s", strsignal (WTERMSIG (status)));
-    } else if (WIFSTOPPED (status)) {
-        msg ("preview: stopped");
-    } else if (WIFCONTINUED (status)) {
-        msg ("preview: continued");
+    sbig_focus_metrics_t m;
+    const ushort *data;
+    ushort height, width, datamax;
+    struct timespec t0, t1;
+    int e;
+
+    if ((e = sbig_ccd_get_datamax (ccd, &datamax)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_datamax: %s", sbig_get_error_string (sb, e));
+    data = sbig_ccd_get_data (ccd, &height, &width);
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if (sbig_focus_measure (data, height, width, datamax, &m) < 0) {
+        err ("sbig_focus_measure");
+        memset (mp, 0, sizeof (*mp));
+        return;
     }
-    free (cmd);
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    if (m.stars > 0)
+        msg ("[%d] stars %d HFD %.2f FWHM %.2f sharpness %.1f (%.1fms)",
+             seq, m.stars, m.hfd, m.fwhm, m.sharpness,
+             (t1.tv_sec - t0.tv_sec) * 1E3 + (t1.tv_nsec - t0.tv_nsec) * 1E-6);
+    else
+        msg ("[%d] no stars, sharpness %.1f (%.1fms)", seq, m.sharpness,
+             (t1.tv_sec - t0.tv_sec) * 1E3 + (t1.tv_nsec - t0.tv_nsec) * 1E-6);
+    *mp = m;
 }
 
-bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
+void preview (sbig_ccd_t *ccd)
 {
-    int e;
-    int flags = START_SKIP_VDD;
     sbfits_t *sbf;
-    const char *tmpdir = getenv ("TMPDIR");
-    if (!tmpdir)
-        tmpdir = "/tmp";
 
     sbf = sbfits_create ();
-    if (sbfits_create_file (sbf, tmpdir, "FOCUS") < 0)
-        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    sbfits_set_ccdinfo (sbf, ccd);
+    msg ("previewing image");
+    if (sbfits_preview (sbf) < 0)
+        msg ("preview: %s", sbfits_get_errstr (sbf));
+    sbfits_destroy (sbf);
+}
+
+bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt, int seq,
+           sbig_focus_metrics_t *m)
+{
+    int e;
+    int flags = START_SKIP_VDD;
 
     if ((e = sbig_ccd_set_shutter_mode (ccd, SC_OPEN_SHUTTER)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_set_shutter_mode: %s", sbig_get_error_string (sb, e));
@@ -265,42 +307,123 @@ bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
             msg_exit ("sbig_ccd_color_convert: %s",
                       sbig_get_error_string (sb, e));
     }
-    sbfits_set_ccdinfo (sbf, ccd);
-    if (sbfits_write_file (sbf) < 0)
-        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
-    if (sbfits_close_file (sbf))
-        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
-
-    msg ("previewing image");
-    preview_ds9 (sbf);
-    (void)unlink (sbfits_get_filename (sbf));
-    sbfits_destroy (sbf);
+    print_metrics (sb, ccd, seq, m);
+    if (opt->preview)
+        preview (ccd);
     return true;
 abort:
     (void)sbig_ccd_end_exposure (ccd, ABORT_DONT_END);
-    (void)unlink (sbfits_get_filename (sbf));
-    sbfits_destroy (sbf);
     return false;
 }
 
-void snap_series (sbig_t *sb, const struct options *opt)
+void set_readout_mode (sbig_t *sb, sbig_ccd_t *ccd,
+                       READOUT_BINNING_MODE mode)
 {
     int e;
+
+    if ((e = sbig_ccd_set_readout_mode (ccd, mode)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+}
+
+/* Read out an opt->roi box centered on (cy, cx) in the full frame,
+ * moved inside the frame if need be.
+ */
+void set_roi (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+              double cy, double cx)
+{
+    ushort top, left, height, width;
+    int y, x, h, w, e;
+
+    set_readout_mode (sb, ccd, opt->readout_mode);
+    if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_window: %s", sbig_get_error_string (sb, e));
+    h = opt->roi < height ? opt->roi : height;
+    w = opt->roi < width ? opt->roi : width;
+    y = lround (cy - h / 2.0);
+    x = lround (cx - w / 2.0);
+    y = y < 0 ? 0 : y > height - h ? height - h : y;
+    x = x < 0 ? 0 : x > width - w ? width - w : x;
+    if ((e = sbig_ccd_set_window (ccd, y, x, h, w)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_window: %s", sbig_get_error_string (sb, e));
+}
+
+/* With --auto-roi, take a lo resolution full frame and find the
+ * brightest unsaturated star in it.  Its position (cy, cx) is returned in
+ * pixels of the focusing readout mode.
+ */
+bool acquire (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
+              int seq, double *cy, double *cx)
+{
+    ushort top, left, height, width, acq_height, acq_width;
+    sbig_focus_metrics_t m;
+
+    set_readout_mode (sb, ccd, opt->readout_mode);
+    (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
+    if (sbig_ccd_set_readout_mode (ccd, RM_3X3) != CE_NO_ERROR)
+        set_readout_mode (sb, ccd, opt->readout_mode);
+    (void)sbig_ccd_get_window (ccd, &top, &left, &acq_height, &acq_width);
+    if (opt->verbose)
+        msg ("[%d] acquiring star in %dx%d frame", seq, acq_width, acq_height);
+    if (!snap (sb, ccd, opt, seq, &m))
+        return false;
+    if (m.stars == 0)
+        return false;
+    *cy = (m.y + 0.5) * height / acq_height - 0.5;
+    *cx = (m.x + 0.5) * width / acq_width - 0.5;
+    return true;
+}
+
+void snap_series (sbig_t *sb, const struct options *opt)
+{
+    int e, seq = 0;
     sbig_ccd_t *ccd;
+    sbig_focus_metrics_t m;
+    bool tracking = false;
+    double cy, cx;
 
     if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
     if ((e = sbig_ccd_end_exposure (ccd, ABORT_DONT_END)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
-    if ((e = sbig_ccd_set_readout_mode (ccd, opt->readout_mode)) != CE_NO_ERROR)
-        msg_exit ("sbig_ccd_set_readout_mode: %s", sbig_get_error_string (sb, e));
+    set_readout_mode (sb, ccd, opt->readout_mode);
     if (opt->partial < 1.0) {
         if ((e = sbig_ccd_set_partial_frame (ccd, opt->partial)) != CE_NO_ERROR)
             msg_exit ("sbig_ccd_set_partial_frame: %s", sbig_get_error_string (sb, e));
     }
     msg ("Type ctrl-C to interrupt");
     while (!interrupted) {
-        snap (sb, ccd, opt);
+        if (!opt->roi) {
+            snap (sb, ccd, opt, seq++, &m);
+            continue;
+        }
+        /* Find the star, then follow it with the box, recentering when it
+         * drifts more than a tenth of the box off center.
+         */
+        if (!tracking) {
+            if (!acquire (sb, ccd, opt, seq++, &cy, &cx))
+                continue;
+            set_roi (sb, ccd, opt, cy, cx);
+            tracking = true;
+        }
+        if (!snap (sb, ccd, opt, seq++, &m))
+            continue;
+        if (m.stars == 0) {
+            msg ("[%d] lost star, reacquiring", seq - 1);
+            tracking = false;
+        } else {
+            ushort top, left, height, width;
+
+            (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
+            if (fabs (top + m.y - cy) > opt->roi / 10.0
+                    || fabs (left + m.x - cx) > opt->roi / 10.0) {
+                cy = top + m.y;
+                cx = left + m.x;
+                if (opt->verbose)
+                    msg ("[%d] recentering on %.0f,%.0f", seq - 1, cx, cy);
+                set_roi (sb, ccd, opt, cy, cx);
+            }
+        }
     }
 
     sbig_ccd_destroy (ccd);
@@ -0,0 +1,236 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Follow the live frame ring published by sbig-snap --live.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libsbig/sbfits.h"
+
+struct options {
+    int count;
+    char *imagedir;
+    bool preview;
+};
+
+static bool interrupted = false;
+
+#define OPTIONS "hn:d:P"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"count",         required_argument,     0, 'n'},
+    {"image-directory", required_argument,   0, 'd'},
+    {"preview",       no_argument,           0, 'P'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-live [OPTIONS] [NAME]\n"
+"  -n, --count N              exit after N images\n"
+"  -d, --image-directory DIR  write each image to a FITS file in DIR\n"
+"  -P, --preview              preview each image using ds9\n"
+);
+    exit (1);
+}
+
+void handle_sigint (int signal)
+{
+    interrupted = true;
+}
+
+const char *prefix (sbfits_t *sbf)
+{
+    switch (sbfits_get_imagetype (sbf)) {
+        case SBFITS_TYPE_DF:
+            return "DF";
+        case SBFITS_TYPE_BF:
+            return "BF";
+        case SBFITS_TYPE_FF:
+            return "FF";
+        default:
+            return "LF";
+    }
+}
+
+/* Summarize image 'seq' in place, without copying it out of the ring.
+ * Returns false if it was overwritten first.
+ */
+bool print_stats (sbig_ring_t *ring, uint64_t seq, sbig_frame_stats_t *st)
+{
+    const ushort *data;
+    ushort height, width;
+    int row;
+
+    if (!(data = sbig_ring_peek (ring, seq, NULL, NULL, &height, &width)))
+        return false;
+    sbig_stats_init (st, 65535, SBIG_STATS_HOT_DELTA);
+    for (row = 0; row < height; row++)
+        sbig_stats_add_row (st, data + (size_t)row * width, width);
+    if (sbig_ring_check (ring, seq) < 0)
+        return false;
+    sbig_stats_finish (st);
+    msg ("[%llu] %ux%u min %u max %u mean %.1f stddev %.1f",
+         (unsigned long long)seq, width, height, st->min, st->max,
+         st->mean, st->stddev);
+    return true;
+}
+
+/* Copy image 'seq' out of the ring, then write it and/or preview it.
+ */
+bool save (sbig_ring_t *ring, uint64_t seq, const struct options *opt)
+{
+    sbfits_t *sbf = sbfits_create ();
+
+    if (sbfits_ring_read (ring, seq, sbf) < 0) {
+        sbfits_destroy (sbf);
+        return false;
+    }
+    if (opt->imagedir) {
+        if (sbfits_create_file (sbf, opt->imagedir, prefix (sbf)) < 0)
+            msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                      sbfits_get_errstr (sbf));
+        if (sbfits_write_file (sbf) < 0)
+            msg_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+        if (sbfits_close_file (sbf) < 0)
+            msg_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+        msg ("wrote %s", sbfits_get_filename (sbf));
+    } else if (opt->preview) {
+        if (sbfits_preview (sbf) < 0)
+            msg ("preview: %s", sbfits_get_errstr (sbf));
+    }
+    sbfits_destroy (sbf);
+    return true;
+}
+
+int main (int argc, char *argv[])
+{
+    struct options *opt;
+    const char *name = SBIG_RING_NAME;
+    sbig_ring_t *ring;
+    sbig_frame_stats_t *st;
+    struct sigaction sa;
+    uint64_t seq, head;
+    int ch, n = 0;
+
+    log_init ("sbig-live");
+
+    opt = xzmalloc (sizeof (*opt));
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'n': /* --count N */
+                opt->count = strtoul (optarg, NULL, 10);
+                if (opt->count < 1)
+                    msg_exit ("error parsing --count argument");
+                break;
+            case 'd': /* --image-directory DIR */
+                free (opt->imagedir);
+                opt->imagedir = xstrdup (optarg);
+                break;
+            case 'P': /* --preview */
+                opt->preview = true;
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind < argc - 1)
+        usage ();
+    if (optind == argc - 1)
+        name = argv[optind];
+    if (opt->imagedir && opt->preview)
+        msg_exit ("--image-directory cannot be used with --preview");
+
+    sa.sa_handler = &handle_sigint;
+    sa.sa_flags = 0;
+    sigfillset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0)
+        err_exit ("sigaction");
+    sa.sa_handler = SIG_IGN;
+    if (sigaction (SIGPIPE, &sa, NULL) < 0)
+        err_exit ("sigaction");
+
+    if (!(ring = sbig_ring_open (name)))
+        err_exit ("%s", name);
+    st = xzmalloc (sizeof (*st));
+
+    /* Start with the newest image, if there is one, and skip ahead to
+     * the newest each time, since the writer does not wait for us.
+     */
+    seq = sbig_ring_head (ring);
+    if (seq > 0)
+        seq--;
+    while (!interrupted && (opt->count == 0 || n < opt->count)) {
+        if ((head = sbig_ring_wait (ring, seq, -1)) == 0) {
+            if (errno == EPIPE) {
+                msg ("%s: writer has finished", name);
+                break;
+            }
+            if (errno == EINTR)
+                continue;
+            err_exit ("%s", name);
+        }
+        if (seq > 0 && head > seq + 1)
+            msg ("skipped %llu images", (unsigned long long)(head - seq - 1));
+        seq = head;
+        if (!print_stats (ring, seq, st)
+                        || ((opt->imagedir || opt->preview)
+                                            && !save (ring, seq, opt))) {
+            msg ("[%llu] overwritten before it could be read",
+                 (unsigned long long)seq);
+            continue;
+        }
+        n++;
+    }
+
+    free (st);
+    sbig_ring_destroy (ring);
+    free (opt->imagedir);
+    free (opt);
+    log_fini ();
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -74,13 +74,31 @@ struct options {
     snap_type_t image_type;
     bool no_cooler;
     char *color_convert;
+    bool double_buffer;
+    int writer_threads;
+    sbfits_compress_t compress;
+    bool mef;
+    char *spool;
+    char *live;
+    char *darklib;
+    sbig_darklib_t *darks;      /* masters loaded from darklib */
+    char *bias;
+    char *flat;
+    char *badpix;
+    sbig_calib_t *calib;        /* light frame calibration, if any */
+    int coadd;
+    sbig_coadd_t *sum;          /* with coadd > 1, exposures so far */
+    ushort *coadd_data;         /* the mean of them */
+    bool register_frames;
+    sbig_register_t *reg;       /* aligns exposures to the series' first */
 };
 
 const char *software_name = PACKAGE_NAME "-" PACKAGE_VERSION;
 const double TE_stable = 3.0; /* degrees C allowable diff from setpoint */
+const double exposure_timeout = 60.0; /* seconds allowed past exposure end */
 static bool interrupted = false;
 
-#define OPTIONS "ht:d:C:r:n:D:m:O:fp:PT:cx:"
+#define OPTIONS "ht:d:C:r:n:D:m:O:fp:PT:cx:bW:z::MS:l::L:B:F:K:a:R"
 static const struct option longopts[] = {
     {"help",          no_argument,           0, 'h'},
     {"exposure-time", required_argument,     0, 't'},
@@ -97,6 +115,18 @@ static const struct option longopts[] = {
     {"image-type",    required_argument,     0, 'T'},
     {"no-cooler",     no_argument,           0, 'c'},
     {"color-convert", required_argument,     0, 'x'},
+    {"double-buffer", no_argument,           0, 'b'},
+    {"writer-threads", required_argument,    0, 'W'},
+    {"compress",      optional_argument,     0, 'z'},
+    {"mef",           no_argument,           0, 'M'},
+    {"spool",         required_argument,     0, 'S'},
+    {"live",          optional_argument,     0, 'l'},
+    {"dark-library",  required_argument,     0, 'L'},
+    {"bias",          required_argument,     0, 'B'},
+    {"flat",          required_argument,     0, 'F'},
+    {"bad-pixels",    required_argument,     0, 'K'},
+    {"coadd",         required_argument,     0, 'a'},
+    {"register",      no_argument,           0, 'R'},
     {0, 0, 0, 0},
 };
 
@@ -123,6 +153,24 @@ void usage (void)
 "  -T, --image-type TYPE      take df, lf, or auto (default auto)\n"
 "  -c, --no-cooler            allow TE to be disabled/unstable\n"
 "  -x, --color-convert=mono   convert raw single shot color to monochrome\n"
+"  -b, --double-buffer        write each file while taking the next image\n"
+"  -W, --writer-threads N     with -b, write up to N files at once (default 1)\n"
+"  -z, --compress[=TYPE]      tile compress FITS: rice (default), hcompress,\n"
+"                             gzip, or none\n"
+"  -M, --mef                  write the series to one multi-extension FITS\n"
+"                             file, one extension per image\n"
+"  -S, --spool FILE           dump raw images to FILE, for sbig spool2fits\n"
+"  -l, --live[=NAME]          publish images to shared memory ring NAME\n"
+"                             (default sbig), for sbig live\n"
+"  -L, --dark-library DIR     with -T auto, subtract matching master darks\n"
+"                             from DIR instead of taking a dark each time\n"
+"  -B, --bias FILE            subtract master bias from light frames taken\n"
+"                             without a dark\n"
+"  -F, --flat FILE            divide light frames by master flat\n"
+"  -K, --bad-pixels FILE      interpolate over pixels that are nonzero in FILE\n"
+"  -a, --coadd N              average N exposures into each image\n"
+"  -R, --register             with -a, align exposures to the first of the\n"
+"                             series before adding them\n"
 );
     exit (1);
 }
@@ -162,6 +210,8 @@ int main (int argc, char *argv[])
     opt->verbose = true;
     opt->partial = 1.0;
     opt->image_type = SNAP_AUTO;
+    opt->writer_threads = 1;
+    opt->coadd = 1;
 
     /* Override defaults with config file
      */
@@ -247,6 +297,55 @@ int main (int argc, char *argv[])
                 free (opt->color_convert);
                 opt->color_convert = xstrdup (optarg);
                 break;
+            case 'b': /* --double-buffer */
+                opt->double_buffer = true;
+                break;
+            case 'W': /* --writer-threads N */
+                opt->writer_threads = strtoul (optarg, NULL, 10);
+                if (opt->writer_threads < 1)
+                    msg_exit ("error parsing --writer-threads argument");
+                break;
+            case 'z': /* --compress[=TYPE] */
+                if (!optarg)
+                    opt->compress = SBFITS_COMPRESS_RICE;
+                else if (sbfits_compress_parse (optarg, &opt->compress) < 0)
+                    msg_exit ("error parsing --compress argument");
+                break;
+            case 'M': /* --mef */
+                opt->mef = true;
+                break;
+            case 'S': /* --spool FILE */
+                free (opt->spool);
+                opt->spool = xstrdup (optarg);
+                break;
+            case 'l': /* --live[=NAME] */
+                free (opt->live);
+                opt->live = xstrdup (optarg ? optarg : SBIG_RING_NAME);
+                break;
+            case 'L': /* --dark-library DIR */
+                free (opt->darklib);
+                opt->darklib = xstrdup (optarg);
+                break;
+            case 'B': /* --bias FILE */
+                free (opt->bias);
+                opt->bias = xstrdup (optarg);
+                break;
+            case 'F': /* --flat FILE */
+                free (opt->flat);
+                opt->flat = xstrdup (optarg);
+                break;
+            case 'K': /* --bad-pixels FILE */
+                free (opt->badpix);
+                opt->badpix = xstrdup (optarg);
+                break;
+            case 'a': /* --coadd N */
+                opt->coadd = strtoul (optarg, NULL, 10);
+                if (opt->coadd < 1 || opt->coadd > SBIG_COADD_MAX)
+                    msg_exit ("error parsing --coadd argument");
+                break;
+            case 'R': /* --register */
+                opt->register_frames = true;
+                break;
             case 'h': /* --help */
             default:
                 usage ();
@@ -254,6 +353,16 @@ int main (int argc, char *argv[])
     }
     if (optind != argc)
         usage ();
+    if (opt->mef && (opt->double_buffer || opt->preview))
+        msg_exit ("--mef cannot be used with --double-buffer or --preview");
+    if (opt->spool && (opt->mef || opt->double_buffer || opt->preview
+                                || opt->compress != SBFITS_COMPRESS_NONE))
+        msg_exit ("--spool cannot be used with --mef, --double-buffer,"
+                  " --preview, or --compress");
+    if (opt->image_type == SNAP_DF && (opt->bias || opt->flat || opt->badpix))
+        msg_exit ("--bias, --flat, and --bad-pixels apply only to light frames");
+    if (opt->register_frames && (opt->coadd <= 1 || opt->image_type == SNAP_DF))
+        msg_exit ("--register applies only to co-added light frames");
 
     /* Verify we have all the info we need for a complete FITS header.
      */
@@ -340,6 +449,12 @@ done:
         if (opt->cfw[i])
             free (opt->cfw[i]);
     }
+    free (opt->spool);
+    free (opt->live);
+    free (opt->darklib);
+    free (opt->bias);
+    free (opt->flat);
+    free (opt->badpix);
     free (opt);
 
     sbig_destroy (sb);
@@ -357,6 +472,12 @@ int config_cb (void *user, const char *section, const char *name,
             if (opt->imagedir)
                 free (opt->imagedir);
             opt->imagedir = xstrdup (value);
+        } else if (!strcmp (name, "compress")) {
+            if (sbfits_compress_parse (value, &opt->compress) < 0)
+                msg ("%s: unknown compression type", value);
+        } else if (!strcmp (name, "darklib")) {
+            free (opt->darklib);
+            opt->darklib = xstrdup (value);
         }
     } else if (!strcmp (section, "cfw")) {
         int slot;
@@ -392,33 +513,53 @@ int config_cb (void *user, const char *section, const char *name,
     return 0; /* 0=success, 1=error */
 }
 
+bool check_interrupted (void *arg)
+{
+    return interrupted;
+}
+
 /* Wait for an exposure in progress to complete.
- * We avoid polling the camera excessively.
  */
 bool exposure_wait (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt)
 {
-    PAR_COMMAND_STATUS status;
     int e;
 
-    usleep (1E6 * opt->t);
-    do {
-        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
-            msg_exit ("sbig_get_exposure_status: %s", sbig_get_error_string (sb, e));
-        if (status != CS_INTEGRATION_COMPLETE)
-            usleep (1E3 * 500); /* 500ms */
-    } while (status != CS_INTEGRATION_COMPLETE && !interrupted);
+    e = sbig_ccd_wait_exposure (ccd, exposure_timeout, check_interrupted, NULL);
+    if (e == CE_KBD_ESC)
+        return false;
+    if (e != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_wait_exposure: %s", sbig_get_error_string (sb, e));
+    return true;
+}
 
-    return !interrupted;
+/* Readout row callback that streams each row into the FITS file,
+ * so the image is written while the rest of the frame is transferred.
+ * A write error aborts the readout, which the caller reports.
+ */
+int write_row (ushort row, ushort *data, ushort width, void *arg)
+{
+    sbfits_t *sbf = arg;
+
+    if (sbfits_write_rows (sbf, row, 1, data) < 0) {
+        msg ("sbfits_write: %s", sbfits_get_errstr (sbf));
+        return CE_BAD_PARAMETER;
+    }
+    return CE_NO_ERROR;
 }
 
 /* Take a picture:
  * SNAP_DF: take a dark frame
  * SNAP_LF: take a light frame
  * SNAP_AUTO: take a light frame, subtracting previous DF during readout
+ * If 'sbf' is non-NULL and the image needs no further processing,
+ * the image data is written to it during readout.
+ * Light frames are calibrated as rows arrive if there is calibration,
+ * with 'dark' (if non-NULL) subtracted on the host.
  */
 bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
-           snap_type_t type, int seq)
+           snap_type_t type, int seq, sbfits_t *sbf, const ushort *dark)
 {
+    int flags = 0;
     int e;
 
     /* Set shutter mode
@@ -442,18 +583,35 @@ bool snap (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
 
     /* Finalize exposure, then read out from camera to sbig_ccd_t internal
      * buffer.  Subtract a previous DF left there if type is SNAP_AUTO.
+     * The previous exposure may still be being co-added from the buffer.
      */
     if ((e = sbig_ccd_end_exposure (ccd, 0)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_end_exposure: %s", sbig_get_error_string (sb, e));
+    if (opt->sum)
+        sbig_coadd_wait (opt->sum);
     if (opt->verbose)
-        msg ("[%d]readout: %s%s", seq, type == SNAP_DF ? "DF" : "LF",
-             type == SNAP_AUTO ? " (subtracted)" : "");
+        msg ("[%d]readout: %s%s%s", seq, type == SNAP_DF ? "DF" : "LF",
+             type == SNAP_AUTO || dark ? " (subtracted)" : "",
+             type != SNAP_DF && opt->calib ? " (calibrated)" : "");
     if (type == SNAP_AUTO)
-        e = sbig_ccd_readout_subtract (ccd);
-    else
-        e = sbig_ccd_readout (ccd);
+        flags |= SBIG_READOUT_SUBTRACT;
+    if (type != SNAP_DF && opt->calib) {
+        sbig_calib_set_dark (opt->calib, dark);
+        flags |= SBIG_READOUT_CALIBRATE;
+    }
+    if (sbf && !(opt->color_convert && type != SNAP_DF)) {
+        sbfits_set_ccdinfo (sbf, ccd);
+        e = sbig_ccd_readout_pipelined (ccd, flags, write_row, sbf);
+    } else
+        e = sbig_ccd_readout_pipelined (ccd, flags, NULL, NULL);
     if (e != CE_NO_ERROR)
         msg_exit ("sbig_ccd_readout: %s", sbig_get_error_string (sb, e));
+    if (opt->verbose) {
+        sbig_readout_timing_t t;
+        (void)sbig_ccd_get_readout_timing (ccd, &t);
+        msg ("[%d]readout: %d rows in %.2fs (%d chunks, %.1f-%.1fms each)",
+             seq, t.rows, t.total, t.chunks, t.min * 1E3, t.max * 1E3);
+    }
 
     if (opt->color_convert && type != SNAP_DF) {
         if (opt->verbose)
@@ -486,7 +644,7 @@ void update_fitsheader (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd,
                         const struct options *opt,
                         double temp_setpoint, double temp)
 {
-    long cwhite, cblack;
+    sbig_frame_stats_t st;
     int e;
     CFW_POSITION cfw_pos = CFWP_UNKNOWN;
 
@@ -515,12 +673,11 @@ void update_fitsheader (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd,
     sbfits_set_site (sbf, opt->sitename, opt->latitude, opt->longitude,
                      opt->elevation);
     sbfits_set_swcreate (sbf, software_name);
-    sbfits_set_contrast (sbf, cblack, cwhite);
     sbfits_set_imagetype (sbf, opt->image_type == SNAP_DF ? SBFITS_TYPE_DF
                                                           : SBFITS_TYPE_LF);
-    if ((e = sbig_ccd_auto_contrast (ccd, &cwhite, &cblack)) != CE_NO_ERROR)
-        msg_exit ("sbig_ccd_auto_contrast: %s", sbig_get_error_string (sb, e));
-    sbfits_set_contrast (sbf, cblack, cwhite);
+    if ((e = sbig_ccd_get_stats (ccd, &st)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_stats: %s", sbig_get_error_string (sb, e));
+    sbfits_set_stats (sbf, &st);
     sbfits_set_pedestal (sbf, 0); /* update if DF subtracted */
 }
 
@@ -546,122 +703,362 @@ void preview_ds9 (sbfits_t *sbf)
     free (cmd);
 }
 
+void write_fits (sbfits_t *sbf, const struct options *opt)
+{
+    if (sbfits_write_file (sbf) < 0)
+        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+    if (sbfits_close_file (sbf))
+        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+    if (opt->verbose)
+        msg ("wrote %s", sbfits_get_filename (sbf));
+    if (opt->preview)
+        preview_ds9 (sbf);
+}
+
+/* Completion callback for the async writer (runs in a writer thread).
+ */
+void write_done (sbfits_t *sbf, int rc, void *arg)
+{
+    const struct options *opt = arg;
+
+    if (rc < 0) {
+        msg ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+        return;
+    }
+    if (opt->verbose)
+        msg ("wrote %s", sbfits_get_filename (sbf));
+    if (opt->preview)
+        preview_ds9 (sbf);
+}
+
+/* Where finished images go: each to its own file, written now or by
+ * an async writer, appended to a multi-extension series file, or dumped
+ * raw to a spool.  They may also be published to a live frame ring.
+ */
+struct output {
+    sbfits_writer_t *w;
+    sbfits_series_t *ser;
+    sbig_spool_t *spool;
+    sbig_ring_t *ring;
+};
+
+/* Write the finished image now, queue it if there is an async writer,
+ * or append it to the series or spool.  Either way, 'sbf' is consumed.
+ */
+void finish (sbfits_t *sbf, const struct options *opt, struct output *out)
+{
+    if (out->ring && sbfits_ring_publish (out->ring, sbf) < 0)
+        msg_exit ("%s: %s", opt->live, sbfits_get_errstr (sbf));
+    if (out->spool) {
+        if (sbfits_spool_append (out->spool, sbf) < 0)
+            msg_exit ("%s: %s", opt->spool, sbfits_get_errstr (sbf));
+        if (opt->verbose)
+            msg ("spooled %s[%d]", opt->spool,
+                 sbig_spool_count (out->spool) - 1);
+        sbfits_destroy (sbf);
+    } else if (out->ser) {
+        if (sbfits_series_append (out->ser, sbf) < 0)
+            msg_exit ("%s: %s", sbfits_series_get_filename (out->ser),
+                      sbfits_series_get_errstr (out->ser));
+        if (opt->verbose)
+            msg ("wrote %s[%d]", sbfits_series_get_filename (out->ser),
+                 sbfits_series_count (out->ser));
+        sbfits_destroy (sbf);
+    } else if (out->w)
+        sbfits_writer_submit (out->w, sbf);
+    else {
+        write_fits (sbf, opt);
+        sbfits_destroy (sbf);
+    }
+}
+
+/* Abandon an image that was not taken.
+ */
+void discard (sbfits_t *sbf, struct output *out)
+{
+    if (!out->ser && !out->spool)
+        (void)unlink (sbfits_get_filename (sbf));
+    sbfits_destroy (sbf);
+}
+
+/* Images appended to a series or spool need no file of their own.
+ */
+sbfits_t *create_fits (const struct options *opt, const char *prefix,
+                       struct output *out)
+{
+    sbfits_t *sbf = sbfits_create ();
+
+    if (!out->ser && !out->spool && sbfits_create_file (sbf, opt->imagedir, prefix) < 0)
+        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    sbfits_set_compress (sbf, opt->compress);
+    return sbf;
+}
+
+/* Rows are streamed to the file during readout, unless the file will be
+ * written later by the async writer, the image is appended to a series
+ * or spool, it is Rice compressed in parallel, or it is co-added.
+ */
+sbfits_t *stream_target (sbfits_t *sbf, const struct options *opt,
+                         struct output *out)
+{
+    if (out->w || out->ser || out->spool || opt->compress == SBFITS_COMPRESS_RICE
+                                         || opt->coadd > 1)
+        return NULL;
+    return sbf;
+}
+
+/* Record the calibration of a light frame in the FITS header.  The bias
+ * is only subtracted from frames that were not dark subtracted.
+ */
+void add_calib_history (sbfits_t *sbf, const struct options *opt,
+                        bool dark_subtracted)
+{
+    if (!opt->calib)
+        return;
+    if (!dark_subtracted && sbig_calib_has_offset (opt->calib)) {
+        sbfits_add_history (sbf, software_name, "Bias Subtraction");
+        sbfits_set_pedestal (sbf, -SBIG_CALIB_PEDESTAL);
+    }
+    if (sbig_calib_has_flat (opt->calib))
+        sbfits_add_history (sbf, software_name, "Flat Field Correction");
+    if (sbig_calib_count_badpix (opt->calib) > 0)
+        sbfits_add_history (sbf, software_name, "Bad Pixel Correction");
+}
+
+/* With --coadd, start adding the exposure just read out to the sum.
+ * This goes on during the next exposure, until snap() reads it out.
+ */
+void coadd (sbig_ccd_t *ccd, const struct options *opt)
+{
+    ushort height, width;
+
+    if (opt->coadd > 1) {
+        if (sbig_coadd_add (opt->sum, sbig_ccd_get_data (ccd, &height,
+                                                         &width)) < 0)
+            err_exit ("sbig_coadd_add");
+    }
+}
+
+/* With --coadd, replace the last exposure in the FITS header with the
+ * mean of all of them, starting at 'start', and their total exposure time.
+ * With --register, exposures that did not register are not counted, and
+ * if none did the last exposure is kept as is.
+ */
+void update_coadd (sbig_t *sb, sbfits_t *sbf, sbig_ccd_t *ccd,
+                   const struct options *opt, int seq, time_t start)
+{
+    sbig_frame_stats_t st;
+    ushort top, left, height, width, datamax;
+    int e, i, count;
+
+    if (opt->coadd <= 1)
+        return;
+    count = sbig_coadd_count (opt->sum);
+    if (opt->reg) {
+        double dy, dx;
+
+        if (count == 0) {
+            msg ("[%d]coadd: no exposures registered, keeping the last", seq);
+            return;
+        }
+        if (opt->verbose) {
+            if (sbig_coadd_get_shift (opt->sum, &dy, &dx))
+                msg ("[%d]coadd: %d of %d exposures registered,"
+                     " last shifted %.2f,%.2f", seq, count, opt->coadd, dx, dy);
+            else
+                msg ("[%d]coadd: %d of %d exposures registered",
+                     seq, count, opt->coadd);
+        }
+    }
+    if (sbig_coadd_finish (opt->sum, opt->coadd_data) < 0)
+        err_exit ("sbig_coadd_finish");
+    if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_window: %s", sbig_get_error_string (sb, e));
+    if ((e = sbig_ccd_get_datamax (ccd, &datamax)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_datamax: %s", sbig_get_error_string (sb, e));
+    sbig_stats_init (&st, datamax, SBIG_STATS_HOT_DELTA);
+    for (i = 0; i < height; i++)
+        sbig_stats_add_row (&st, opt->coadd_data + (size_t)i * width, width);
+    sbig_stats_finish (&st);
+    sbfits_set_data (sbf, opt->coadd_data);
+    sbfits_set_stats (sbf, &st);
+    sbfits_set_exposure (sbf, start, opt->t * count);
+    sbfits_set_num_exposures (sbf, count);
+    sbfits_add_history (sbf, software_name, opt->reg
+                        ? "Mean of registered exposures"
+                        : "Mean of co-added exposures");
+}
+
 void snap_one_autodark (sbig_t *sb, sbig_ccd_t *ccd,
-                        const struct options *opt, int seq)
+                        const struct options *opt, int seq,
+                        struct output *out)
 {
     double temp, setpoint;
     sbfits_t *sbf;
+    const ushort *dark = NULL;
+    time_t start = 0;
+    int i;
 
     /* Create FITS file for output.
      */
-    sbf = sbfits_create ();
-    if (sbfits_create_file (sbf, opt->imagedir, "LF") < 0)
-        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    sbf = create_fits (opt, "LF", out);
 
-    /* Take DF, LF
+    /* If there is a master dark for this exposure time and temperature,
+     * take just the LF and subtract the dark on the host.
      */
-    if (!snap (sb, ccd, opt, SNAP_DF, seq))
-        goto abort;
-    get_temp (sb, &temp, &setpoint); /* get temp for FITS */
-    if (!snap (sb, ccd, opt, SNAP_AUTO, seq))
-        goto abort;
+    if (opt->darks) {
+        sbig_dark_key_t key;
+
+        get_temp (sb, &temp, &setpoint);
+        if (sbig_dark_key_ccd (ccd, opt->t, temp, &key) == CE_NO_ERROR)
+            dark = sbig_darklib_find (opt->darks, &key);
+    }
+    for (i = 0; i < opt->coadd; i++) {
+        if (dark) {
+            if (!snap (sb, ccd, opt, SNAP_LF, seq,
+                       stream_target (sbf, opt, out), dark))
+                goto abort;
+        } else {
+            /* Take DF, LF
+             */
+            if (!snap (sb, ccd, opt, SNAP_DF, seq, NULL, NULL))
+                goto abort;
+            if (i == 0)
+                get_temp (sb, &temp, &setpoint); /* get temp for FITS */
+            if (!snap (sb, ccd, opt, SNAP_AUTO, seq,
+                       stream_target (sbf, opt, out), NULL))
+                goto abort;
+        }
+        if (i == 0)
+            start = sbig_ccd_get_start_time (ccd);
+        coadd (ccd, opt);
+    }
 
     /* Write out FITS file, optionally preview
      */
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    update_coadd (sb, sbf, ccd, opt, seq, start);
     sbfits_add_history (sbf, software_name, "Dark Subtraction");
+    add_calib_history (sbf, opt, true);
     if (opt->color_convert)
         sbfits_add_history (sbf, software_name, "One shot color conversion");
-    sbfits_set_pedestal (sbf, -100); /* readout_subtract does this */
-    if (sbfits_write_file (sbf) < 0)
-        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
-    if (sbfits_close_file (sbf))
-        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
-    if (opt->verbose)
-        msg ("wrote %s", sbfits_get_filename (sbf));
-    if (opt->preview) {
-        if (opt->verbose)
-            msg ("preview");
-        preview_ds9 (sbf);
-    }
-    sbfits_destroy (sbf);
+    sbfits_set_pedestal (sbf, -SBIG_CALIB_PEDESTAL); /* both subtractions add it */
+    finish (sbf, opt, out);
     return;
 abort:
-    (void)unlink (sbfits_get_filename (sbf));
-    sbfits_destroy (sbf);
+    discard (sbf, out);
 }
 
 void snap_one_df (sbig_t *sb, sbig_ccd_t *ccd,
-                  const struct options *opt, int seq)
+                  const struct options *opt, int seq, struct output *out)
 {
     double temp, setpoint;
     sbfits_t *sbf;
+    time_t start = 0;
+    int i;
 
-    sbf = sbfits_create ();
-    if (sbfits_create_file (sbf, opt->imagedir, "DF") < 0)
-        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    sbf = create_fits (opt, "DF", out);
 
     get_temp (sb, &temp, &setpoint);
 
-    if (!snap (sb, ccd, opt, SNAP_DF, seq))
-        goto abort;
+    for (i = 0; i < opt->coadd; i++) {
+        if (!snap (sb, ccd, opt, SNAP_DF, seq, stream_target (sbf, opt, out),
+                   NULL))
+            goto abort;
+        if (i == 0)
+            start = sbig_ccd_get_start_time (ccd);
+        coadd (ccd, opt);
+    }
 
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
-    if (sbfits_write_file (sbf) < 0)
-        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
-    if (sbfits_close_file (sbf))
-        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
-    if (opt->verbose)
-        msg ("wrote %s", sbfits_get_filename (sbf));
-    if (opt->preview)
-        preview_ds9 (sbf);
+    update_coadd (sb, sbf, ccd, opt, seq, start);
+    finish (sbf, opt, out);
     return;
 abort:
-    (void)unlink (sbfits_get_filename (sbf));
-    sbfits_destroy (sbf);
+    discard (sbf, out);
 }
 
 void snap_one_lf (sbig_t *sb, sbig_ccd_t *ccd, const struct options *opt,
-                  int seq)
+                  int seq, struct output *out)
 {
     double temp, setpoint;
     sbfits_t *sbf;
+    time_t start = 0;
+    int i;
 
-    sbf = sbfits_create ();
-    if (sbfits_create_file (sbf, opt->imagedir, "LF") < 0)
-        msg_exit ("%s: %s", sbfits_get_filename (sbf), sbfits_get_errstr (sbf));
+    sbf = create_fits (opt, "LF", out);
 
     get_temp (sb, &temp, &setpoint);
 
-    if (!snap (sb, ccd, opt, SNAP_LF, seq))
-        goto abort;
+    for (i = 0; i < opt->coadd; i++) {
+        if (!snap (sb, ccd, opt, SNAP_LF, seq, stream_target (sbf, opt, out),
+                   NULL))
+            goto abort;
+        if (i == 0)
+            start = sbig_ccd_get_start_time (ccd);
+        coadd (ccd, opt);
+    }
 
     update_fitsheader (sb, sbf, ccd, opt, setpoint, temp);
+    update_coadd (sb, sbf, ccd, opt, seq, start);
+    add_calib_history (sbf, opt, false);
     if (opt->color_convert)
         sbfits_add_history (sbf, software_name, "One shot color conversion");
-    if (sbfits_write_file (sbf) < 0)
-        err_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
-    if (sbfits_close_file (sbf))
-        err_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
-    if (opt->verbose)
-        msg ("wrote %s", sbfits_get_filename (sbf));
-    if (opt->preview)
-        preview_ds9 (sbf);
-    sbfits_destroy (sbf);
+    finish (sbf, opt, out);
     return;
 abort:
-    (void)unlink (sbfits_get_filename (sbf));
+    discard (sbf, out);
+}
+
+/* Read a master frame (or bad pixel map) for calibration, which must be
+ * the size of the readout window.  PEDESTAL is applied.
+ */
+ushort *load_master (const char *path, ushort height, ushort width)
+{
+    sbfits_t *sbf = sbfits_create ();
+    ushort h, w;
+    ushort *data;
+    long pedestal;
+    size_t i, n;
+
+    if (sbfits_open_file (sbf, path) < 0)
+        msg_exit ("%s: %s", path, sbfits_get_errstr (sbf));
+    sbfits_get_size (sbf, &h, &w);
+    if (h != height || w != width)
+        msg_exit ("%s: %hux%hu does not match the %hux%hu readout window",
+                  path, w, h, width, height);
+    n = (size_t)h * w;
+    data = xzmalloc (n * sizeof (ushort));
+    if (sbfits_read_rows (sbf, 0, h, data) < 0)
+        msg_exit ("%s: %s", path, sbfits_get_errstr (sbf));
+    if ((pedestal = sbfits_get_pedestal (sbf)) != 0) {
+        for (i = 0; i < n; i++) {
+            long v = data[i] + pedestal;
+            data[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+        }
+    }
+    if (sbfits_close_file (sbf) < 0)
+        msg_exit ("%s: %s", path, sbfits_get_errstr (sbf));
     sbfits_destroy (sbf);
+    return data;
 }
 
 void snap_series (sbig_t *sb, struct options *opt)
 {
     int e, i;
     sbig_ccd_t *ccd;
+    struct output out = { NULL, NULL, NULL, NULL };
 
     if ((e = sbig_ccd_create (sb, opt->chip, &ccd)) != CE_NO_ERROR)
         msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (sb, e));
 
+    /* Statistics for the FITS header are gathered as rows arrive.
+     */
+    if ((e = sbig_ccd_set_readout_stats (ccd, 1)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_stats: %s",
+                  sbig_get_error_string (sb, e));
+
     /* Abort any in-progress exposure
      */
     if ((e = sbig_ccd_end_exposure (ccd, ABORT_DONT_END)) != CE_NO_ERROR)
@@ -678,19 +1075,172 @@ void snap_series (sbig_t *sb, struct options *opt)
             msg_exit ("sbig_ccd_set_partial_frame: %s", sbig_get_error_string (sb, e));
     }
 
+    /* With --dark-library, master darks replace the per-frame dark
+     * where they match.
+     */
+    if (opt->darklib && opt->image_type == SNAP_AUTO) {
+        if (!(opt->darks = sbig_darklib_create (SBIG_DARKLIB_TEMP_STEP)))
+            err_exit ("sbig_darklib_create");
+        if (sbig_darklib_load_dir (opt->darks, opt->darklib) < 0)
+            msg_exit ("%s", sbig_darklib_get_errstr (opt->darks));
+        if (opt->verbose)
+            msg ("loaded %d master darks from %s",
+                 sbig_darklib_count (opt->darks), opt->darklib);
+    }
+
+    /* With --coadd, each image is the mean of several exposures.
+     */
+    if (opt->coadd > 1) {
+        ushort top, left, height, width;
+
+        if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_window: %s",
+                      sbig_get_error_string (sb, e));
+        if (!(opt->sum = sbig_coadd_create (height, width)))
+            err_exit ("sbig_coadd_create");
+        opt->coadd_data = xzmalloc ((size_t)height * width * sizeof (ushort));
+        if (opt->register_frames) {
+            if (!(opt->reg = sbig_register_create (height, width)))
+                err_exit ("sbig_register_create");
+            sbig_coadd_set_register (opt->sum, opt->reg);
+        }
+    }
+
+    /* Light frames are calibrated row by row during readout.
+     */
+    if (opt->darks || opt->bias || opt->flat || opt->badpix) {
+        ushort top, left, height, width;
+        ushort *data;
+
+        if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_window: %s",
+                      sbig_get_error_string (sb, e));
+        if (!(opt->calib = sbig_calib_create (height, width)))
+            err_exit ("sbig_calib_create");
+        if (opt->bias) {
+            data = load_master (opt->bias, height, width);
+            sbig_calib_set_bias (opt->calib, data);
+            free (data);
+        }
+        if (opt->flat) {
+            data = load_master (opt->flat, height, width);
+            sbig_calib_set_flat (opt->calib, data);
+            free (data);
+        }
+        if (opt->badpix) {
+            data = load_master (opt->badpix, height, width);
+            sbig_calib_set_badpix (opt->calib, data);
+            free (data);
+            if (opt->verbose)
+                msg ("loaded %d bad pixels from %s",
+                     sbig_calib_count_badpix (opt->calib), opt->badpix);
+        }
+        if ((e = sbig_ccd_set_calib (ccd, opt->calib)) != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_set_calib: %s", sbig_get_error_string (sb, e));
+    }
+
+    /* With --double-buffer, each frame is written by a writer thread
+     * while the next exposure is in progress.
+     */
+    if (opt->double_buffer && opt->count > 1) {
+        out.w = sbfits_writer_create (opt->writer_threads,
+                                      opt->writer_threads + 1, write_done, opt);
+        if (!out.w)
+            err_exit ("sbfits_writer_create");
+    }
+
+    /* With --mef, the whole series goes into one file.
+     */
+    if (opt->mef) {
+        out.ser = sbfits_series_create (opt->imagedir,
+                                        opt->image_type == SNAP_DF ? "DF"
+                                                                   : "LF");
+        if (!out.ser)
+            err_exit ("sbfits_series_create");
+    }
+
+    /* With --spool, raw frames are dumped for later conversion,
+     * with space preallocated for the whole series.
+     */
+    if (opt->spool) {
+        ushort top, left, height, width;
+
+        if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_window: %s",
+                      sbig_get_error_string (sb, e));
+        out.spool = sbig_spool_create (opt->spool, height, width, opt->count);
+        if (!out.spool)
+            err_exit ("%s", opt->spool);
+    }
+
+    /* With --live, each image is also published to shared memory for
+     * viewers, which the series never waits for.
+     */
+    if (opt->live) {
+        ushort top, left, height, width;
+
+        if ((e = sbig_ccd_get_window (ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+            msg_exit ("sbig_ccd_get_window: %s",
+                      sbig_get_error_string (sb, e));
+        out.ring = sbig_ring_create (opt->live, height, width,
+                                     SBIG_RING_SLOTS);
+        if (!out.ring)
+            err_exit ("%s", opt->live);
+        if (opt->verbose)
+            msg ("publishing images to %s", opt->live);
+    }
+
     /* Take series of images and write them out as FITS files.
      * Optionally increase the exposure time by time_delta on each exposure.
      */
     for (i = 0; i < opt->count && !interrupted; i++) {
         if (opt->image_type == SNAP_AUTO)
-            snap_one_autodark (sb, ccd, opt, i);
+            snap_one_autodark (sb, ccd, opt, i, &out);
         else if (opt->image_type == SNAP_LF)
-            snap_one_lf (sb, ccd, opt, i);
+            snap_one_lf (sb, ccd, opt, i, &out);
         else if (opt->image_type == SNAP_DF)
-            snap_one_df (sb, ccd, opt, i);
+            snap_one_df (sb, ccd, opt, i, &out);
         opt->t += opt->time_delta;
     }
 
+    if (out.w) {
+        if (sbfits_writer_flush (out.w) > 0)
+            msg_exit ("some FITS files could not be written");
+        sbfits_writer_destroy (out.w);
+    }
+    if (out.ser) {
+        if (sbfits_series_close (out.ser) < 0)
+            msg_exit ("%s: %s", sbfits_series_get_filename (out.ser),
+                      sbfits_series_get_errstr (out.ser));
+        if (sbfits_series_count (out.ser) == 0)
+            (void)unlink (sbfits_series_get_filename (out.ser));
+        else if (opt->verbose)
+            msg ("closed %s (%d images)", sbfits_series_get_filename (out.ser),
+                 sbfits_series_count (out.ser));
+        sbfits_series_destroy (out.ser);
+    }
+    sbig_darklib_destroy (opt->darks);
+    opt->darks = NULL;
+    sbig_calib_destroy (opt->calib);
+    opt->calib = NULL;
+    sbig_coadd_destroy (opt->sum);
+    opt->sum = NULL;
+    free (opt->coadd_data);
+    opt->coadd_data = NULL;
+    sbig_register_destroy (opt->reg);
+    opt->reg = NULL;
+    if (out.spool) {
+        int n = sbig_spool_count (out.spool);
+        if (sbig_spool_close (out.spool) < 0)
+            err_exit ("%s", opt->spool);
+        if (opt->verbose)
+            msg ("closed %s (%d images)", opt->spool, n);
+    }
+    sbig_ring_destroy (out.ring);
     sbig_ccd_destroy (ccd);
 }
 
@@ -0,0 +1,212 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Convert a raw frame spool written by sbig-snap --spool to FITS files.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libsbig/sbfits.h"
+
+struct options {
+    char *imagedir;
+    sbfits_compress_t compress;
+    bool mef;
+    bool remove;
+    bool verbose;
+};
+
+#define OPTIONS "hd:z::Mr"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"image-directory", required_argument,   0, 'd'},
+    {"compress",      optional_argument,     0, 'z'},
+    {"mef",           no_argument,           0, 'M'},
+    {"remove",        no_argument,           0, 'r'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-spool2fits [OPTIONS] SPOOLFILE\n"
+"  -d, --image-directory DIR  where to put images (default: with SPOOLFILE)\n"
+"  -z, --compress[=TYPE]      tile compress FITS: rice (default), hcompress,\n"
+"                             gzip, or none\n"
+"  -M, --mef                  write one multi-extension FITS file\n"
+"  -r, --remove               remove SPOOLFILE once converted\n"
+);
+    exit (1);
+}
+
+const char *prefix (sbfits_t *sbf)
+{
+    switch (sbfits_get_imagetype (sbf)) {
+        case SBFITS_TYPE_DF:
+            return "DF";
+        case SBFITS_TYPE_BF:
+            return "BF";
+        case SBFITS_TYPE_FF:
+            return "FF";
+        default:
+            return "LF";
+    }
+}
+
+/* Write each frame to its own file.  Frames were spooled faster than
+ * one a second, so the frame number goes in the name to keep names unique.
+ */
+void convert_files (sbig_spool_t *sp, const struct options *opt)
+{
+    int i, n = sbig_spool_count (sp);
+
+    for (i = 0; i < n; i++) {
+        sbfits_t *sbf = sbfits_create ();
+        char name[32];
+
+        if (sbfits_spool_read (sp, i, sbf) < 0)
+            msg_exit ("frame %d: %s", i, sbfits_get_errstr (sbf));
+        snprintf (name, sizeof (name), "%s_%04d", prefix (sbf), i);
+        if (sbfits_create_file (sbf, opt->imagedir, name) < 0)
+            msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                      sbfits_get_errstr (sbf));
+        sbfits_set_compress (sbf, opt->compress);
+        if (sbfits_write_file (sbf) < 0)
+            msg_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+        if (sbfits_close_file (sbf) < 0)
+            msg_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+        if (opt->verbose)
+            msg ("wrote %s", sbfits_get_filename (sbf));
+        sbfits_destroy (sbf);
+    }
+}
+
+void convert_mef (sbig_spool_t *sp, const struct options *opt)
+{
+    int i, n = sbig_spool_count (sp);
+    sbfits_series_t *ser = NULL;
+
+    for (i = 0; i < n; i++) {
+        sbfits_t *sbf = sbfits_create ();
+
+        if (sbfits_spool_read (sp, i, sbf) < 0)
+            msg_exit ("frame %d: %s", i, sbfits_get_errstr (sbf));
+        if (!ser && !(ser = sbfits_series_create (opt->imagedir,
+                                                  prefix (sbf))))
+            err_exit ("sbfits_series_create");
+        sbfits_set_compress (sbf, opt->compress);
+        if (sbfits_series_append (ser, sbf) < 0)
+            msg_exit ("%s: %s", sbfits_series_get_filename (ser),
+                      sbfits_series_get_errstr (ser));
+        sbfits_destroy (sbf);
+    }
+    if (ser) {
+        if (sbfits_series_close (ser) < 0)
+            msg_exit ("%s: %s", sbfits_series_get_filename (ser),
+                      sbfits_series_get_errstr (ser));
+        if (opt->verbose)
+            msg ("wrote %s (%d images)", sbfits_series_get_filename (ser),
+                 sbfits_series_count (ser));
+        sbfits_series_destroy (ser);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    struct options *opt;
+    const char *path;
+    sbig_spool_t *sp;
+    int ch;
+
+    log_init ("sbig-spool2fits");
+
+    opt = xzmalloc (sizeof (*opt));
+    opt->verbose = true;
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'd': /* --image-directory DIR */
+                free (opt->imagedir);
+                opt->imagedir = xstrdup (optarg);
+                break;
+            case 'z': /* --compress[=TYPE] */
+                if (!optarg)
+                    opt->compress = SBFITS_COMPRESS_RICE;
+                else if (sbfits_compress_parse (optarg, &opt->compress) < 0)
+                    msg_exit ("error parsing --compress argument");
+                break;
+            case 'M': /* --mef */
+                opt->mef = true;
+                break;
+            case 'r': /* --remove */
+                opt->remove = true;
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc - 1)
+        usage ();
+    path = argv[optind];
+    if (!opt->imagedir) {
+        char *cpy = xstrdup (path);
+        opt->imagedir = xstrdup (dirname (cpy));
+        free (cpy);
+    }
+
+    if (!(sp = sbig_spool_open (path)))
+        err_exit ("%s", path);
+    if (opt->mef)
+        convert_mef (sp, opt);
+    else
+        convert_files (sp, opt);
+    if (sbig_spool_close (sp) < 0)
+        err_exit ("%s", path);
+    if (opt->remove && unlink (path) < 0)
+        err_exit ("%s", path);
+
+    free (opt->imagedir);
+    free (opt);
+    log_fini ();
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,258 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+
+/* Combine bias, dark, or flat frames into a master frame.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libsbig/sbfits.h"
+
+struct options {
+    char *imagedir;
+    sbfits_compress_t compress;
+    sbig_stack_method_t method;
+    double sigma;
+    bool verbose;
+};
+
+#define OPTIONS "hd:z::m:k:"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"image-directory", required_argument,   0, 'd'},
+    {"compress",      optional_argument,     0, 'z'},
+    {"method",        required_argument,     0, 'm'},
+    {"sigma",         required_argument,     0, 'k'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbig-stack [OPTIONS] FILE...\n"
+"  -d, --image-directory DIR  where to put the master (default: with FILE)\n"
+"  -m, --method METHOD        median (default) or clip (sigma clipped mean)\n"
+"  -k, --sigma K              with -m clip, reject pixels more than K\n"
+"                             standard deviations from the median (default 3)\n"
+"  -z, --compress[=TYPE]      tile compress FITS: rice (default), hcompress,\n"
+"                             gzip, or none\n"
+);
+    exit (1);
+}
+
+const char *prefix (sbfits_t *sbf)
+{
+    switch (sbfits_get_imagetype (sbf)) {
+        case SBFITS_TYPE_DF:
+            return "MDF";
+        case SBFITS_TYPE_BF:
+            return "MBF";
+        case SBFITS_TYPE_FF:
+            return "MFF";
+        default:
+            return "MLF";
+    }
+}
+
+int read_rows (int frame, ushort row, ushort count, ushort *data, void *arg)
+{
+    sbfits_t **in = arg;
+
+    if (sbfits_read_rows (in[frame], row, count, data) < 0) {
+        msg ("%s: %s", sbfits_get_filename (in[frame]),
+             sbfits_get_errstr (in[frame]));
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Open the frames and check that they can be combined.  Darks must all
+ * have the same exposure; flats and biases need not.
+ */
+sbfits_t **open_frames (int n, char **paths, double *temperature)
+{
+    sbfits_t **in = xzmalloc (n * sizeof (in[0]));
+    ushort h0, w0, h, w;
+    double setpoint, temp, sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        in[i] = sbfits_create ();
+        if (sbfits_open_file (in[i], paths[i]) < 0)
+            msg_exit ("%s: %s", paths[i], sbfits_get_errstr (in[i]));
+        sbfits_get_size (in[i], &h, &w);
+        sbfits_get_temperature (in[i], &setpoint, &temp);
+        sum += temp;
+        if (i == 0) {
+            h0 = h;
+            w0 = w;
+            continue;
+        }
+        if (h != h0 || w != w0)
+            msg_exit ("%s: %hux%hu, but %s is %hux%hu", paths[i], w, h,
+                      paths[0], w0, h0);
+        if (sbfits_get_imagetype (in[i]) != sbfits_get_imagetype (in[0]))
+            msg_exit ("%s: image type differs from %s", paths[i], paths[0]);
+        if (sbfits_get_pedestal (in[i]) != sbfits_get_pedestal (in[0]))
+            msg_exit ("%s: PEDESTAL differs from %s", paths[i], paths[0]);
+        if (sbfits_get_imagetype (in[0]) == SBFITS_TYPE_DF
+                && fabs (sbfits_get_exposure_time (in[i])
+                       - sbfits_get_exposure_time (in[0])) >= 0.001)
+            msg_exit ("%s: exposure time differs from %s", paths[i],
+                      paths[0]);
+    }
+    *temperature = sum / n;
+    return in;
+}
+
+int main (int argc, char *argv[])
+{
+    struct options *opt;
+    sbfits_t **in;
+    sbfits_t *sbf;
+    sbig_frame_stats_t st;
+    char history[72];
+    double setpoint, temperature, mean_temp;
+    ushort *data;
+    ushort h, w;
+    int ch, i, n;
+
+    log_init ("sbig-stack");
+
+    opt = xzmalloc (sizeof (*opt));
+    opt->verbose = true;
+    opt->method = SBIG_STACK_MEDIAN;
+    opt->sigma = SBIG_STACK_SIGMA;
+
+    optind = 0;
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'd': /* --image-directory DIR */
+                free (opt->imagedir);
+                opt->imagedir = xstrdup (optarg);
+                break;
+            case 'z': /* --compress[=TYPE] */
+                if (!optarg)
+                    opt->compress = SBFITS_COMPRESS_RICE;
+                else if (sbfits_compress_parse (optarg, &opt->compress) < 0)
+                    msg_exit ("error parsing --compress argument");
+                break;
+            case 'm': /* --method METHOD */
+                if (sbig_stack_method_parse (optarg, &opt->method) < 0)
+                    msg_exit ("error parsing --method argument");
+                break;
+            case 'k': /* --sigma K */
+                opt->sigma = strtod (optarg, NULL);
+                if (opt->sigma <= 0)
+                    msg_exit ("error parsing --sigma argument");
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind == argc)
+        usage ();
+    n = argc - optind;
+    if (!opt->imagedir) {
+        char *cpy = xstrdup (argv[optind]);
+        opt->imagedir = xstrdup (dirname (cpy));
+        free (cpy);
+    }
+
+    in = open_frames (n, argv + optind, &mean_temp);
+    sbfits_get_size (in[0], &h, &w);
+    data = xzmalloc ((size_t)h * w * sizeof (ushort));
+    if (sbig_stack_frames (n, h, w, opt->method, opt->sigma,
+                           read_rows, in, data) < 0)
+        msg_exit ("stack failed");
+    for (i = 1; i < n; i++) {
+        if (sbfits_close_file (in[i]) < 0)
+            msg_exit ("%s: %s", sbfits_get_filename (in[i]),
+                      sbfits_get_errstr (in[i]));
+        sbfits_destroy (in[i]);
+    }
+
+    /* The master takes the first frame's header, with the average
+     * CCD temperature of the stack.
+     */
+    sbf = in[0];
+    if (sbfits_close_file (sbf) < 0)
+        msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                  sbfits_get_errstr (sbf));
+    sbfits_set_data (sbf, data);
+    sbfits_get_temperature (sbf, &setpoint, &temperature);
+    sbfits_set_temperature (sbf, setpoint, mean_temp);
+    if (opt->method == SBIG_STACK_MEDIAN)
+        snprintf (history, sizeof (history), "Median of %d frames", n);
+    else
+        snprintf (history, sizeof (history),
+                  "Sigma clipped mean of %d frames, %.1f sigma",
+                  n, opt->sigma);
+    sbfits_add_history (sbf, "sbig-stack", history);
+    sbig_stats_init (&st, 65535, SBIG_STATS_HOT_DELTA);
+    for (i = 0; i < h; i++)
+        sbig_stats_add_row (&st, data + (size_t)i * w, w);
+    sbig_stats_finish (&st);
+    sbfits_set_stats (sbf, &st);
+    sbfits_set_compress (sbf, opt->compress);
+
+    if (sbfits_create_file (sbf, opt->imagedir, prefix (sbf)) < 0)
+        msg_exit ("%s: %s", sbfits_get_filename (sbf),
+                  sbfits_get_errstr (sbf));
+    if (sbfits_write_file (sbf) < 0)
+        msg_exit ("sbfits_write: %s", sbfits_get_errstr (sbf));
+    if (sbfits_close_file (sbf) < 0)
+        msg_exit ("sbfits_close: %s", sbfits_get_errstr (sbf));
+    if (opt->verbose)
+        msg ("wrote %s (%s)", sbfits_get_filename (sbf), history);
+    sbfits_destroy (sbf);
+
+    free (in);
+    free (data);
+    free (opt->imagedir);
+    free (opt);
+    log_fini ();
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -89,6 +89,11 @@ static void help (void)
 "   cfw        Select a filter on CFW device\n"
 "   snap       Take a picture\n"
 "   focus      Preview images quickly in a loop\n"
+"   bench      Time each phase of exposure, readout and FITS write\n"
+"   spool2fits Convert a raw spool from snap --spool to FITS files\n"
+"   stack      Combine bias, dark, or flat frames into a master\n"
+"   live       Follow images published by snap --live\n"
+"   ctl        Send a request to sbigd\n"
 );
 }
 
@@ -0,0 +1,652 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* sbigd - hold the camera open and serve requests from local clients
+ *
+ * Clients connect to a unix socket and send one line requests (see
+ * client.h).  Requests that only query or set state (status, cooler,
+ * cfw query, abort) are answered at once, even during an exposure.
+ * Exposures and filter moves are queued and run one at a time in the
+ * order they arrive; the reply is sent when each finishes.  Images are
+ * published to a live frame ring (see ring.h) rather than sent over the
+ * socket.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "src/common/libsbig/sbig.h"
+#include "src/common/libsbig/sbfits.h"
+#include "src/common/libutil/log.h"
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/list.h"
+
+const char *software_name = PACKAGE_NAME "-" PACKAGE_VERSION;
+const double exposure_timeout = 60.0; /* seconds allowed past exposure end */
+static bool interrupted = false;
+
+struct client {
+    int fd;
+    char buf[SBIG_CLIENT_LINE];
+    size_t len;                 /* bytes in buf */
+    bool dead;
+};
+
+typedef enum {
+    JOB_EXPOSE,
+    JOB_CFW,
+} job_type_t;
+
+struct job {
+    struct client *c;           /* NULL if the client has gone away */
+    job_type_t type;
+    double t;
+    bool dark;
+    READOUT_BINNING_MODE readout_mode;
+    double partial;
+    CFW_POSITION position;
+};
+
+struct daemon {
+    sbig_t *sb;
+    CAMERA_TYPE type;
+    sbig_ccd_t *ccd;
+    sbig_ring_t *ring;
+    const char *ring_name;
+    int fd;                     /* listening socket */
+    List clients;
+    List jobs;                  /* waiting to run */
+    struct job *running;
+    bool abort;                 /* abort the running exposure */
+    bool verbose;
+};
+
+#define OPTIONS "hs:l:v"
+static const struct option longopts[] = {
+    {"help",          no_argument,           0, 'h'},
+    {"socket",        required_argument,     0, 's'},
+    {"live",          required_argument,     0, 'l'},
+    {"verbose",       no_argument,           0, 'v'},
+    {0, 0, 0, 0},
+};
+
+void usage (void)
+{
+    fprintf (stderr,
+"Usage: sbigd [OPTIONS]\n"
+"  -s, --socket PATH  listen on PATH (default $SBIGD_SOCKET or "
+                                            SBIG_CLIENT_SOCKET ")\n"
+"  -l, --live NAME    publish images to shared memory ring NAME\n"
+"                     (default " SBIG_RING_NAME ")\n"
+"  -v, --verbose      log each request\n"
+);
+    exit (1);
+}
+
+void handle_signal (int signal)
+{
+    interrupted = true;
+}
+
+void reply (struct client *c, const char *fmt, ...)
+{
+    char buf[SBIG_CLIENT_LINE];
+    va_list ap;
+    int n;
+
+    if (!c || c->dead)
+        return;
+    va_start (ap, fmt);
+    n = vsnprintf (buf, sizeof (buf) - 1, fmt, ap);
+    va_end (ap);
+    if (n >= sizeof (buf) - 1)
+        n = sizeof (buf) - 2;
+    buf[n++] = '\n';
+    /* Replies are short, so a client whose socket is full is not reading.
+     */
+    if (write (c->fd, buf, n) < n)
+        c->dead = true;
+}
+
+void client_destroy (struct client *c)
+{
+    if (c) {
+        (void)close (c->fd);
+        free (c);
+    }
+}
+
+int job_client (struct job *job, struct client *c)
+{
+    return job->c == c;
+}
+
+/* Queued jobs of a client that has gone away are dropped; a running one
+ * finishes, but with nobody to reply to.
+ */
+void drop_client (struct daemon *d, struct client *c)
+{
+    (void)list_delete_all (d->jobs, (ListFindF)job_client, c);
+    if (d->running && d->running->c == c)
+        d->running->c = NULL;
+}
+
+/* Parse the key=value arguments of an expose request.
+ */
+int parse_expose (struct job *job, int ac, char **av, const char **errp)
+{
+    int i;
+
+    job->type = JOB_EXPOSE;
+    job->readout_mode = RM_1X1;
+    job->partial = 1.0;
+    for (i = 1; i < ac; i++) {
+        char *val = strchr (av[i], '=');
+        if (!val)
+            goto badarg;
+        *val++ = '\0';
+        if (!strcmp (av[i], "time")) {
+            if ((job->t = strtod (val, NULL)) <= 0)
+                goto badarg;
+        } else if (!strcmp (av[i], "type")) {
+            if (!strcmp (val, "df"))
+                job->dark = true;
+            else if (strcmp (val, "lf") != 0)
+                goto badarg;
+        } else if (!strcmp (av[i], "res")) {
+            if (!strcmp (val, "hi"))
+                job->readout_mode = RM_1X1;
+            else if (!strcmp (val, "med"))
+                job->readout_mode = RM_2X2;
+            else if (!strcmp (val, "lo"))
+                job->readout_mode = RM_3X3;
+            else
+                goto badarg;
+        } else if (!strcmp (av[i], "partial")) {
+            job->partial = strtod (val, NULL);
+            if (job->partial <= 0 || job->partial > 1.0)
+                goto badarg;
+        } else
+            goto badarg;
+    }
+    if (job->t == 0) {
+        *errp = "expose needs time=SEC";
+        return -1;
+    }
+    return 0;
+badarg:
+    *errp = "expose takes time=SEC [type=lf|df] [res=hi|med|lo] [partial=N]";
+    return -1;
+}
+
+void do_status (struct daemon *d, struct client *c)
+{
+    QueryTemperatureStatusResults2 temp;
+    CFW_STATUS status;
+    CFW_POSITION position;
+    char camera[32], cfw[16];
+    char *p;
+    int e;
+
+    if ((e = sbig_temp_get_info (d->sb, &temp)) != CE_NO_ERROR) {
+        reply (c, "error sbig_temp_get_info: %s",
+               sbig_get_error_string (d->sb, e));
+        return;
+    }
+    if (sbig_cfw_query (d->sb, &status, &position) != CE_NO_ERROR)
+        snprintf (cfw, sizeof (cfw), "none");
+    else if (status == CFWS_BUSY)
+        snprintf (cfw, sizeof (cfw), "busy");
+    else if (position == CFWP_UNKNOWN)
+        snprintf (cfw, sizeof (cfw), "unknown");
+    else
+        snprintf (cfw, sizeof (cfw), "%d", position);
+    snprintf (camera, sizeof (camera), "%s", sbig_strcam (d->type));
+    while ((p = strchr (camera, ' ')))
+        *p = '-';
+    reply (c, "ok camera=%s state=%s queue=%d cooling=%s setpoint=%.2f"
+              " ccd=%.2f power=%.0f cfw=%s frames=%llu live=%s",
+           camera, !d->running ? "idle"
+                 : d->running->type == JOB_EXPOSE ? "exposing" : "moving",
+           list_count (d->jobs), temp.coolingEnabled ? "on" : "off",
+           temp.ccdSetpoint, temp.imagingCCDTemperature,
+           temp.imagingCCDPower, cfw,
+           (unsigned long long)sbig_ring_head (d->ring), d->ring_name);
+}
+
+void do_cooler (struct daemon *d, struct client *c, int ac, char **av)
+{
+    TEMPERATURE_REGULATION mode;
+    double setpoint = 0;
+    int e;
+
+    if (ac == 3 && !strcmp (av[1], "on")) {
+        mode = REGULATION_ON;
+        setpoint = strtod (av[2], NULL);
+    } else if (ac == 2 && !strcmp (av[1], "off"))
+        mode = REGULATION_OFF;
+    else {
+        reply (c, "error cooler takes on SETPOINT or off");
+        return;
+    }
+    if ((e = sbig_temp_set (d->sb, mode, setpoint)) != CE_NO_ERROR)
+        reply (c, "error sbig_temp_set: %s", sbig_get_error_string (d->sb, e));
+    else
+        reply (c, "ok");
+}
+
+void do_cfw_query (struct daemon *d, struct client *c)
+{
+    CFW_STATUS status;
+    CFW_POSITION position;
+    int e;
+
+    if ((e = sbig_cfw_query (d->sb, &status, &position)) != CE_NO_ERROR)
+        reply (c, "error sbig_cfw_query: %s", sbig_get_error_string (d->sb, e));
+    else
+        reply (c, "ok status=%s position=%d",
+               status == CFWS_UNKNOWN ? "unknown" :
+               status == CFWS_IDLE ? "idle" : "busy", position);
+}
+
+void enqueue (struct daemon *d, const struct job *job)
+{
+    struct job *cpy = xzmalloc (sizeof (*cpy));
+
+    *cpy = *job;
+    list_enqueue (d->jobs, cpy);
+}
+
+/* Answer a request, or queue it to run when the camera is free.
+ */
+void dispatch (struct daemon *d, struct client *c, char *line)
+{
+    char *av[16], *saveptr;
+    int ac = 0;
+    struct job job = { .c = c };
+    const char *errstr;
+
+    while (ac < sizeof (av) / sizeof (av[0])
+                && (av[ac] = strtok_r (ac == 0 ? line : NULL, " \t\r",
+                                       &saveptr)))
+        ac++;
+    if (ac == 0)
+        return;
+    if (d->verbose)
+        msg ("client %d: %s", c->fd, av[0]);
+
+    if (!strcmp (av[0], "status") && ac == 1)
+        do_status (d, c);
+    else if (!strcmp (av[0], "cooler"))
+        do_cooler (d, c, ac, av);
+    else if (!strcmp (av[0], "cfw") && ac == 2 && !strcmp (av[1], "query"))
+        do_cfw_query (d, c);
+    else if (!strcmp (av[0], "cfw") && ac == 3 && !strcmp (av[1], "goto")) {
+        job.type = JOB_CFW;
+        job.position = strtoul (av[2], NULL, 10);
+        if (job.position < CFWP_1 || job.position > CFWP_10)
+            reply (c, "error cfw goto takes a slot from 1 to 10");
+        else
+            enqueue (d, &job);
+    } else if (!strcmp (av[0], "expose")) {
+        if (parse_expose (&job, ac, av, &errstr) < 0)
+            reply (c, "error %s", errstr);
+        else
+            enqueue (d, &job);
+    } else if (!strcmp (av[0], "abort") && ac == 1) {
+        bool abort = d->running && d->running->type == JOB_EXPOSE;
+        if (abort)
+            d->abort = true;
+        reply (c, "ok aborted=%d", abort);
+    } else
+        reply (c, "error unknown request");
+}
+
+/* Read what the client sent, and dispatch each complete line.
+ */
+void client_read (struct daemon *d, struct client *c)
+{
+    ssize_t n;
+    char *nl;
+
+    n = read (c->fd, c->buf + c->len, sizeof (c->buf) - c->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        c->dead = true;
+        return;
+    }
+    c->len += n;
+    while (!c->dead && (nl = memchr (c->buf, '\n', c->len))) {
+        *nl++ = '\0';
+        dispatch (d, c, c->buf);
+        c->len -= nl - c->buf;
+        memmove (c->buf, nl, c->len);
+    }
+    if (c->len == sizeof (c->buf)) {
+        reply (c, "error request too long");
+        c->dead = true;
+    }
+}
+
+/* Accept new clients and serve requests for up to 'timeout' msec
+ * (forever if negative).
+ */
+void service (struct daemon *d, int timeout)
+{
+    int i, n = list_count (d->clients) + 1;
+    struct pollfd *fds = xzmalloc (sizeof (fds[0]) * n);
+    struct client **cs = xzmalloc (sizeof (cs[0]) * n);
+    ListIterator itr;
+    struct client *c;
+    int fd;
+
+    fds[0].fd = d->fd;
+    fds[0].events = POLLIN;
+    itr = list_iterator_create (d->clients);
+    for (i = 1; (c = list_next (itr)); i++) {
+        cs[i] = c;
+        fds[i].fd = c->fd;
+        fds[i].events = POLLIN;
+    }
+    if (poll (fds, n, timeout) < 0) {
+        if (errno != EINTR)
+            err_exit ("poll");
+        goto done;
+    }
+    for (i = 1; i < n; i++) {
+        if (fds[i].revents)
+            client_read (d, cs[i]);
+    }
+    if ((fds[0].revents & POLLIN)
+            && (fd = accept4 (d->fd, NULL, NULL,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        c = xzmalloc (sizeof (*c));
+        c->fd = fd;
+        list_append (d->clients, c);
+        if (d->verbose)
+            msg ("client %d: connected", fd);
+    }
+    list_iterator_reset (itr);
+    while ((c = list_next (itr))) {
+        if (c->dead) {
+            if (d->verbose)
+                msg ("client %d: disconnected", c->fd);
+            drop_client (d, c);
+            list_delete (itr);
+        }
+    }
+done:
+    list_iterator_destroy (itr);
+    free (cs);
+    free (fds);
+}
+
+/* Serve clients while an exposure is in progress.
+ */
+bool service_cb (void *arg)
+{
+    struct daemon *d = arg;
+
+    service (d, 0);
+    return d->abort || interrupted;
+}
+
+void run_expose (struct daemon *d, struct job *job)
+{
+    QueryTemperatureStatusResults2 temp;
+    sbfits_t *sbf;
+    ushort top, left, height, width;
+    int e;
+
+    e = sbig_ccd_set_shutter_mode (d->ccd, job->dark ? SC_CLOSE_SHUTTER
+                                                     : SC_OPEN_SHUTTER);
+    if (e == CE_NO_ERROR)
+        e = sbig_ccd_set_readout_mode (d->ccd, job->readout_mode);
+    if (e == CE_NO_ERROR && job->partial < 1.0)
+        e = sbig_ccd_set_partial_frame (d->ccd, job->partial);
+    if (e == CE_NO_ERROR)
+        e = sbig_ccd_start_exposure (d->ccd, 0, job->t);
+    if (e != CE_NO_ERROR)
+        goto error;
+    e = sbig_ccd_wait_exposure (d->ccd, exposure_timeout, service_cb, d);
+    if (e == CE_KBD_ESC) {
+        (void)sbig_ccd_end_exposure (d->ccd, ABORT_DONT_END);
+        reply (job->c, "error aborted");
+        return;
+    }
+    if (e == CE_NO_ERROR)
+        e = sbig_ccd_end_exposure (d->ccd, 0);
+    if (e == CE_NO_ERROR)
+        e = sbig_ccd_readout_pipelined (d->ccd, 0, NULL, NULL);
+    if (e == CE_NO_ERROR)
+        e = sbig_temp_get_info (d->sb, &temp);
+    if (e != CE_NO_ERROR)
+        goto error;
+
+    sbf = sbfits_create ();
+    sbfits_set_ccdinfo (sbf, d->ccd);
+    sbfits_set_temperature (sbf, temp.ccdSetpoint, temp.imagingCCDTemperature);
+    sbfits_set_imagetype (sbf, job->dark ? SBFITS_TYPE_DF : SBFITS_TYPE_LF);
+    sbfits_set_swcreate (sbf, software_name);
+    if (sbfits_ring_publish (d->ring, sbf) < 0)
+        reply (job->c, "error %s: %s", d->ring_name, sbfits_get_errstr (sbf));
+    else {
+        (void)sbig_ccd_get_window (d->ccd, &top, &left, &height, &width);
+        reply (job->c, "ok frame=%llu height=%u width=%u",
+               (unsigned long long)sbig_ring_head (d->ring), height, width);
+    }
+    sbfits_destroy (sbf);
+    return;
+error:
+    reply (job->c, "error %s", sbig_get_error_string (d->sb, e));
+}
+
+void run_cfw (struct daemon *d, struct job *job)
+{
+    CFW_STATUS status;
+    CFW_POSITION actual;
+    int e;
+
+    if ((e = sbig_cfw_goto (d->sb, job->position)) != CE_NO_ERROR)
+        goto error;
+    for (;;) {
+        if ((e = sbig_cfw_query (d->sb, &status, &actual)) != CE_NO_ERROR)
+            goto error;
+        if (status != CFWS_BUSY || interrupted)
+            break;
+        service (d, 100);
+    }
+    if (status == CFWS_BUSY)
+        reply (job->c, "error interrupted");
+    else
+        reply (job->c, "ok position=%d", actual);
+    return;
+error:
+    reply (job->c, "error %s", sbig_get_error_string (d->sb, e));
+}
+
+void run_job (struct daemon *d, struct job *job)
+{
+    d->running = job;
+    d->abort = false;
+    if (job->type == JOB_EXPOSE)
+        run_expose (d, job);
+    else
+        run_cfw (d, job);
+    d->running = NULL;
+    free (job);
+}
+
+/* Listen on 'path', replacing a socket left behind by a daemon that
+ * did not exit cleanly, but not one that is still running.
+ */
+int listen_socket (const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    sbig_client_t *c;
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+        msg_exit ("%s: path too long", path);
+    strcpy (addr.sun_path, path);
+    if ((c = sbig_client_connect (path))) {
+        sbig_client_destroy (c);
+        msg_exit ("%s: sbigd is already running", path);
+    }
+    (void)unlink (path);
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        err_exit ("socket");
+    if (bind (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+        err_exit ("%s", path);
+    if (listen (fd, 16) < 0)
+        err_exit ("listen");
+    return fd;
+}
+
+int main (int argc, char *argv[])
+{
+    const char *sbig_udrv = getenv ("SBIG_UDRV");
+    const char *sbig_device = getenv ("SBIG_DEVICE");
+    const char *path = getenv ("SBIGD_SOCKET");
+    struct daemon *d;
+    struct sigaction sa;
+    struct job *job;
+    ushort top, left, height, width;
+    int e, ch;
+
+    log_init ("sbigd");
+
+    d = xzmalloc (sizeof (*d));
+    d->ring_name = SBIG_RING_NAME;
+    if (!path)
+        path = SBIG_CLIENT_SOCKET;
+
+    while ((ch = getopt_long (argc, argv, OPTIONS, longopts, NULL)) != -1) {
+        switch (ch) {
+            case 's': /* --socket PATH */
+                path = optarg;
+                break;
+            case 'l': /* --live NAME */
+                d->ring_name = optarg;
+                break;
+            case 'v': /* --verbose */
+                d->verbose = true;
+                break;
+            case 'h': /* --help */
+            default:
+                usage ();
+        }
+    }
+    if (optind != argc)
+        usage ();
+
+    if (!sbig_device)
+        msg_exit ("SBIG_DEVICE is not set");
+    if (!(d->sb = sbig_new ()))
+        err_exit ("sbig_new");
+    if (sbig_dlopen (d->sb, sbig_udrv) != 0)
+        msg_exit ("%s", dlerror ());
+    if ((e = sbig_open_driver (d->sb)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_driver: %s", sbig_get_error_string (d->sb, e));
+    if ((e = sbig_open_device (d->sb, sbig_device)) != CE_NO_ERROR)
+        msg_exit ("sbig_open_device: %s", sbig_get_error_string (d->sb, e));
+    if ((e = sbig_establish_link (d->sb, &d->type)) != CE_NO_ERROR)
+        msg_exit ("sbig_establish_link: %s", sbig_get_error_string (d->sb, e));
+    msg ("Link established to %s", sbig_strcam (d->type));
+
+    /* The ring has room for a full high resolution frame.
+     */
+    if ((e = sbig_ccd_create (d->sb, CCD_IMAGING, &d->ccd)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_create: %s", sbig_get_error_string (d->sb, e));
+    if ((e = sbig_ccd_end_exposure (d->ccd, ABORT_DONT_END)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_end_exposure: %s",
+                  sbig_get_error_string (d->sb, e));
+    if ((e = sbig_ccd_set_readout_mode (d->ccd, RM_1X1)) != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_set_readout_mode: %s",
+                  sbig_get_error_string (d->sb, e));
+    if ((e = sbig_ccd_get_window (d->ccd, &top, &left, &height, &width))
+                                                            != CE_NO_ERROR)
+        msg_exit ("sbig_ccd_get_window: %s", sbig_get_error_string (d->sb, e));
+    if (!(d->ring = sbig_ring_create (d->ring_name, height, width,
+                                      SBIG_RING_SLOTS)))
+        err_exit ("%s", d->ring_name);
+
+    d->clients = list_create ((ListDelF)client_destroy);
+    d->jobs = list_create ((ListDelF)free);
+    d->fd = listen_socket (path);
+
+    sa.sa_handler = &handle_signal;
+    sa.sa_flags = 0;
+    sigfillset (&sa.sa_mask);
+    if (sigaction (SIGINT, &sa, NULL) < 0 || sigaction (SIGTERM, &sa, NULL) < 0)
+        err_exit ("sigaction");
+    sa.sa_handler = SIG_IGN;
+    if (sigaction (SIGPIPE, &sa, NULL) < 0)
+        err_exit ("sigaction");
+    msg ("listening on %s, publishing images to %s", path, d->ring_name);
+
+    while (!interrupted) {
+        if ((job = list_dequeue (d->jobs)))
+            run_job (d, job);
+        else
+            service (d, -1);
+    }
+
+    msg ("shutting down");
+    while ((job = list_dequeue (d->jobs))) {
+        reply (job->c, "error sbigd is shutting down");
+        free (job);
+    }
+    (void)unlink (path);
+    (void)close (d->fd);
+    list_destroy (d->jobs);
+    list_destroy (d->clients);
+    sbig_ring_destroy (d->ring);
+    sbig_ccd_destroy (d->ccd);
+    if ((e = sbig_close_device (d->sb)) != CE_NO_ERROR)
+        msg_exit ("sbig_close_device: %s", sbig_get_error_string (d->sb, e));
+    sbig_destroy (d->sb);
+    free (d);
+    log_fini ();
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
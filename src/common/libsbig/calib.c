@@ -0,0 +1,226 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Per-row calibration: bias/dark, flat field, and bad pixels
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sbigudrv.h"
+#include "calib.h"
+
+#include "src/common/libutil/darksub.h"
+#include "src/common/libutil/xzmalloc.h"
+
+struct sbig_calib {
+    ushort height, width;
+    ushort *bias;               /* owned copy, or NULL */
+    const ushort *dark;         /* caller's, or NULL */
+    float *flat;                /* reciprocal of normalized flat, or NULL */
+    int *bad_row;               /* bad pixels in row r are */
+    ushort *bad_col;            /*   bad_col[bad_row[r]..bad_row[r+1]-1] */
+    int nbad;
+};
+
+sbig_calib_t *sbig_calib_create (ushort height, ushort width)
+{
+    sbig_calib_t *cal;
+
+    if (height == 0 || width == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    cal = xzmalloc (sizeof (*cal));
+    cal->height = height;
+    cal->width = width;
+    return cal;
+}
+
+void sbig_calib_destroy (sbig_calib_t *cal)
+{
+    if (cal) {
+        free (cal->bias);
+        free (cal->flat);
+        free (cal->bad_row);
+        free (cal->bad_col);
+        free (cal);
+    }
+}
+
+void sbig_calib_get_size (sbig_calib_t *cal, ushort *height, ushort *width)
+{
+    *height = cal->height;
+    *width = cal->width;
+}
+
+void sbig_calib_set_bias (sbig_calib_t *cal, const ushort *bias)
+{
+    size_t n = (size_t)cal->height * cal->width;
+
+    free (cal->bias);
+    cal->bias = NULL;
+    if (bias) {
+        cal->bias = xzmalloc (n * sizeof (ushort));
+        memcpy (cal->bias, bias, n * sizeof (ushort));
+    }
+}
+
+void sbig_calib_set_dark (sbig_calib_t *cal, const ushort *dark)
+{
+    cal->dark = dark;
+}
+
+/* Store mean / flat, so correcting a pixel is one multiply.  Pixels with
+ * no flat signal are left alone.
+ */
+void sbig_calib_set_flat (sbig_calib_t *cal, const ushort *flat)
+{
+    size_t i, n = (size_t)cal->height * cal->width;
+    double sum = 0, mean;
+
+    free (cal->flat);
+    cal->flat = NULL;
+    if (!flat)
+        return;
+    for (i = 0; i < n; i++)
+        sum += flat[i];
+    mean = sum / n;
+    cal->flat = xzmalloc (n * sizeof (float));
+    for (i = 0; i < n; i++)
+        cal->flat[i] = flat[i] > 0 ? mean / flat[i] : 1.0;
+}
+
+void sbig_calib_set_badpix (sbig_calib_t *cal, const ushort *map)
+{
+    size_t i, n = (size_t)cal->height * cal->width;
+    int r, c, k = 0;
+
+    free (cal->bad_row);
+    free (cal->bad_col);
+    cal->bad_row = NULL;
+    cal->bad_col = NULL;
+    cal->nbad = 0;
+    if (!map)
+        return;
+    for (i = 0; i < n; i++) {
+        if (map[i])
+            cal->nbad++;
+    }
+    cal->bad_row = xzmalloc ((cal->height + 1) * sizeof (int));
+    cal->bad_col = xzmalloc ((cal->nbad + 1) * sizeof (ushort));
+    for (r = 0; r < cal->height; r++) {
+        cal->bad_row[r] = k;
+        for (c = 0; c < cal->width; c++) {
+            if (map[(size_t)r * cal->width + c])
+                cal->bad_col[k++] = c;
+        }
+    }
+    cal->bad_row[r] = k;
+}
+
+int sbig_calib_count_badpix (sbig_calib_t *cal)
+{
+    return cal->nbad;
+}
+
+bool sbig_calib_has_offset (sbig_calib_t *cal)
+{
+    return cal->dark || cal->bias;
+}
+
+bool sbig_calib_has_flat (sbig_calib_t *cal)
+{
+    return cal->flat != NULL;
+}
+
+static void flat_row (const float *recip, ushort pedestal, ushort *data,
+                      int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        float v = (data[x] - pedestal) * recip[x] + pedestal + 0.5f;
+        data[x] = v <= 0 ? 0 : v >= 65535 ? 65535 : (ushort)v;
+    }
+}
+
+/* Fill each run of adjacent bad pixels by interpolating between the good
+ * pixels either side of it in the same row, the only neighbors that
+ * have been read out when the row arrives.
+ */
+static void badpix_row (const ushort *col, int n, ushort *data, int width)
+{
+    int j, k, x, l, r;
+
+    for (j = 0; j < n; j = k) {
+        for (k = j + 1; k < n && col[k] == col[k - 1] + 1; k++)
+            ;
+        l = col[j] - 1;
+        r = col[k - 1] + 1;
+        for (x = col[j]; x < r; x++) {
+            if (l >= 0 && r < width)
+                data[x] = data[l] + ((data[r] - data[l]) * (x - l)
+                                     + (r - l) / 2) / (r - l);
+            else if (l >= 0)
+                data[x] = data[l];
+            else if (r < width)
+                data[x] = data[r];
+        }
+    }
+}
+
+int sbig_calib_row (sbig_calib_t *cal, ushort row, ushort *data,
+                    bool subtracted)
+{
+    size_t off = (size_t)row * cal->width;
+    const ushort *offset = cal->dark ? cal->dark : cal->bias;
+    ushort pedestal = 0;
+
+    if (row >= cal->height)
+        return -1;
+    if (subtracted)
+        pedestal = SBIG_CALIB_PEDESTAL;
+    else if (offset) {
+        darksub_ushort (data, offset + off, SBIG_CALIB_PEDESTAL, data,
+                        cal->width);
+        pedestal = SBIG_CALIB_PEDESTAL;
+    }
+    if (cal->flat)
+        flat_row (cal->flat + off, pedestal, data, cal->width);
+    if (cal->nbad > 0)
+        badpix_row (cal->bad_col + cal->bad_row[row],
+                    cal->bad_row[row + 1] - cal->bad_row[row],
+                    data, cal->width);
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,66 @@
+#ifndef _SBIG_CALIB_H
+#define _SBIG_CALIB_H
+
+#include <stdbool.h>
+
+#include "sbigudrv.h"
+
+/* Calibration applied to each row as it is read out (see
+ * sbig_ccd_set_calib()), so a calibrated frame is ready as soon as
+ * readout completes:  subtract the dark, or if there is none the bias,
+ * then divide by the flat, then interpolate over bad pixels.
+ * Frames are the size of the readout window.
+ */
+
+#define SBIG_CALIB_PEDESTAL     100     /* as SBIGUDrv's readout subtract */
+
+typedef struct sbig_calib sbig_calib_t;
+
+/* Create calibration for frames of 'height' x 'width' pixels, with no
+ * stages enabled.  Returns NULL with errno set on failure.
+ */
+sbig_calib_t *sbig_calib_create (ushort height, ushort width);
+void sbig_calib_destroy (sbig_calib_t *cal);
+
+void sbig_calib_get_size (sbig_calib_t *cal, ushort *height, ushort *width);
+
+/* Set the master bias (copied), or NULL for none.  A dark frame includes
+ * the bias, so the bias is only subtracted from frames without a dark.
+ */
+void sbig_calib_set_bias (sbig_calib_t *cal, const ushort *bias);
+
+/* Set the dark for the next frame, or NULL for none.  It is not copied,
+ * e.g. so a dark from sbig_darklib_find() may be used directly.
+ */
+void sbig_calib_set_dark (sbig_calib_t *cal, const ushort *dark);
+
+/* Set the master flat, or NULL for none.  Its reciprocal, normalized to
+ * the flat's mean, is precomputed.  The flat should itself be calibrated.
+ */
+void sbig_calib_set_flat (sbig_calib_t *cal, const ushort *flat);
+
+/* Set the bad pixel map, nonzero where pixels are bad, or NULL for none.
+ * Only an index of the bad pixels is kept.
+ */
+void sbig_calib_set_badpix (sbig_calib_t *cal, const ushort *map);
+int sbig_calib_count_badpix (sbig_calib_t *cal);
+
+/* True if frames will have a bias or dark subtracted.
+ */
+bool sbig_calib_has_offset (sbig_calib_t *cal);
+bool sbig_calib_has_flat (sbig_calib_t *cal);
+
+/* Calibrate 'row' in place.  Subtracting a bias or dark adds
+ * SBIG_CALIB_PEDESTAL, about which the flat is applied.  If 'subtracted',
+ * the row already had a dark subtracted with that pedestal by the driver,
+ * so only the flat and bad pixel stages apply.
+ * Returns -1 if 'row' is out of range.
+ */
+int sbig_calib_row (sbig_calib_t *cal, ushort row, ushort *data,
+                    bool subtracted);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
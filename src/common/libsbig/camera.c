@@ -33,11 +33,14 @@
 #include <arpa/inet.h> /* htons */
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/param.h> /* MIN */
 
 #include "handle.h"
 #include "handle_impl.h"
 #include "sbigudrv.h"
 #include "sbig.h"
+#include "parallel.h"
 
 #include "src/common/libutil/bcd.h"
 #include "src/common/libutil/color.h"
@@ -55,11 +58,21 @@ struct sbig_ccd {
     ulong exp_flags;
     double exposureTime;
     time_t exposureStart;
+    struct timespec exposureEnd; /* expected, CLOCK_MONOTONIC */
     CFW_POSITION last_cfw_position;
     int restore_cfw_position:1;
     int has_eshutter:1;
+    int has_abg:1;      /* imaging CCD has antiblooming gate */
     int color_bayer:1;
     int color_truesense:1;
+    int no_frame:1;
+    int stats_readout:1;
+    int stats_valid:1;
+    ushort chunk_rows;
+    sbig_readout_timing_t timing;
+    int nthreads;       /* for post-processing, 0 = online CPUs */
+    sbig_frame_stats_t *stats; /* cached if stats_valid */
+    sbig_calib_t *calib;        /* for SBIG_READOUT_CALIBRATE */
 };
 
 static int lookup_roinfo (sbig_ccd_t *ccd, READOUT_BINNING_MODE mode)
@@ -76,7 +89,19 @@ static void realloc_frame (sbig_ccd_t *ccd)
 {
     if (ccd->frame)
         free (ccd->frame);
-    ccd->frame = xzmalloc (sizeof (*ccd->frame) * ccd->height * ccd->width);
+    ccd->frame = NULL;
+    ccd->stats_valid = 0;
+    if (!ccd->no_frame)
+        ccd->frame = xzmalloc (sizeof (*ccd->frame) * ccd->height
+                                                    * ccd->width);
+}
+
+int sbig_ccd_set_frame_buffer (sbig_ccd_t *ccd, int enable)
+{
+    ccd->no_frame = enable ? 0 : 1;
+    if (!ccd->frame != !enable)
+        realloc_frame (ccd);
+    return CE_NO_ERROR;
 }
 
 /* FIXME: PixCel255/237 doesn't support info0 on tracking ccd
@@ -84,6 +109,7 @@ static void realloc_frame (sbig_ccd_t *ccd)
 int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp)
 {
     sbig_ccd_t *ccd = xzmalloc (sizeof (*ccd));
+    GetCCDInfoResults2 info2;
     GetCCDInfoResults4 info4;
     GetCCDInfoResults6 info6;
     int e;
@@ -110,6 +136,19 @@ int sbig_ccd_create (sbig_t *sb, CCD_REQUEST chip, sbig_ccd_t **ccdp)
     if ((info4.capabilitiesBits & CB_CCD_ESHUTTER_MASK) == CB_CCD_ESHUTTER_YES)
         ccd->has_eshutter = 1;
 
+    /* Only the ST-7/8 datamax depends on ABG, so only ask those.
+     * Assume ABG if the query fails, for the more conservative datamax.
+     */
+    ccd->has_abg = 1;
+    if (ccd->info0.cameraType == ST7_CAMERA
+                                || ccd->info0.cameraType == ST8_CAMERA) {
+        if (sbig_ccd_get_info2 (ccd, &info2) == CE_NO_ERROR
+                                                && !info2.imagingABG)
+            ccd->has_abg = 0;
+    }
+
+    ccd->chunk_rows = 32;
+    ccd->stats = xzmalloc (sizeof (*ccd->stats));
     ccd->abg_mode = ABG_LOW7;            /* ABG shut off during exposure */
     ccd->shutter_mode = SC_OPEN_SHUTTER; /* open during exp, close during r/o */
 
@@ -145,6 +184,7 @@ void sbig_ccd_destroy (sbig_ccd_t *ccd)
 {
     if (ccd->frame)
         free (ccd->frame);
+    free (ccd->stats);
     free (ccd);
 }
 
@@ -296,8 +336,14 @@ int sbig_ccd_set_partial_frame (sbig_ccd_t *ccd, double part)
 int sbig_ccd_set_window (sbig_ccd_t *ccd, ushort top, ushort left,
                          ushort height, ushort width)
 {
-    if (top > ccd->height || left > ccd->width || height > ccd->height
-                                               || width > ccd->width)
+    int ro_index = lookup_roinfo (ccd, ccd->readout_mode);
+
+    /* Check against the full frame, not the current window, so a window
+     * may be moved or grown.
+     */
+    if (ro_index == -1
+            || top + height > ccd->info0.readoutInfo[ro_index].height
+            || left + width > ccd->info0.readoutInfo[ro_index].width)
         return CE_BAD_PARAMETER;
     ccd->top = top;
     ccd->left = left;
@@ -335,6 +381,28 @@ int sbig_ccd_clr_exposure_flags (sbig_ccd_t *ccd, ulong flags)
     return CE_NO_ERROR;
 }
 
+static double timespec_diff (struct timespec *t0, struct timespec *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) + 1E-9 * (t1->tv_nsec - t0->tv_nsec);
+}
+
+static void timespec_add (struct timespec *ts, double t)
+{
+    long ns = ts->tv_nsec + (long)((t - floor (t)) * 1E9);
+
+    ts->tv_sec += (time_t)floor (t) + ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+static void nap (double t)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 0 };
+
+    timespec_add (&ts, t);
+    while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
 /* Min exposure in seconds
  * FIXME: I've been conservative in grouping the ? cameras with ST7.
  */
@@ -432,6 +500,8 @@ int sbig_ccd_start_exposure (sbig_ccd_t *ccd, unsigned short flags,
             ccd->restore_cfw_position = 1;
         }
     }
+    clock_gettime (CLOCK_MONOTONIC, &ccd->exposureEnd);
+    timespec_add (&ccd->exposureEnd, exposureTime);
     return ccd->sb->fun (CC_START_EXPOSURE2, &in, NULL);
 }
 
@@ -449,6 +519,49 @@ int sbig_ccd_get_exposure_status (sbig_ccd_t *ccd, PAR_COMMAND_STATUS *sp)
     return e;
 }
 
+/* Wake this long before the expected end of exposure and start polling.
+ * Poll at 1ms, doubling up to 32ms, while the camera has not finished.
+ */
+static const double wait_margin = 0.005;
+static const double wait_cancel_interval = 0.1;
+static const double poll_min = 0.001;
+static const double poll_max = 0.032;
+
+int sbig_ccd_wait_exposure (sbig_ccd_t *ccd, double timeout,
+                            sbig_cancel_f cancel, void *arg)
+{
+    PAR_COMMAND_STATUS status;
+    struct timespec now;
+    double t, interval = poll_min;
+    int e;
+
+    for (;;) {
+        if (cancel && cancel (arg))
+            return CE_KBD_ESC;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        t = timespec_diff (&now, &ccd->exposureEnd) - wait_margin;
+        if (t <= 0)
+            break;
+        nap (MIN (t, wait_cancel_interval));
+    }
+    for (;;) {
+        if ((e = sbig_ccd_get_exposure_status (ccd, &status)) != CE_NO_ERROR)
+            return e;
+        if (status == CS_INTEGRATION_COMPLETE)
+            break;
+        if (status == CS_IDLE)
+            return CE_NO_EXPOSURE_IN_PROGRESS;
+        if (cancel && cancel (arg))
+            return CE_KBD_ESC;
+        clock_gettime (CLOCK_MONOTONIC, &now);
+        if (timeout > 0 && timespec_diff (&ccd->exposureEnd, &now) > timeout)
+            return CE_RX_TIMEOUT;
+        nap (interval);
+        interval = MIN (interval * 2, poll_max);
+    }
+    return CE_NO_ERROR;
+}
+
 int sbig_ccd_end_exposure (sbig_ccd_t *ccd, ushort flags)
 {
     EndExposureParams in = { .ccd = ccd->ccd | flags };
@@ -463,12 +576,28 @@ int sbig_ccd_end_exposure (sbig_ccd_t *ccd, ushort flags)
     return ccd->sb->fun (CC_END_EXPOSURE, &in, NULL);
 }
 
-static int start_readout (sbig_ccd_t *ccd)
+static int start_readout (sbig_ccd_t *ccd, int flags)
 {
     StartReadoutParams in = { .ccd = ccd->ccd, .readoutMode = ccd->readout_mode,
                               .top = ccd->top, .left = ccd->left,
                               .height = ccd->height, .width = ccd->width };
 
+    if ((flags & SBIG_READOUT_CALIBRATE)) {
+        ushort height, width;
+
+        if (!ccd->calib)
+            return CE_BAD_PARAMETER;
+        sbig_calib_get_size (ccd->calib, &height, &width);
+        if (height != ccd->height || width != ccd->width)
+            return CE_BAD_PARAMETER;
+    }
+    memset (&ccd->timing, 0, sizeof (ccd->timing));
+    ccd->stats_valid = 0;
+    if (ccd->stats_readout) {
+        ushort datamax;
+        (void)sbig_ccd_get_datamax (ccd, &datamax);
+        sbig_stats_init (ccd->stats, datamax, SBIG_STATS_HOT_DELTA);
+    }
     return ccd->sb->fun (CC_START_READOUT, &in, NULL);
 }
 
@@ -478,8 +607,14 @@ static int start_readout (sbig_ccd_t *ccd)
 static int end_readout (sbig_ccd_t *ccd)
 {
     EndReadoutParams in = { .ccd = ccd->ccd };
+    int e = ccd->sb->fun (CC_END_READOUT, &in, NULL);
 
-    return ccd->sb->fun (CC_END_READOUT, &in, NULL);
+    if (e == CE_NO_ERROR && ccd->stats_readout
+                         && ccd->stats->npix == ccd->height * ccd->width) {
+        sbig_stats_finish (ccd->stats);
+        ccd->stats_valid = 1;
+    }
+    return e;
 }
 
 static int readout_line (sbig_ccd_t *ccd, ushort start, ushort len, ushort *buf)
@@ -498,17 +633,55 @@ static int read_subtract_line (sbig_ccd_t *ccd, ushort start, ushort len, ushort
     return ccd->sb->fun (CC_READ_SUBTRACT_LINE, &in, buf);
 }
 
-int sbig_ccd_readout (sbig_ccd_t *ccd)
+/* Read 'nrows' rows starting at 'row' into 'buf', timing the chunk as
+ * a unit.  SBIGUDrv has no multi-row readout command, so rows are still
+ * fetched one CC_READOUT_LINE at a time; the chunk is what callers
+ * synchronize on.  Rows are calibrated before statistics are taken.
+ */
+static int readout_chunk (sbig_ccd_t *ccd, int flags, int row, int nrows,
+                          ushort *buf)
 {
-    ushort *pp = ccd->frame;
-    int i, e;
+    struct timespec t0, t1;
+    double t;
+    int i, e = CE_NO_ERROR;
+
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    for (i = 0; e == CE_NO_ERROR && i < nrows; i++) {
+        if ((flags & SBIG_READOUT_SUBTRACT))
+            e = read_subtract_line (ccd, ccd->left, ccd->width, buf);
+        else
+            e = readout_line (ccd, ccd->left, ccd->width, buf);
+        if (e == CE_NO_ERROR && (flags & SBIG_READOUT_CALIBRATE))
+            (void)sbig_calib_row (ccd->calib, row + i, buf,
+                                  (flags & SBIG_READOUT_SUBTRACT));
+        if (e == CE_NO_ERROR && ccd->stats_readout)
+            sbig_stats_add_row (ccd->stats, buf, ccd->width);
+        buf += ccd->width;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+
+    t = timespec_diff (&t0, &t1);
+    if (ccd->timing.chunks == 0 || t < ccd->timing.min)
+        ccd->timing.min = t;
+    if (t > ccd->timing.max)
+        ccd->timing.max = t;
+    ccd->timing.total += t;
+    ccd->timing.chunks++;
+    ccd->timing.rows += i;
+    return e;
+}
 
-    assert (pp != NULL);
+static int readout_frame (sbig_ccd_t *ccd, int flags)
+{
+    int i, n, e;
 
-    e = start_readout (ccd);
-    for (i = 0; e == CE_NO_ERROR && i < ccd->height; i++) {
-        e = readout_line (ccd, ccd->left, ccd->width, pp);
-        pp += ccd->width;
+    if (!ccd->frame)
+        return CE_BAD_PARAMETER;
+
+    e = start_readout (ccd, flags);
+    for (i = 0; e == CE_NO_ERROR && i < ccd->height; i += n) {
+        n = MIN (ccd->chunk_rows, ccd->height - i);
+        e = readout_chunk (ccd, flags, i, n, ccd->frame + i * ccd->width);
     }
     if (e == CE_NO_ERROR)
         e = end_readout (ccd);
@@ -516,37 +689,188 @@ int sbig_ccd_readout (sbig_ccd_t *ccd)
     return e;
 }
 
+int sbig_ccd_readout (sbig_ccd_t *ccd)
+{
+    return readout_frame (ccd, 0);
+}
+
 int sbig_ccd_readout_subtract (sbig_ccd_t *ccd)
 {
-    ushort *pp = ccd->frame;
-    int i, e;
+    return readout_frame (ccd, SBIG_READOUT_SUBTRACT);
+}
+
+int sbig_ccd_set_readout_chunk (sbig_ccd_t *ccd, ushort rows)
+{
+    if (rows == 0)
+        return CE_BAD_PARAMETER;
+    ccd->chunk_rows = rows;
+    return CE_NO_ERROR;
+}
 
-    assert (pp != NULL);
+int sbig_ccd_get_readout_timing (sbig_ccd_t *ccd, sbig_readout_timing_t *tp)
+{
+    *tp = ccd->timing;
+    return CE_NO_ERROR;
+}
+
+/* State shared between the readout producer thread and the consumer.
+ * 'rows_done' only grows; the consumer sets 'abort' to stop the producer.
+ */
+struct pipeline {
+    sbig_ccd_t *ccd;
+    int flags;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int rows_done;
+    int error;
+    bool abort;
+};
+
+static void *readout_producer (void *arg)
+{
+    struct pipeline *p = arg;
+    sbig_ccd_t *ccd = p->ccd;
+    bool abort = false;
+    int i, n, e = CE_NO_ERROR;
+
+    for (i = 0; e == CE_NO_ERROR && !abort && i < ccd->height; i += n) {
+        n = MIN (ccd->chunk_rows, ccd->height - i);
+        e = readout_chunk (ccd, p->flags, i, n, ccd->frame + i * ccd->width);
+
+        pthread_mutex_lock (&p->lock);
+        if (e == CE_NO_ERROR)
+            p->rows_done = i + n;
+        else
+            p->error = e;
+        abort = p->abort;
+        pthread_cond_signal (&p->cond);
+        pthread_mutex_unlock (&p->lock);
+    }
+    return NULL;
+}
 
-    e = start_readout (ccd);
+int sbig_ccd_readout_pipelined (sbig_ccd_t *ccd, int flags,
+                                sbig_ccd_row_f fun, void *arg)
+{
+    struct pipeline p = { .ccd = ccd, .flags = flags };
+    pthread_t t;
+    int row = 0, avail;
+    int e, ce = CE_NO_ERROR;
+
+    if (!ccd->frame)
+        return CE_BAD_PARAMETER;
+    if ((e = start_readout (ccd, flags)) != CE_NO_ERROR)
+        return e;
+    pthread_mutex_init (&p.lock, NULL);
+    pthread_cond_init (&p.cond, NULL);
+    if (pthread_create (&t, NULL, readout_producer, &p) != 0) {
+        e = CE_OS_ERROR;
+        goto done;
+    }
+    while (row < ccd->height && ce == CE_NO_ERROR) {
+        pthread_mutex_lock (&p.lock);
+        while (p.rows_done == row && p.error == CE_NO_ERROR)
+            pthread_cond_wait (&p.cond, &p.lock);
+        avail = p.rows_done;
+        e = p.error;
+        pthread_mutex_unlock (&p.lock);
+
+        for (; row < avail && ce == CE_NO_ERROR; row++) {
+            if (fun)
+                ce = fun (row, ccd->frame + row * ccd->width, ccd->width, arg);
+        }
+        if (e != CE_NO_ERROR)
+            break;
+    }
+    if (ce != CE_NO_ERROR) {
+        pthread_mutex_lock (&p.lock);
+        p.abort = true;
+        pthread_mutex_unlock (&p.lock);
+    }
+    pthread_join (t, NULL);
+    if (e == CE_NO_ERROR)
+        e = p.error;
+    if (e == CE_NO_ERROR)
+        e = ce;
+done:
+    pthread_cond_destroy (&p.cond);
+    pthread_mutex_destroy (&p.lock);
+    if (e == CE_NO_ERROR)
+        e = end_readout (ccd);
+
+    return e;
+}
+
+int sbig_ccd_readout_cb (sbig_ccd_t *ccd, int flags,
+                         sbig_ccd_row_f fun, void *arg)
+{
+    ushort *rowbuf = NULL;
+    ushort *pp;
+    int i, e;
+
+    if (!ccd->frame) {
+        if ((flags & SBIG_READOUT_SUBTRACT))
+            return CE_BAD_PARAMETER;
+        if (!(rowbuf = malloc (sizeof (*rowbuf) * ccd->width)))
+            return CE_OS_ERROR;
+    }
+    e = start_readout (ccd, flags);
     for (i = 0; e == CE_NO_ERROR && i < ccd->height; i++) {
-        e = read_subtract_line (ccd, ccd->left, ccd->width, pp);
-        pp += ccd->width;
+        pp = rowbuf ? rowbuf : ccd->frame + i * ccd->width;
+        e = readout_chunk (ccd, flags, i, 1, pp);
+        if (e == CE_NO_ERROR && fun)
+            e = fun (i, pp, ccd->width, arg);
     }
     if (e == CE_NO_ERROR)
         e = end_readout (ccd);
+    free (rowbuf);
 
     return e;
 }
 
+int sbig_ccd_set_calib (sbig_ccd_t *ccd, sbig_calib_t *cal)
+{
+    ccd->calib = cal;
+    return CE_NO_ERROR;
+}
+
+int sbig_ccd_set_threads (sbig_ccd_t *ccd, int nthreads)
+{
+    if (nthreads < 0)
+        return CE_BAD_PARAMETER;
+    ccd->nthreads = nthreads;
+    return CE_NO_ERROR;
+}
+
+struct convert_arg {
+    sbig_ccd_t *ccd;
+    ushort *out;
+};
+
+static void convert_band (int index, int row0, int nrows, void *arg)
+{
+    struct convert_arg *a = arg;
+
+    color_bayer_to_mono_rows (a->ccd->frame, a->out, a->ccd->width,
+                              a->ccd->height, row0, nrows);
+}
+
 int sbig_ccd_color_convert (sbig_ccd_t *ccd, const char *method)
 {
     if (!ccd->color_bayer) // FIXME: add support for Truesense (which cam?)
         return CE_BAD_PARAMETER;
+    if (!ccd->frame)
+        return CE_BAD_PARAMETER;
 
     if (!strncasecmp (method, "monochrome", strlen (method))) {
-        ushort *xframe;
+        struct convert_arg a = { .ccd = ccd };
 
-        if (!(xframe = calloc (ccd->height*ccd->width, sizeof (ushort))))
+        if (!(a.out = calloc (ccd->height*ccd->width, sizeof (ushort))))
             return CE_OS_ERROR;
-        color_bayer_to_mono (ccd->frame, xframe, ccd->width, ccd->height);
+        par_run (ccd->nthreads, ccd->height, convert_band, &a);
         free (ccd->frame);
-        ccd->frame = xframe;
+        ccd->frame = a.out;
+        ccd->stats_valid = 0;
         return CE_NO_ERROR;
     }
     return CE_BAD_PARAMETER;
@@ -597,7 +921,8 @@ int sbig_ccd_writepgm (sbig_ccd_t *ccd, const char *filename)
     FILE *f;
     int i, j;
 
-    assert (pp != NULL);
+    if (!pp)
+        return CE_BAD_PARAMETER;
 
     nrow = xzmalloc (sizeof (*nrow) * ccd->width);
 
@@ -639,72 +964,109 @@ double sbig_ccd_get_exposure_time (sbig_ccd_t *ccd)
     return ccd->exposureTime;
 }
 
-int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *maxp)
+int sbig_ccd_get_datamax (sbig_ccd_t *ccd, ushort *datamax)
 {
-    int i, j;
-    ushort max = 0;
-    ushort *pp = ccd->frame;
-    for (i = 0; i < ccd->height; i++) {
-        for (j = 0; j < ccd->width; j++)
-            if (*pp > max)
-                max = *pp;
+    switch (ccd->info0.cameraType) {
+        case ST7_CAMERA:
+        case ST8_CAMERA:
+            if (ccd->readout_mode != RM_1X1)
+                *datamax = 65000;
+            else if (!ccd->has_abg)
+                *datamax = 40000;
+            else
+                *datamax = 20000;
+            break;
+        case ST10_CAMERA:
+            if (ccd->readout_mode == RM_1X1)
+                *datamax = 50000;
+            else
+                *datamax = 65000;
+            break;
+        case ST9_CAMERA:
+        case ST2K_CAMERA:
+        default:
+            *datamax = 65000;
+            break;
     }
-    *maxp = max;
     return CE_NO_ERROR;
 }
 
-/* Borrowed from CSBIGImg::AutoBackgroundAndRange() (sdk/app).
+int sbig_ccd_set_readout_stats (sbig_ccd_t *ccd, int enable)
+{
+    ccd->stats_readout = enable ? 1 : 0;
+    return CE_NO_ERROR;
+}
+
+struct stats_arg {
+    sbig_ccd_t *ccd;
+    sbig_frame_stats_t *part;   /* per band */
+};
+
+static void stats_band (int index, int row0, int nrows, void *arg)
+{
+    struct stats_arg *a = arg;
+    ushort *pp = a->ccd->frame + (size_t)row0 * a->ccd->width;
+    int i;
+
+    for (i = 0; i < nrows; i++, pp += a->ccd->width)
+        sbig_stats_add_row (&a->part[index], pp, a->ccd->width);
+}
+
+/* One pass over the frame, split into bands whose partial statistics
+ * are merged.  Cached until the frame changes.
  */
-int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite)
+static int update_stats (sbig_ccd_t *ccd)
 {
-    ushort *pp = ccd->frame;
-    ulong hist[4096];
-    int i, j;
-    ulong totalPixels, histSum;
-    ulong s20, s99;
-    ushort p20, p99;
-    long back, range;
-
-    // calculate the pixel histogram with 4096 bins
-    memset(hist, 0, sizeof(hist));
-    for (i = 0; i < ccd->height; i++)
-            for (j = 0; j < ccd->width; j++)
-                    hist[(*pp++) >> 4]++;
-
-    // integrate the histogram and find the 20% and 99% points
-    totalPixels = (unsigned long)ccd->width * ccd->height;
-    s20 = (20 * totalPixels) / 100;
-    s99 = (99 * totalPixels) / 100;
-    histSum = 0;
-    p20 = p99 = 65535;
-    for (i = 0; i < 4096; i++) {
-            histSum += hist[i];
-            if (histSum >= s20 && p20 == 65535)
-                    p20 = i;
-            if (histSum >= s99 && p99 == 65535)
-                    p99 = i;
-    }
+    struct stats_arg a = { .ccd = ccd };
+    int i, nbands;
+    ushort datamax;
 
-    // set the range to 110% of the difference between
-    // the 99% and 20% histogram points, not letting
-    // it be too low or overflow unsigned short
-    range = (16L * (p99 - p20) * 11) / 10;
-    if (range < 64)
-            range = 64;
-    else if (range > 65536)
-            range = 65536;
-
-    // set the background to the 20% point lowered
-    // by 10% of the range so it's not completely
-    // black.  Also check for overrange and don't
-    // let a saturated image show up a black
-    back = 16L * p20 - range / 10;
-    if (p20 >= 4080)        // saturated image?
-            back = 16L * 4080 - range;
-
-    *cblack = back;
-    *cwhite = back + range;
+    if (ccd->stats_valid)
+        return CE_NO_ERROR;
+    if (!ccd->frame)
+        return CE_BAD_PARAMETER;
+    (void)sbig_ccd_get_datamax (ccd, &datamax);
+    nbands = par_nbands (ccd->nthreads, ccd->height);
+    a.part = xzmalloc (sizeof (a.part[0]) * nbands);
+    for (i = 0; i < nbands; i++)
+        sbig_stats_init (&a.part[i], datamax, SBIG_STATS_HOT_DELTA);
+    par_run (ccd->nthreads, ccd->height, stats_band, &a);
+    sbig_stats_init (ccd->stats, datamax, SBIG_STATS_HOT_DELTA);
+    for (i = 0; i < nbands; i++)
+        sbig_stats_merge (ccd->stats, &a.part[i]);
+    free (a.part);
+    sbig_stats_finish (ccd->stats);
+    ccd->stats_valid = 1;
+    return CE_NO_ERROR;
+}
 
+int sbig_ccd_get_stats (sbig_ccd_t *ccd, sbig_frame_stats_t *st)
+{
+    int e;
+
+    if ((e = update_stats (ccd)) != CE_NO_ERROR)
+        return e;
+    *st = *ccd->stats;
+    return CE_NO_ERROR;
+}
+
+int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *maxp)
+{
+    int e;
+
+    if ((e = update_stats (ccd)) != CE_NO_ERROR)
+        return e;
+    *maxp = ccd->stats->max;
+    return CE_NO_ERROR;
+}
+
+int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite)
+{
+    int e;
+
+    if ((e = update_stats (ccd)) != CE_NO_ERROR)
+        return e;
+    sbig_stats_contrast (ccd->stats, cblack, cwhite);
     return CE_NO_ERROR;
 }
 
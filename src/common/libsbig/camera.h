@@ -2,9 +2,12 @@
 #define _SBIG_CAMERA_H
 
 #include <time.h>
+#include <stdbool.h>
 
 #include "handle.h"
 #include "sbigudrv.h"
+#include "stats.h"
+#include "calib.h"
 
 typedef struct sbig_ccd sbig_ccd_t;
 
@@ -100,19 +103,98 @@ int sbig_ccd_start_exposure (sbig_ccd_t *ccd, ushort flags, double exposureTime)
 int sbig_ccd_get_exposure_status (sbig_ccd_t *ccd, PAR_COMMAND_STATUS *sp);
 int sbig_ccd_end_exposure (sbig_ccd_t *ccd, ushort flags);
 
+/* Wait for the exposure started by sbig_ccd_start_exposure() to complete.
+ * Sleeps until shortly before the exposure should end, then polls status
+ * at millisecond intervals, backing off gradually if the camera is late.
+ * 'timeout' is the number of seconds to allow past the expected end of the
+ * exposure (<= 0 means wait indefinitely), after which CE_RX_TIMEOUT is
+ * returned.  If 'cancel' is non-NULL it is called at least every 100ms,
+ * and if it returns true, CE_KBD_ESC is returned.  The exposure is not
+ * ended in either case.
+ */
+typedef bool (*sbig_cancel_f)(void *arg);
+
+int sbig_ccd_wait_exposure (sbig_ccd_t *ccd, double timeout,
+                            sbig_cancel_f cancel, void *arg);
+
 /* Readout to internal buffer (start, iterate reading lines, stop).
  * Ref SBIGUDrv sec 3.2.3, 3.2.4, 3.2.5
  */
 int sbig_ccd_readout (sbig_ccd_t *ccd);
 int sbig_ccd_readout_subtract (sbig_ccd_t *ccd);
 
+/* Set the number of rows read per chunk (default 32).  Rows are handed
+ * to pipelined readout consumers, and timed, a chunk at a time.
+ * sbig_ccd_readout_cb() always uses one row chunks.
+ */
+int sbig_ccd_set_readout_chunk (sbig_ccd_t *ccd, ushort rows);
+
+/* Get timing of the most recent readout.  Times are in seconds and
+ * cover only the ReadoutLine commands, not start/end readout.
+ */
+typedef struct {
+    int chunks;         /* number of chunks read */
+    int rows;           /* number of rows read */
+    double total;       /* total time in driver */
+    double min, max;    /* shortest and longest chunk */
+} sbig_readout_timing_t;
+
+int sbig_ccd_get_readout_timing (sbig_ccd_t *ccd, sbig_readout_timing_t *tp);
+
+/* Readout flags:
+ *  SBIG_READOUT_SUBTRACT - subtract the image already in the internal
+ *    buffer, as in sbig_ccd_readout_subtract().
+ *  SBIG_READOUT_CALIBRATE - calibrate each row as it is read, with the
+ *    calibration set by sbig_ccd_set_calib().
+ */
+enum {
+    SBIG_READOUT_SUBTRACT = 1,
+    SBIG_READOUT_CALIBRATE = 2,
+};
+
+/* Called once per row read out, in row order.  'data' points to 'width'
+ * pixels of row 'row' (0 based, relative to the window top).
+ * Return CE_NO_ERROR to continue, or an error code to abort the readout.
+ */
+typedef int (*sbig_ccd_row_f)(ushort row, ushort *data, ushort width,
+                              void *arg);
+
+/* Pipelined readout to internal buffer.  A producer thread pulls rows
+ * from the driver while 'fun' is called from the calling thread on each
+ * completed row, so per-row processing overlaps the transfer of the rows
+ * that follow.  'fun' must not issue driver commands.
+ */
+int sbig_ccd_readout_pipelined (sbig_ccd_t *ccd, int flags,
+                                sbig_ccd_row_f fun, void *arg);
+
+/* Synchronous readout that calls 'fun' on each row as soon as the driver
+ * returns it.  If the internal buffer is disabled (see below), rows are
+ * read into a single row buffer that is reused for every row, so 'data'
+ * is only valid for the duration of the call.  SBIG_READOUT_SUBTRACT
+ * requires the internal buffer.
+ */
+int sbig_ccd_readout_cb (sbig_ccd_t *ccd, int flags,
+                         sbig_ccd_row_f fun, void *arg);
+
+/* Enable/disable the internal frame buffer (default: enabled).
+ * When disabled, no full frame is allocated, only sbig_ccd_readout_cb()
+ * may be used for readout, and sbig_ccd_get_data() returns NULL.
+ */
+int sbig_ccd_set_frame_buffer (sbig_ccd_t *ccd, int enable);
+
 /* Convert single shot color image.
  * Set 'option' to one of the following (or a substring):
  *   - monochrome - convert to to mono using 3x3 kernel from SBIGUDrv sec 5.2
  */
 int sbig_ccd_color_convert (sbig_ccd_t *ccd, const char *option);
 
+/* Set the calibration used by SBIG_READOUT_CALIBRATE, or NULL.  It must
+ * be the size of the readout window, and is not copied.
+ */
+int sbig_ccd_set_calib (sbig_ccd_t *ccd, sbig_calib_t *cal);
+
 /* Get reference to internal buffer, a sequence of rows, pixels.
+ * Returns NULL if the internal buffer is disabled.
  */
 ushort *sbig_ccd_get_data (sbig_ccd_t *ccd, ushort *height, ushort *width);
 
@@ -129,9 +211,34 @@ double sbig_ccd_get_exposure_time (sbig_ccd_t *ccd);
  */
 int sbig_ccd_writepgm (sbig_ccd_t *ccd, const char *filename);
 
+/* Get the saturation level (FITS DATAMAX) for the current readout mode.
+ * Ref: SBIG USB Camera manual rev 14, table 3.2
+ */
+int sbig_ccd_get_datamax (sbig_ccd_t *ccd, ushort *datamax);
+
+/* Accumulate frame statistics row by row during readout (default: off).
+ * A following sbig_ccd_get_stats() then needs no pass over the frame.
+ * This also works with the internal buffer disabled.
+ */
+int sbig_ccd_set_readout_stats (sbig_ccd_t *ccd, int enable);
+
+/* Get statistics for the frame in the internal buffer.  They are computed
+ * in one pass and cached until the next readout or color conversion.
+ * Saturated pixels are those >= datamax; hot_delta is SBIG_STATS_HOT_DELTA.
+ */
+int sbig_ccd_get_stats (sbig_ccd_t *ccd, sbig_frame_stats_t *st);
+
+/* Get max pixel value, from sbig_ccd_get_stats().
+ */
 int sbig_ccd_get_max (sbig_ccd_t *ccd, ushort *max);
 
-/* Calculate CWHITE and CBLACK values from image data.
+/* Set the number of threads used by color_convert and get_stats,
+ * which split the frame into bands of rows.
+ * Default: 0, meaning one per online CPU.
+ */
+int sbig_ccd_set_threads (sbig_ccd_t *ccd, int nthreads);
+
+/* Calculate CWHITE and CBLACK values from sbig_ccd_get_stats().
  */
 int sbig_ccd_auto_contrast (sbig_ccd_t *ccd, long *cblack, long *cwhite);
 
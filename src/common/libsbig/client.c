@@ -0,0 +1,183 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "client.h"
+
+struct sbig_client {
+    int fd;
+    char buf[SBIG_CLIENT_LINE];
+    size_t len;                 /* bytes in buf */
+};
+
+sbig_client_t *sbig_client_connect (const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    sbig_client_t *c;
+
+    if (!path && !(path = getenv ("SBIGD_SOCKET")))
+        path = SBIG_CLIENT_SOCKET;
+    if (strlen (path) >= sizeof (addr.sun_path)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    strcpy (addr.sun_path, path);
+    if (!(c = calloc (1, sizeof (*c))))
+        return NULL;
+    if ((c->fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+        goto error;
+    if (connect (c->fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+        goto error;
+    return c;
+error:
+    sbig_client_destroy (c);
+    return NULL;
+}
+
+void sbig_client_destroy (sbig_client_t *c)
+{
+    if (c) {
+        int saved_errno = errno;
+        if (c->fd >= 0)
+            (void)close (c->fd);
+        free (c);
+        errno = saved_errno;
+    }
+}
+
+static int write_all (int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write (fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read a line into c->buf, without the newline.
+ */
+static int read_line (sbig_client_t *c)
+{
+    ssize_t n;
+    char *nl;
+
+    c->len = 0;
+    for (;;) {
+        if (c->len == sizeof (c->buf)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if ((n = read (c->fd, c->buf + c->len, 1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        c->len++;
+        if ((nl = memchr (c->buf, '\n', c->len))) {
+            *nl = '\0';
+            return 0;
+        }
+    }
+}
+
+int sbig_client_request (sbig_client_t *c, char *reply, size_t len,
+                         const char *fmt, ...)
+{
+    char req[SBIG_CLIENT_LINE];
+    va_list ap;
+    const char *rest;
+    int n, rc;
+
+    va_start (ap, fmt);
+    n = vsnprintf (req, sizeof (req) - 1, fmt, ap);
+    va_end (ap);
+    if (n < 0 || n >= sizeof (req) - 1 || strchr (req, '\n')) {
+        errno = EINVAL;
+        return -1;
+    }
+    req[n++] = '\n';
+    if (write_all (c->fd, req, n) < 0 || read_line (c) < 0)
+        return -1;
+    if (!strncmp (c->buf, "ok", 2) && (c->buf[2] == ' ' || !c->buf[2]))
+        rc = 0;
+    else if (!strncmp (c->buf, "error", 5) && (c->buf[5] == ' '
+                                            || !c->buf[5]))
+        rc = -1;
+    else {
+        errno = EPROTO;
+        return -1;
+    }
+    rest = c->buf + (rc == 0 ? 2 : 5);
+    while (*rest == ' ')
+        rest++;
+    if (reply)
+        snprintf (reply, len, "%s", rest);
+    if (rc < 0)
+        errno = EREMOTEIO;
+    return rc;
+}
+
+int sbig_client_get (const char *reply, const char *key, char *val,
+                     size_t len)
+{
+    size_t keylen = strlen (key);
+    const char *p = reply;
+
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        if (!strncmp (p, key, keylen) && p[keylen] == '=') {
+            p += keylen + 1;
+            snprintf (val, len, "%.*s", (int)strcspn (p, " "), p);
+            return 0;
+        }
+        p += strcspn (p, " ");
+    }
+    return -1;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
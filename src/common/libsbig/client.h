@@ -0,0 +1,42 @@
+#ifndef _SBIG_CLIENT_H
+#define _SBIG_CLIENT_H
+
+#include <stddef.h>
+
+/* Client side of the sbigd protocol.  sbigd owns the camera and takes
+ * requests from any number of local clients over a unix socket.  Each
+ * request is one line, e.g. "status" or "expose time=30", and gets one
+ * reply line: "ok" followed by key=value pairs, or "error" and a message.
+ */
+
+#define SBIG_CLIENT_SOCKET  "/tmp/sbigd.sock"   /* default, or $SBIGD_SOCKET */
+#define SBIG_CLIENT_LINE    512                 /* maximum line length */
+
+typedef struct sbig_client sbig_client_t;
+
+/* Connect to sbigd at 'path', or the default if NULL.  Returns NULL with
+ * errno set on failure: ENOENT or ECONNREFUSED if sbigd is not running.
+ */
+sbig_client_t *sbig_client_connect (const char *path);
+void sbig_client_destroy (sbig_client_t *c);
+
+/* Send a request and wait for the reply.  On "ok", the rest of the reply
+ * is copied to 'reply' and 0 is returned.  On "error", the message is
+ * copied to 'reply' and -1 is returned with errno set to EREMOTEIO.
+ * Otherwise -1 is returned with errno set.
+ */
+int sbig_client_request (sbig_client_t *c, char *reply, size_t len,
+                         const char *fmt, ...)
+                         __attribute__ ((format (printf, 4, 5)));
+
+/* Copy the value of 'key' in a reply to 'val'.
+ * Returns -1 if it is not there.
+ */
+int sbig_client_get (const char *reply, const char *key, char *val,
+                     size_t len);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,250 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Co-add frames into 32-bit sums in the background, optionally shifting
+ * them into alignment first
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "sbigudrv.h"
+#include "coadd.h"
+#include "register.h"
+#include "parallel.h"
+
+#include "src/common/libutil/accum.h"
+#include "src/common/libutil/xzmalloc.h"
+
+#define SUBPIX  64      /* bilinear weights are in 1/SUBPIX pixels */
+
+struct sbig_coadd {
+    ushort height, width;
+    uint32_t *acc;
+    int count;
+    const ushort *frame;        /* being added */
+    pthread_t t;
+    bool running;
+    sbig_register_t *reg;
+    ushort *cover;              /* with reg, frames summed per pixel */
+    double dy, dx;              /* shift of the last frame */
+    bool registered;
+    int sy, sx;                 /* whole pixels of the shift */
+    int fy, fx;                 /* and fraction, in 1/SUBPIX */
+};
+
+sbig_coadd_t *sbig_coadd_create (ushort height, ushort width)
+{
+    sbig_coadd_t *co;
+
+    if (height == 0 || width == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    co = xzmalloc (sizeof (*co));
+    co->height = height;
+    co->width = width;
+    co->acc = xzmalloc ((size_t)height * width * sizeof (uint32_t));
+    return co;
+}
+
+void sbig_coadd_destroy (sbig_coadd_t *co)
+{
+    if (co) {
+        sbig_coadd_wait (co);
+        free (co->acc);
+        free (co->cover);
+        free (co);
+    }
+}
+
+static void add_band (int index, int row0, int nrows, void *arg)
+{
+    sbig_coadd_t *co = arg;
+    size_t off = (size_t)row0 * co->width;
+
+    accum_ushort (co->acc + off, co->frame + off, (size_t)nrows * co->width);
+}
+
+/* Add frame(y + dy, x + dx) where it falls within the frame.
+ */
+static void add_shifted_band (int index, int row0, int nrows, void *arg)
+{
+    sbig_coadd_t *co = arg;
+    int w = co->width;
+    int x0 = co->sx < 0 ? -co->sx : 0;
+    int x1 = w - co->sx - (co->fx > 0);
+    int dx1 = co->fx > 0;
+    uint32_t wx0 = SUBPIX - co->fx, wx1 = co->fx;
+    uint32_t wy0 = SUBPIX - co->fy, wy1 = co->fy;
+    int y, x;
+
+    if (x1 > w)
+        x1 = w;
+    for (y = row0; y < row0 + nrows; y++) {
+        int sy = y + co->sy;
+        const ushort *r0, *r1;
+        uint32_t *acc = co->acc + (size_t)y * w;
+        ushort *cover = co->cover + (size_t)y * w;
+
+        if (sy < 0 || sy + (co->fy > 0) >= co->height)
+            continue;
+        r0 = co->frame + (size_t)sy * w;
+        r1 = co->fy > 0 ? r0 + w : r0;
+        for (x = x0; x < x1; x++) {
+            int i = x + co->sx;
+            uint32_t v = (r0[i] * wx0 + r0[i + dx1] * wx1) * wy0
+                       + (r1[i] * wx0 + r1[i + dx1] * wx1) * wy1;
+            acc[x] += (v + SUBPIX * SUBPIX / 2) / (SUBPIX * SUBPIX);
+            cover[x]++;
+        }
+    }
+}
+
+/* Register the frame, or make it the reference, and set up its shift.
+ */
+static bool register_frame (sbig_coadd_t *co)
+{
+    double fy, fx;
+
+    co->dy = co->dx = 0;
+    if (!sbig_register_has_reference (co->reg))
+        sbig_register_set_reference (co->reg, co->frame);
+    else if (sbig_register_measure (co->reg, co->frame, &co->dy, &co->dx) < 0)
+        return false;
+    fy = floor (co->dy);
+    fx = floor (co->dx);
+    co->sy = fy;
+    co->sx = fx;
+    co->fy = lround ((co->dy - fy) * SUBPIX);
+    co->fx = lround ((co->dx - fx) * SUBPIX);
+    if (co->fy == SUBPIX) {
+        co->sy++;
+        co->fy = 0;
+    }
+    if (co->fx == SUBPIX) {
+        co->sx++;
+        co->fx = 0;
+    }
+    return true;
+}
+
+static void *add_thread (void *arg)
+{
+    sbig_coadd_t *co = arg;
+
+    if (co->reg) {
+        if (!(co->registered = register_frame (co)))
+            return NULL;
+        par_run (0, co->height, add_shifted_band, co);
+    }
+    else
+        par_run (0, co->height, add_band, co);
+    co->count++;
+    return NULL;
+}
+
+int sbig_coadd_add (sbig_coadd_t *co, const ushort *frame)
+{
+    sbig_coadd_wait (co);
+    if (co->count == SBIG_COADD_MAX) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    co->frame = frame;
+    if (pthread_create (&co->t, NULL, add_thread, co) == 0)
+        co->running = true;
+    else
+        add_thread (co);
+    return 0;
+}
+
+void sbig_coadd_wait (sbig_coadd_t *co)
+{
+    if (co->running) {
+        pthread_join (co->t, NULL);
+        co->running = false;
+    }
+}
+
+void sbig_coadd_set_register (sbig_coadd_t *co, sbig_register_t *reg)
+{
+    sbig_coadd_wait (co);
+    co->reg = reg;
+    if (reg && !co->cover)
+        co->cover = xzmalloc ((size_t)co->height * co->width
+                              * sizeof (co->cover[0]));
+}
+
+bool sbig_coadd_get_shift (sbig_coadd_t *co, double *dy, double *dx)
+{
+    sbig_coadd_wait (co);
+    *dy = co->dy;
+    *dx = co->dx;
+    return co->registered;
+}
+
+int sbig_coadd_count (sbig_coadd_t *co)
+{
+    sbig_coadd_wait (co);
+    return co->count;
+}
+
+int sbig_coadd_finish (sbig_coadd_t *co, ushort *out)
+{
+    size_t i, n = (size_t)co->height * co->width;
+    uint32_t half;
+
+    sbig_coadd_wait (co);
+    if (co->count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (co->cover) {
+        for (i = 0; i < n; i++) {
+            out[i] = co->cover[i] ? (co->acc[i] + co->cover[i] / 2)
+                                    / co->cover[i] : 0;
+        }
+        memset (co->cover, 0, n * sizeof (co->cover[0]));
+    } else {
+        half = co->count / 2;
+        for (i = 0; i < n; i++)
+            out[i] = (co->acc[i] + half) / co->count;
+    }
+    memset (co->acc, 0, n * sizeof (uint32_t));
+    co->count = 0;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,62 @@
+#ifndef _SBIG_COADD_H
+#define _SBIG_COADD_H
+
+#include <stdbool.h>
+
+#include "sbigudrv.h"
+#include "register.h"
+
+/* Co-add a series of short exposures into one frame.  Frames are summed
+ * to 32 bits by a background thread, so the sum of one frame (and its
+ * registration, if any) can overlap the next exposure.
+ */
+
+#define SBIG_COADD_MAX  65535   /* frames that cannot overflow the sums */
+
+typedef struct sbig_coadd sbig_coadd_t;
+
+/* Create an empty sum of frames of 'height' x 'width' pixels.
+ * Returns NULL with errno set on failure.
+ */
+sbig_coadd_t *sbig_coadd_create (ushort height, ushort width);
+void sbig_coadd_destroy (sbig_coadd_t *co);
+
+/* Start adding 'frame' in the background, once any previous add is done.
+ * 'frame' must not be modified until sbig_coadd_wait() returns.
+ * Returns -1 with errno set if SBIG_COADD_MAX frames have been added.
+ */
+int sbig_coadd_add (sbig_coadd_t *co, const ushort *frame);
+
+/* Wait for the frame being added, if any.
+ */
+void sbig_coadd_wait (sbig_coadd_t *co);
+
+/* Shift and add: register each frame with 'reg', whose reference is set
+ * from the first frame added if it has none, and shift it by bilinear
+ * interpolation into alignment before adding it.  Frames that do not
+ * register are left out.  Each pixel of the mean is over the frames that
+ * covered it, or 0 if none did.  Set before adding any frames; 'reg'
+ * must outlive the sum.
+ */
+void sbig_coadd_set_register (sbig_coadd_t *co, sbig_register_t *reg);
+
+/* Get the shift applied to the last frame added while registering.
+ * Returns false if it did not register and was left out.
+ */
+bool sbig_coadd_get_shift (sbig_coadd_t *co, double *dy, double *dx);
+
+/* Number of frames in the sum, once any being added is done.
+ */
+int sbig_coadd_count (sbig_coadd_t *co);
+
+/* Store the mean of the frames added in 'out', so pixel values keep the
+ * scale of a single exposure, and empty the sum.
+ * Returns -1 with errno set if no frames were added.
+ */
+int sbig_coadd_finish (sbig_coadd_t *co, ushort *out);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,370 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* In-memory library of master darks
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/param.h>
+#include <fitsio.h>
+
+#include "sbigudrv.h"
+#include "camera.h"
+#include "darklib.h"
+
+#include "src/common/libutil/xzmalloc.h"
+#include "src/common/libutil/list.h"
+
+/* When two darks have the same setup and temperature bucket, the one
+ * with the higher rank is kept, or if they tie, the later file name,
+ * e.g. the newest of a set of timestamped frames.
+ */
+enum {
+    RANK_FRAME = 0,             /* a single dark frame */
+    RANK_MASTER = 1,            /* a master from sbig stack */
+    RANK_ADDED = 2,             /* added with sbig_darklib_add() */
+};
+
+struct dark {
+    sbig_dark_key_t key;
+    long bucket;
+    int rank;
+    char *name;
+    ushort *data;
+};
+
+struct sbig_darklib {
+    double temp_step;
+    List darks;
+    char error_string[160];
+};
+
+static void dark_destroy (struct dark *d)
+{
+    if (d) {
+        free (d->data);
+        free (d->name);
+        free (d);
+    }
+}
+
+sbig_darklib_t *sbig_darklib_create (double temp_step)
+{
+    sbig_darklib_t *lib;
+
+    if (temp_step <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    lib = xzmalloc (sizeof (*lib));
+    lib->temp_step = temp_step;
+    lib->darks = list_create ((ListDelF)dark_destroy);
+    return lib;
+}
+
+void sbig_darklib_destroy (sbig_darklib_t *lib)
+{
+    if (lib) {
+        list_destroy (lib->darks);
+        free (lib);
+    }
+}
+
+static long bucket (sbig_darklib_t *lib, double temperature)
+{
+    return lround (temperature / lib->temp_step);
+}
+
+static bool same_setup (const sbig_dark_key_t *a, const sbig_dark_key_t *b)
+{
+    return fabs (a->exposure_time - b->exposure_time) < 0.001
+        && a->readout_mode == b->readout_mode
+        && a->top == b->top && a->left == b->left
+        && a->height == b->height && a->width == b->width;
+}
+
+static int add_dark (sbig_darklib_t *lib, const sbig_dark_key_t *key,
+                     const ushort *data, int rank, const char *name)
+{
+    size_t len = (size_t)key->height * key->width * sizeof (ushort);
+    ListIterator itr;
+    struct dark *d;
+
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    itr = list_iterator_create (lib->darks);
+    while ((d = list_next (itr))) {
+        if (same_setup (&d->key, key)
+                && d->bucket == bucket (lib, key->temperature)) {
+            if (d->rank > rank
+                    || (d->rank == rank && strcmp (d->name, name) > 0)) {
+                list_iterator_destroy (itr);
+                return 0;
+            }
+            list_delete (itr);
+            break;
+        }
+    }
+    list_iterator_destroy (itr);
+
+    d = xzmalloc (sizeof (*d));
+    d->key = *key;
+    d->bucket = bucket (lib, key->temperature);
+    d->rank = rank;
+    d->name = xstrdup (name);
+    d->data = xzmalloc (len);
+    memcpy (d->data, data, len);
+    list_append (lib->darks, d);
+    return 0;
+}
+
+int sbig_darklib_add (sbig_darklib_t *lib, const sbig_dark_key_t *key,
+                      const ushort *data)
+{
+    return add_dark (lib, key, data, RANK_ADDED, "");
+}
+
+const ushort *sbig_darklib_find (sbig_darklib_t *lib,
+                                 const sbig_dark_key_t *key)
+{
+    ListIterator itr = list_iterator_create (lib->darks);
+    struct dark *d;
+
+    while ((d = list_next (itr))) {
+        if (same_setup (&d->key, key)
+                && d->bucket == bucket (lib, key->temperature))
+            break;
+    }
+    list_iterator_destroy (itr);
+    return d ? d->data : NULL;
+}
+
+int sbig_darklib_count (sbig_darklib_t *lib)
+{
+    return list_count (lib->darks);
+}
+
+const char *sbig_darklib_get_errstr (sbig_darklib_t *lib)
+{
+    return lib->error_string;
+}
+
+static void fits_error (sbig_darklib_t *lib, const char *path, int status)
+{
+    char buf[FLEN_ERRMSG];
+
+    fits_get_errstatus (status, buf);
+    snprintf (lib->error_string, sizeof (lib->error_string), "%s: %s",
+              path, buf);
+}
+
+/* True if the header has SWMODIFY = 'sbig-stack', i.e. a stacked master.
+ */
+static bool is_master (fitsfile *f, int *status)
+{
+    char name[FLEN_KEYWORD], value[FLEN_VALUE], comment[FLEN_COMMENT];
+    int i, nkeys;
+
+    if (fits_get_hdrspace (f, &nkeys, NULL, status))
+        return false;
+    for (i = 1; i <= nkeys; i++) {
+        if (fits_read_keyn (f, i, name, value, comment, status))
+            return false;
+        if (!strcmp (name, "SWMODIFY")
+                && !strncmp (value, "'sbig-stack", 11))
+            return true;
+    }
+    return false;
+}
+
+/* Returns 1 if loaded, 0 if not a dark frame, -1 on error.
+ */
+static int load_file (sbig_darklib_t *lib, const char *path)
+{
+    fitsfile *f = NULL;
+    int status = 0;
+    char imagetyp[FLEN_VALUE];
+    sbig_dark_key_t key;
+    int bitpix, naxis, x, y;
+    long naxes[2] = { 0, 0 };
+    long fpixel[2] = { 1, 1 };
+    long pedestal = 0;
+    ushort mode;
+    ushort *data = NULL;
+    const char *name;
+    size_t i, n;
+    int rank;
+    int rc = -1;
+
+    if (fits_open_image (&f, path, READONLY, &status))
+        goto error;
+    if (fits_read_key (f, TSTRING, "IMAGETYP", imagetyp, NULL, &status)) {
+        if (status != KEY_NO_EXIST)
+            goto error;
+        status = 0;
+        rc = 0;
+        goto done;
+    }
+    if (strcmp (imagetyp, "Dark Frame") != 0) {
+        rc = 0;
+        goto done;
+    }
+    fits_get_img_param (f, 2, &bitpix, &naxis, naxes, &status);
+    fits_read_key (f, TDOUBLE, "EXPTIME", &key.exposure_time, NULL, &status);
+    fits_read_key (f, TDOUBLE, "CCD-TEMP", &key.temperature, NULL, &status);
+    fits_read_key (f, TUSHORT, "RESMODE", &mode, NULL, &status);
+    fits_read_key (f, TINT, "XORGSUBF", &x, NULL, &status);
+    fits_read_key (f, TINT, "YORGSUBF", &y, NULL, &status);
+    if (status)
+        goto error;
+    if (fits_read_key (f, TLONG, "PEDESTAL", &pedestal, NULL, &status)) {
+        if (status != KEY_NO_EXIST)
+            goto error;
+        status = 0;
+    }
+    rank = is_master (f, &status) ? RANK_MASTER : RANK_FRAME;
+    if (status)
+        goto error;
+    if (naxis != 2 || naxes[0] < 1 || naxes[0] > 65535
+                   || naxes[1] < 1 || naxes[1] > 65535) {
+        snprintf (lib->error_string, sizeof (lib->error_string),
+                  "%s: not a 2D image", path);
+        goto done;
+    }
+    key.readout_mode = mode;
+    key.left = x;
+    key.top = y;
+    key.width = naxes[0];
+    key.height = naxes[1];
+    n = (size_t)naxes[0] * naxes[1];
+    data = xzmalloc (n * sizeof (ushort));
+    if (fits_read_pix (f, TUSHORT, fpixel, n, NULL, data, NULL, &status))
+        goto error;
+
+    /* PEDESTAL is added to ADU to get true counts.
+     */
+    if (pedestal != 0) {
+        for (i = 0; i < n; i++) {
+            long v = data[i] + pedestal;
+            data[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+        }
+    }
+    name = strrchr (path, '/');
+    name = name ? name + 1 : path;
+    if (add_dark (lib, &key, data, rank, name) < 0) {
+        snprintf (lib->error_string, sizeof (lib->error_string), "%s: %s",
+                  path, strerror (errno));
+        goto done;
+    }
+    rc = 1;
+    goto done;
+error:
+    fits_error (lib, path, status);
+done:
+    if (f) {
+        status = 0;
+        fits_close_file (f, &status);
+    }
+    free (data);
+    return rc;
+}
+
+int sbig_darklib_load (sbig_darklib_t *lib, const char *path)
+{
+    int rc = load_file (lib, path);
+
+    if (rc == 0) {
+        snprintf (lib->error_string, sizeof (lib->error_string),
+                  "%s: not a dark frame", path);
+        return -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+static bool is_fits_name (const char *name)
+{
+    const char *ext = strrchr (name, '.');
+
+    return ext && (!strcasecmp (ext, ".fits") || !strcasecmp (ext, ".fit")
+                                              || !strcasecmp (ext, ".fts"));
+}
+
+int sbig_darklib_load_dir (sbig_darklib_t *lib, const char *dir)
+{
+    DIR *d;
+    struct dirent *ent;
+    char path[PATH_MAX];
+    int n, count = 0;
+
+    if (!(d = opendir (dir))) {
+        snprintf (lib->error_string, sizeof (lib->error_string), "%s: %s",
+                  dir, strerror (errno));
+        return -1;
+    }
+    while ((ent = readdir (d))) {
+        if (!is_fits_name (ent->d_name))
+            continue;
+        if (snprintf (path, sizeof (path), "%s/%s", dir, ent->d_name)
+                                                        >= sizeof (path))
+            continue;
+        if ((n = load_file (lib, path)) < 0) {
+            count = -1;
+            break;
+        }
+        count += n;
+    }
+    closedir (d);
+    return count;
+}
+
+int sbig_dark_key_ccd (sbig_ccd_t *ccd, double exposure_time,
+                       double temperature, sbig_dark_key_t *key)
+{
+    int e;
+
+    if ((e = sbig_ccd_get_readout_mode (ccd, &key->readout_mode))
+                                                    != CE_NO_ERROR)
+        return e;
+    if ((e = sbig_ccd_get_window (ccd, &key->top, &key->left,
+                                  &key->height, &key->width)) != CE_NO_ERROR)
+        return e;
+    key->exposure_time = exposure_time;
+    key->temperature = temperature;
+    return CE_NO_ERROR;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,74 @@
+#ifndef _SBIG_DARKLIB_H
+#define _SBIG_DARKLIB_H
+
+#include "sbigudrv.h"
+#include "camera.h"
+
+/* Library of master dark frames held in memory, so light frames can be
+ * dark subtracted on the host instead of taking a fresh dark for each
+ * one: pass a master dark to sbig_calib_set_dark() and read out with
+ * SBIG_READOUT_CALIBRATE.  Darks are keyed by exposure time,
+ * readout mode, window, and CCD temperature rounded to a bucket.
+ */
+
+#define SBIG_DARKLIB_TEMP_STEP  1.0     /* default temperature bucket, C */
+
+typedef struct sbig_darklib sbig_darklib_t;
+
+typedef struct {
+    double exposure_time;               /* seconds */
+    READOUT_BINNING_MODE readout_mode;
+    ushort top, left, height, width;    /* window */
+    double temperature;                 /* CCD temperature, C */
+} sbig_dark_key_t;
+
+/* Create an empty library whose temperature buckets are 'temp_step'
+ * degrees wide.  Returns NULL with errno set on failure.
+ */
+sbig_darklib_t *sbig_darklib_create (double temp_step);
+void sbig_darklib_destroy (sbig_darklib_t *lib);
+
+/* Add a copy of a dark of key->height x key->width pixels, replacing
+ * any dark with the same key and temperature bucket.  The library holds
+ * at most one dark per key and bucket.
+ */
+int sbig_darklib_add (sbig_darklib_t *lib, const sbig_dark_key_t *key,
+                      const ushort *data);
+
+/* Load a master dark from a FITS file (IMAGETYP 'Dark Frame', e.g. from
+ * sbig snap -T df or sbig stack), keyed by its EXPTIME, RESMODE,
+ * XORGSUBF/YORGSUBF, size, and CCD-TEMP.  PEDESTAL is applied.
+ * A file loaded earlier with the same key and bucket is kept instead if
+ * it is a master from sbig stack and this is not, or if both are of the
+ * same kind and its file name sorts later, so the newest of a set of
+ * timestamped frames wins regardless of load order.
+ * Returns -1 on failure (see sbig_darklib_get_errstr()).
+ */
+int sbig_darklib_load (sbig_darklib_t *lib, const char *path);
+
+/* Load every dark in directory 'dir' as above, skipping FITS files that
+ * are not dark frames.  Returns the number read, or -1 on failure.
+ */
+int sbig_darklib_load_dir (sbig_darklib_t *lib, const char *dir);
+
+int sbig_darklib_count (sbig_darklib_t *lib);
+const char *sbig_darklib_get_errstr (sbig_darklib_t *lib);
+
+/* Find the dark for 'key': exposure time within a millisecond, same
+ * readout mode and window, and same temperature bucket.
+ * Returns NULL if there is none.
+ */
+const ushort *sbig_darklib_find (sbig_darklib_t *lib,
+                                 const sbig_dark_key_t *key);
+
+/* Fill in 'key' for the next exposure of 'ccd', from its readout mode
+ * and window.
+ */
+int sbig_dark_key_ccd (sbig_ccd_t *ccd, double exposure_time,
+                       double temperature, sbig_dark_key_t *key);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,325 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+
+/* Star detection and focus metrics
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "sbigudrv.h"
+#include "focus.h"
+#include "parallel.h"
+
+#include "src/common/libutil/xzmalloc.h"
+
+#define SAMPLES     65536       /* pixels sampled for background and noise */
+#define CANDIDATES  (4 * SBIG_FOCUS_MAX_STARS)  /* kept per band */
+#define RADIAL_STEPS 10         /* radial profile bins per pixel */
+#define RADIAL_BINS (SBIG_FOCUS_RADIUS * RADIAL_STEPS)
+
+struct star {
+    int y, x;
+    ushort peak;
+};
+
+struct band {
+    struct star cand[CANDIDATES];
+    int ncand;
+    int min;                    /* index of the faintest candidate */
+    double gradient;            /* Brenner sum */
+};
+
+struct scan_arg {
+    const ushort *data;
+    int height, width;
+    ushort thresh, half, datamax;
+    struct band *bands;
+};
+
+/* Median and median absolute deviation of a sample of pixels, from a
+ * histogram of their values.
+ */
+static void background (const ushort *data, size_t npix, double *bg,
+                        double *noise)
+{
+    uint32_t *hist = xzmalloc (65536 * sizeof (hist[0]));
+    size_t stride = npix > SAMPLES ? npix / SAMPLES : 1;
+    size_t i, n = 0, cum = 0;
+    int med, d;
+
+    for (i = 0; i < npix; i += stride) {
+        hist[data[i]]++;
+        n++;
+    }
+    for (med = 0; med < 65535; med++) {
+        if ((cum += hist[med]) * 2 >= n)
+            break;
+    }
+    cum = hist[med];
+    for (d = 1; cum * 2 < n && d < 65536; d++) {
+        if (med - d >= 0)
+            cum += hist[med - d];
+        if (med + d <= 65535)
+            cum += hist[med + d];
+    }
+    free (hist);
+    *bg = med;
+    *noise = 1.4826 * (d - 1);
+}
+
+static void add_candidate (struct band *b, int y, int x, ushort peak)
+{
+    int i;
+
+    if (b->ncand < CANDIDATES) {
+        b->cand[b->ncand] = (struct star){ .y = y, .x = x, .peak = peak };
+        if (b->ncand == 0 || peak < b->cand[b->min].peak)
+            b->min = b->ncand;
+        b->ncand++;
+        return;
+    }
+    if (peak <= b->cand[b->min].peak)
+        return;
+    b->cand[b->min] = (struct star){ .y = y, .x = x, .peak = peak };
+    for (i = 0; i < b->ncand; i++) {
+        if (b->cand[i].peak < b->cand[b->min].peak)
+            b->min = i;
+    }
+}
+
+/* A star candidate is a local maximum above the detection threshold,
+ * not saturated, with at least two of its four neighbors above half the
+ * threshold, which rejects hot pixels and cosmic rays.
+ */
+static void scan_band (int index, int row0, int nrows, void *arg)
+{
+    struct scan_arg *a = arg;
+    struct band *b = &a->bands[index];
+    int w = a->width;
+    int y, x;
+
+    for (y = row0; y < row0 + nrows; y++) {
+        const ushort *p = a->data + (size_t)y * w;
+        uint64_t g = 0;
+
+        for (x = 0; x + 2 < w; x++) {
+            int d = p[x + 2] - p[x];
+            g += (int64_t)d * d;
+        }
+        b->gradient += g;
+
+        if (y < SBIG_FOCUS_RADIUS || y >= a->height - SBIG_FOCUS_RADIUS)
+            continue;
+        for (x = SBIG_FOCUS_RADIUS; x < w - SBIG_FOCUS_RADIUS; x++) {
+            const ushort *up = p - w, *dn = p + w;
+            ushort v = p[x];
+            int n;
+
+            if (v <= a->thresh || v >= a->datamax)
+                continue;
+            if (v <= p[x - 1] || v < p[x + 1]
+                    || v <= up[x - 1] || v <= up[x] || v <= up[x + 1]
+                    || v < dn[x - 1] || v < dn[x] || v < dn[x + 1])
+                continue;
+            n = (p[x - 1] > a->half) + (p[x + 1] > a->half)
+              + (up[x] > a->half) + (dn[x] > a->half);
+            if (n < 2)
+                continue;
+            add_candidate (b, y, x, v);
+        }
+    }
+}
+
+static int cmp_peak (const void *a, const void *b)
+{
+    const struct star *s1 = a, *s2 = b;
+
+    return (int)s2->peak - (int)s1->peak;
+}
+
+static int cmp_double (const void *a, const void *b)
+{
+    double d1 = *(const double *)a, d2 = *(const double *)b;
+
+    return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+}
+
+static double median (double *v, int n)
+{
+    qsort (v, n, sizeof (v[0]), cmp_double);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+/* Measure the star near (y, x) within the aperture: recenter on its
+ * centroid (cy, cx), then find the diameter enclosing half its flux from
+ * a radial profile, and FWHM from the area of pixels above half the peak.
+ * Returns -1 if there is no flux above the background.
+ */
+static int measure_star (const ushort *data, int height, int width,
+                         const struct star *s, double bg,
+                         double *hfd, double *fwhm, double *cyp, double *cxp)
+{
+    const int r = SBIG_FOCUS_RADIUS;
+    double cy = s->y, cx = s->x;
+    double profile[RADIAL_BINS] = { 0 };
+    double flux = 0, cum = 0, half = (s->peak - bg) / 2;
+    int iter, y, x, y0, x0, k, area = 0;
+
+    for (iter = 0; iter < 2; iter++) {
+        double sy = 0, sx = 0, sf = 0;
+
+        y0 = lround (cy);
+        x0 = lround (cx);
+        if (y0 < r)
+            y0 = r;
+        if (y0 > height - 1 - r)
+            y0 = height - 1 - r;
+        if (x0 < r)
+            x0 = r;
+        if (x0 > width - 1 - r)
+            x0 = width - 1 - r;
+        for (y = y0 - r; y <= y0 + r; y++) {
+            const ushort *p = data + (size_t)y * width;
+            for (x = x0 - r; x <= x0 + r; x++) {
+                double v = p[x] - bg;
+                if (v > 0 && (y - y0) * (y - y0) + (x - x0) * (x - x0) <= r * r) {
+                    sy += v * y;
+                    sx += v * x;
+                    sf += v;
+                }
+            }
+        }
+        if (sf <= 0)
+            return -1;
+        cy = sy / sf;
+        cx = sx / sf;
+    }
+    for (y = y0 - r; y <= y0 + r; y++) {
+        const ushort *p = data + (size_t)y * width;
+        for (x = x0 - r; x <= x0 + r; x++) {
+            double v = p[x] - bg;
+            double d = sqrt ((y - cy) * (y - cy) + (x - cx) * (x - cx));
+            if (v > 0 && d < r) {
+                profile[(int)(d * RADIAL_STEPS)] += v;
+                flux += v;
+                if (v >= half)
+                    area++;
+            }
+        }
+    }
+    if (flux <= 0)
+        return -1;
+    for (k = 0; k < RADIAL_BINS; k++) {
+        if (cum + profile[k] >= flux / 2)
+            break;
+        cum += profile[k];
+    }
+    *hfd = 2 * (k + (flux / 2 - cum) / profile[k]) / RADIAL_STEPS;
+    *fwhm = 2 * sqrt (area / M_PI);
+    *cyp = cy;
+    *cxp = cx;
+    return 0;
+}
+
+int sbig_focus_measure (const ushort *data, ushort height, ushort width,
+                        ushort datamax, sbig_focus_metrics_t *m)
+{
+    struct scan_arg a;
+    int nbands = par_nbands (0, height);
+    struct star *cand;
+    double hfd[SBIG_FOCUS_MAX_STARS], fwhm[SBIG_FOCUS_MAX_STARS];
+    double gradient = 0, noise, t, cy, cx;
+    int i, j, n = 0, ncand = 0;
+
+    if (height < 2 * SBIG_FOCUS_RADIUS + 1
+                            || width < 2 * SBIG_FOCUS_RADIUS + 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset (m, 0, sizeof (*m));
+    background (data, (size_t)height * width, &m->background, &m->noise);
+
+    noise = m->noise < 1 ? 1 : m->noise;
+    t = m->background + SBIG_FOCUS_SIGMA * noise;
+    a.thresh = t > 65535 ? 65535 : t;
+    t = m->background + SBIG_FOCUS_SIGMA * noise / 2;
+    a.half = t > 65535 ? 65535 : t;
+    a.data = data;
+    a.height = height;
+    a.width = width;
+    a.datamax = datamax;
+    a.bands = xzmalloc (nbands * sizeof (a.bands[0]));
+    par_run (0, height, scan_band, &a);
+
+    cand = xzmalloc (nbands * CANDIDATES * sizeof (cand[0]));
+    for (i = 0; i < nbands; i++) {
+        gradient += a.bands[i].gradient;
+        memcpy (cand + ncand, a.bands[i].cand,
+                a.bands[i].ncand * sizeof (cand[0]));
+        ncand += a.bands[i].ncand;
+    }
+    free (a.bands);
+    m->sharpness = gradient / ((double)height * (width - 2))
+                 - 2 * m->noise * m->noise;
+
+    /* Measure the brightest candidates, skipping any within the aperture
+     * of a brighter one (e.g. a second maximum of the same star).
+     */
+    qsort (cand, ncand, sizeof (cand[0]), cmp_peak);
+    for (i = 0; i < ncand && n < SBIG_FOCUS_MAX_STARS; i++) {
+        for (j = 0; j < i; j++) {
+            if (abs (cand[j].y - cand[i].y) <= SBIG_FOCUS_RADIUS
+                    && abs (cand[j].x - cand[i].x) <= SBIG_FOCUS_RADIUS)
+                break;
+        }
+        if (j < i)
+            continue;
+        if (measure_star (data, height, width, &cand[i], m->background,
+                          &hfd[n], &fwhm[n], &cy, &cx) < 0)
+            continue;
+        if (n++ == 0) {
+            m->y = cy;
+            m->x = cx;
+        }
+    }
+    free (cand);
+    if (n > 0) {
+        m->stars = n;
+        m->hfd = median (hfd, n);
+        m->fwhm = median (fwhm, n);
+    }
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
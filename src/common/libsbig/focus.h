@@ -0,0 +1,39 @@
+#ifndef _SBIG_FOCUS_H
+#define _SBIG_FOCUS_H
+
+#include "sbigudrv.h"
+
+/* Focus metrics computed directly on a frame: detect stars, then measure
+ * their half flux diameter and FWHM, plus a whole-frame sharpness score
+ * for fields without usable stars.  Smaller HFD and FWHM, and larger
+ * sharpness, are better focus.
+ */
+
+#define SBIG_FOCUS_SIGMA        5.0     /* detection threshold, noise sigmas */
+#define SBIG_FOCUS_RADIUS       16      /* measuring aperture, pixels */
+#define SBIG_FOCUS_MAX_STARS    50      /* brightest stars measured */
+
+typedef struct {
+    double background;  /* median pixel value, ADU */
+    double noise;       /* robust standard deviation, ADU */
+    int stars;          /* stars measured */
+    double hfd;         /* median half flux diameter, pixels */
+    double fwhm;        /* median full width at half maximum, pixels */
+    double sharpness;   /* Brenner gradient: mean squared difference of
+                           pixels two apart along rows, less that of noise */
+    double y, x;        /* centroid of the brightest star measured */
+} sbig_focus_metrics_t;
+
+/* Measure 'data' of 'height' x 'width' pixels.  Stars with pixels at or
+ * above 'datamax' are saturated and skipped.  If no stars are found,
+ * 'stars' is 0 and so are 'hfd', 'fwhm', 'y', and 'x'.
+ * Returns -1 with errno set if the frame is too small to measure.
+ */
+int sbig_focus_measure (const ushort *data, ushort height, ushort width,
+                        ushort datamax, sbig_focus_metrics_t *m);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,120 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Row-band parallel executor for full frame post-processing.
+ *
+ * Threads are started per call.  Frame kernels run for milliseconds
+ * or more, so thread creation is noise, and there is no pool to manage.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "src/common/libutil/xzmalloc.h"
+
+/* Don't bother splitting bands smaller than this.
+ */
+static const int min_band_rows = 64;
+
+struct band {
+    pthread_t t;
+    int index;
+    int row0;
+    int nrows;
+    par_band_f fun;
+    void *arg;
+    int started;
+};
+
+int par_default_threads (void)
+{
+    long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+}
+
+int par_nbands (int nthreads, int rows)
+{
+    int n;
+
+    if (nthreads <= 0)
+        nthreads = par_default_threads ();
+    n = rows / min_band_rows;
+    if (n > nthreads)
+        n = nthreads;
+    if (n < 1)
+        n = 1;
+    return n;
+}
+
+static void *band_thread (void *arg)
+{
+    struct band *b = arg;
+
+    b->fun (b->index, b->row0, b->nrows, b->arg);
+    return NULL;
+}
+
+void par_run (int nthreads, int rows, par_band_f fun, void *arg)
+{
+    int nbands = par_nbands (nthreads, rows);
+    struct band *b;
+    int i, row0 = 0;
+
+    if (nbands == 1) {
+        fun (0, 0, rows, arg);
+        return;
+    }
+    b = xzmalloc (sizeof (*b) * nbands);
+    for (i = 0; i < nbands; i++) {
+        b[i].index = i;
+        b[i].row0 = row0;
+        b[i].nrows = rows / nbands + (i < rows % nbands ? 1 : 0);
+        b[i].fun = fun;
+        b[i].arg = arg;
+        row0 += b[i].nrows;
+    }
+    /* Band 0 runs in the calling thread.  If a thread can't be started,
+     * its band runs here too, so the work always gets done.
+     */
+    for (i = 1; i < nbands; i++) {
+        if (pthread_create (&b[i].t, NULL, band_thread, &b[i]) == 0)
+            b[i].started = 1;
+    }
+    fun (b[0].index, b[0].row0, b[0].nrows, arg);
+    for (i = 1; i < nbands; i++) {
+        if (b[i].started)
+            (void)pthread_join (b[i].t, NULL);
+        else
+            fun (b[i].index, b[i].row0, b[i].nrows, arg);
+    }
+    free (b);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,27 @@
+#ifndef _SBIG_PARALLEL_H
+#define _SBIG_PARALLEL_H
+
+/* Internal: split a frame into bands of contiguous rows and process
+ * them concurrently.  'nthreads' <= 0 means one per online CPU.
+ */
+
+/* Process rows [row0, row0 + nrows).  'index' is the band number,
+ * 0 <= index < par_nbands(), for selecting per-band scratch state.
+ */
+typedef void (*par_band_f)(int index, int row0, int nrows, void *arg);
+
+int par_default_threads (void);
+
+/* Number of bands par_run() will use for 'rows' rows.
+ */
+int par_nbands (int nthreads, int rows);
+
+/* Call 'fun' on each band and wait for all of them to finish.
+ */
+void par_run (int nthreads, int rows, par_band_f fun, void *arg);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,400 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+
+/* Register frames to a reference by phase correlation
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <complex.h>
+
+#include "sbigudrv.h"
+#include "register.h"
+#include "parallel.h"
+
+#include "src/common/libutil/fft.h"
+#include "src/common/libutil/xzmalloc.h"
+
+struct sbig_register {
+    ushort height, width;
+    int n;                      /* transform size */
+    int bin;                    /* binning of the coarse pass */
+    int ch, cw;                 /* binned frame size */
+    int fh, fw;                 /* fine pass window size */
+    int fy, fx;                 /* fine pass window origin in the reference */
+    fft_plan_t *plan;
+    float *img;                 /* binned or windowed pixels */
+    float complex *buf;
+    float complex *cref;        /* conjugate transforms of the reference */
+    float complex *fref;
+    bool have_ref;
+};
+
+struct load_arg {
+    sbig_register_t *reg;
+    const ushort *frame;
+    int y0, x0, ow, bin;
+};
+
+struct fft_arg {
+    sbig_register_t *reg;
+    bool inverse;
+};
+
+sbig_register_t *sbig_register_create (ushort height, ushort width)
+{
+    sbig_register_t *reg;
+    int size = height > width ? height : width;
+    int n;
+
+    if (height == 0 || width == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    reg = xzmalloc (sizeof (*reg));
+    reg->height = height;
+    reg->width = width;
+    reg->bin = (size + SBIG_REGISTER_SIZE - 1) / SBIG_REGISTER_SIZE;
+    reg->ch = (height + reg->bin - 1) / reg->bin;
+    reg->cw = (width + reg->bin - 1) / reg->bin;
+    for (n = 2; n < reg->ch || n < reg->cw; n <<= 1)
+        ;
+    reg->n = n;
+    reg->fh = height < n ? height : n;
+    reg->fw = width < n ? width : n;
+    if (!(reg->plan = fft_plan_create (n))) {
+        free (reg);
+        return NULL;
+    }
+    reg->img = xzmalloc ((size_t)n * n * sizeof (reg->img[0]));
+    reg->buf = xzmalloc ((size_t)n * n * sizeof (reg->buf[0]));
+    reg->cref = xzmalloc ((size_t)n * n * sizeof (reg->cref[0]));
+    reg->fref = xzmalloc ((size_t)n * n * sizeof (reg->fref[0]));
+    return reg;
+}
+
+void sbig_register_destroy (sbig_register_t *reg)
+{
+    if (reg) {
+        fft_plan_destroy (reg->plan);
+        free (reg->img);
+        free (reg->buf);
+        free (reg->cref);
+        free (reg->fref);
+        free (reg);
+    }
+}
+
+/* Average bin x bin blocks, clipped to the frame, into img rows.
+ */
+static void load_band (int index, int row0, int nrows, void *arg)
+{
+    struct load_arg *a = arg;
+    sbig_register_t *reg = a->reg;
+    int i, j, y, x;
+
+    for (i = row0; i < row0 + nrows; i++) {
+        int ya = a->y0 + i * a->bin;
+        int yb = ya + a->bin > reg->height ? reg->height : ya + a->bin;
+        float *out = reg->img + (size_t)i * a->ow;
+
+        for (j = 0; j < a->ow; j++) {
+            int xa = a->x0 + j * a->bin;
+            int xb = xa + a->bin > reg->width ? reg->width : xa + a->bin;
+            unsigned long sum = 0;
+
+            for (y = ya; y < yb; y++) {
+                const ushort *p = a->frame + (size_t)y * reg->width;
+                for (x = xa; x < xb; x++)
+                    sum += p[x];
+            }
+            out[j] = (float)sum / ((yb - ya) * (xb - xa));
+        }
+    }
+}
+
+static void load (sbig_register_t *reg, const ushort *frame,
+                  int y0, int x0, int oh, int ow, int bin)
+{
+    struct load_arg a = { .reg = reg, .frame = frame,
+                          .y0 = y0, .x0 = x0, .ow = ow, .bin = bin };
+
+    par_run (0, oh, load_band, &a);
+}
+
+/* Copy img into the corner of buf, less its mean, tapered to zero at the
+ * edges by a Hann window so they do not correlate.
+ */
+static void window (sbig_register_t *reg, int oh, int ow)
+{
+    size_t count = (size_t)oh * ow;
+    double mean = 0;
+    float *wx = xzmalloc (ow * sizeof (wx[0]));
+    size_t k;
+    int i, j;
+
+    for (k = 0; k < count; k++)
+        mean += reg->img[k];
+    mean /= count;
+    for (j = 0; j < ow; j++)
+        wx[j] = 0.5 - 0.5 * cos (2 * M_PI * (j + 0.5) / ow);
+    memset (reg->buf, 0, (size_t)reg->n * reg->n * sizeof (reg->buf[0]));
+    for (i = 0; i < oh; i++) {
+        float wy = 0.5 - 0.5 * cos (2 * M_PI * (i + 0.5) / oh);
+        const float *in = reg->img + (size_t)i * ow;
+        float complex *out = reg->buf + (size_t)i * reg->n;
+
+        for (j = 0; j < ow; j++)
+            out[j] = (in[j] - mean) * wy * wx[j];
+    }
+    free (wx);
+}
+
+static void fft_rows (int index, int row0, int nrows, void *arg)
+{
+    struct fft_arg *a = arg;
+    int i;
+
+    for (i = row0; i < row0 + nrows; i++)
+        fft_1d (a->reg->plan, a->reg->buf + (size_t)i * a->reg->n, 1,
+                a->inverse);
+}
+
+static void fft_cols (int index, int col0, int ncols, void *arg)
+{
+    struct fft_arg *a = arg;
+    int j;
+
+    for (j = col0; j < col0 + ncols; j++)
+        fft_1d (a->reg->plan, a->reg->buf + j, a->reg->n, a->inverse);
+}
+
+static void fft_2d (sbig_register_t *reg, bool inverse)
+{
+    struct fft_arg a = { .reg = reg, .inverse = inverse };
+
+    par_run (0, reg->n, fft_rows, &a);
+    par_run (0, reg->n, fft_cols, &a);
+}
+
+/* Transform an oh x ow region of 'frame' at (y0, x0), binned, into buf.
+ */
+static void transform (sbig_register_t *reg, const ushort *frame,
+                       int y0, int x0, int oh, int ow, int bin)
+{
+    load (reg, frame, y0, x0, oh, ow, bin);
+    window (reg, oh, ow);
+    fft_2d (reg, false);
+}
+
+static void conjugate (sbig_register_t *reg, float complex *ref)
+{
+    size_t k, count = (size_t)reg->n * reg->n;
+
+    for (k = 0; k < count; k++)
+        ref[k] = conjf (reg->buf[k]);
+}
+
+/* Offset of the parabola through (-1, a), (0, b), (1, c) from 0.
+ */
+static double vertex (float a, float b, float c)
+{
+    float d = a - 2 * b + c;
+
+    return d < 0 ? (a - c) / (2 * d) : 0;
+}
+
+/* Correlate the transform in buf with 'ref', leaving the location of the
+ * peak in (py, px) and its height over the rms of the surface in 'snr'.
+ * The cross power spectrum is only partially whitened (divided by the
+ * square root of its magnitude), which keeps the peak sharp without
+ * letting the noise at high frequencies, where stars have little power,
+ * swamp it.
+ */
+static void correlate (sbig_register_t *reg, const float complex *ref,
+                       double *py, double *px, double *snr)
+{
+    int n = reg->n;
+    size_t k, count = (size_t)n * n, peak = 0;
+    double ss = 0;
+    int y, x;
+    float *c;
+
+    for (k = 0; k < count; k++) {
+        float ar = crealf (reg->buf[k]), ai = cimagf (reg->buf[k]);
+        float br = crealf (ref[k]), bi = cimagf (ref[k]);
+        float re = ar * br - ai * bi;
+        float im = ar * bi + ai * br;
+        float mag = sqrtf (sqrtf (re * re + im * im));
+
+        reg->buf[k] = mag > 0 ? (re / mag) + I * (im / mag) : 0;
+    }
+    reg->buf[0] = 0;
+    fft_2d (reg, true);
+
+    c = reg->img;
+    for (k = 0; k < count; k++) {
+        c[k] = crealf (reg->buf[k]);
+        ss += (double)c[k] * c[k];
+        if (c[k] > c[peak])
+            peak = k;
+    }
+    y = peak / n;
+    x = peak % n;
+    *py = y + vertex (c[((y + n - 1) % n) * n + x], c[peak],
+                      c[((y + 1) % n) * n + x]);
+    *px = x + vertex (c[y * n + (x + n - 1) % n], c[peak],
+                      c[y * n + (x + 1) % n]);
+    if (*py > n / 2)
+        *py -= n;
+    if (*px > n / 2)
+        *px -= n;
+    *snr = ss > 0 ? c[peak] / sqrt (ss / count) : 0;
+}
+
+static int clamp (int v, int lo, int hi)
+{
+    return v < lo ? lo : v > hi ? hi : v;
+}
+
+/* Pick the fine pass window: the one whose central half has the most
+ * high frequency energy in the binned reference in img, i.e. stars rather
+ * than sky, away from the edges the Hann window suppresses.
+ */
+static void choose_window (sbig_register_t *reg)
+{
+    int ch = reg->ch, cw = reg->cw;
+    int wh = (reg->fh + reg->bin - 1) / reg->bin;
+    int ww = (reg->fw + reg->bin - 1) / reg->bin;
+    int ih = wh > 1 ? wh / 2 : 1;
+    int iw = ww > 1 ? ww / 2 : 1;
+    double *sat = xzmalloc ((size_t)(ch + 1) * (cw + 1) * sizeof (sat[0]));
+    double best = -1;
+    int i, j, by = 0, bx = 0;
+
+    /* summed area table of the squared Laplacian */
+    for (i = 0; i < ch; i++) {
+        for (j = 0; j < cw; j++) {
+            const float *p = reg->img + (size_t)i * cw + j;
+            double e = 0;
+
+            if (i > 0 && i < ch - 1 && j > 0 && j < cw - 1) {
+                e = 4 * p[0] - p[-1] - p[1] - p[-cw] - p[cw];
+                e *= e;
+            }
+            sat[(i + 1) * (cw + 1) + j + 1] = e + sat[i * (cw + 1) + j + 1]
+                                                + sat[(i + 1) * (cw + 1) + j]
+                                                - sat[i * (cw + 1) + j];
+        }
+    }
+    for (i = 0; i + ih <= ch; i++) {
+        for (j = 0; j + iw <= cw; j++) {
+            double e = sat[(i + ih) * (cw + 1) + j + iw]
+                     - sat[i * (cw + 1) + j + iw]
+                     - sat[(i + ih) * (cw + 1) + j]
+                     + sat[i * (cw + 1) + j];
+            if (e > best) {
+                best = e;
+                by = i;
+                bx = j;
+            }
+        }
+    }
+    free (sat);
+    reg->fy = clamp ((by - (wh - ih) / 2) * reg->bin, 0,
+                     reg->height - reg->fh);
+    reg->fx = clamp ((bx - (ww - iw) / 2) * reg->bin, 0,
+                     reg->width - reg->fw);
+}
+
+void sbig_register_set_reference (sbig_register_t *reg, const ushort *frame)
+{
+    load (reg, frame, 0, 0, reg->ch, reg->cw, reg->bin);
+    if (reg->bin > 1)
+        choose_window (reg);
+    window (reg, reg->ch, reg->cw);
+    fft_2d (reg, false);
+    conjugate (reg, reg->cref);
+    if (reg->bin > 1) {
+        transform (reg, frame, reg->fy, reg->fx, reg->fh, reg->fw, 1);
+        conjugate (reg, reg->fref);
+    }
+    reg->have_ref = true;
+}
+
+bool sbig_register_has_reference (sbig_register_t *reg)
+{
+    return reg->have_ref;
+}
+
+int sbig_register_measure (sbig_register_t *reg, const ushort *frame,
+                           double *dy, double *dx)
+{
+    double cy, cx, fy, fx, snr;
+    int oy, ox;
+
+    if (!reg->have_ref) {
+        errno = EINVAL;
+        return -1;
+    }
+    transform (reg, frame, 0, 0, reg->ch, reg->cw, reg->bin);
+    correlate (reg, reg->cref, &cy, &cx, &snr);
+    if (snr < SBIG_REGISTER_MIN_SNR) {
+        errno = ENOENT;
+        return -1;
+    }
+    cy *= reg->bin;
+    cx *= reg->bin;
+
+    /* Refine at full resolution, in a window offset by the coarse shift.
+     * Keep the coarse result if the refinement does not agree with it.
+     */
+    if (reg->bin > 1) {
+        oy = clamp (reg->fy + lround (cy), 0, reg->height - reg->fh);
+        ox = clamp (reg->fx + lround (cx), 0, reg->width - reg->fw);
+        transform (reg, frame, oy, ox, reg->fh, reg->fw, 1);
+        correlate (reg, reg->fref, &fy, &fx, &snr);
+        fy += oy - reg->fy;
+        fx += ox - reg->fx;
+        if (snr >= SBIG_REGISTER_MIN_SNR
+                && fabs (fy - cy) <= reg->bin && fabs (fx - cx) <= reg->bin) {
+            cy = fy;
+            cx = fx;
+        }
+    }
+    *dy = cy;
+    *dx = cx;
+    return 0;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,44 @@
+#ifndef _SBIG_REGISTER_H
+#define _SBIG_REGISTER_H
+
+#include <stdbool.h>
+
+#include "sbigudrv.h"
+
+/* Measure the translation between frames of a series and a reference
+ * frame by phase correlation: first on the whole frame binned down to
+ * fit a SBIG_REGISTER_SIZE square, then at full resolution on the
+ * reference's most detailed SBIG_REGISTER_SIZE square, for a sub-pixel
+ * result.  Frames should be dark subtracted, or hot pixels will pull the
+ * result toward no shift.
+ */
+
+#define SBIG_REGISTER_SIZE      256     /* correlation window, pixels */
+#define SBIG_REGISTER_MIN_SNR   12.0    /* correlation peak / rms for a match */
+
+typedef struct sbig_register sbig_register_t;
+
+/* Create registration for frames of 'height' x 'width' pixels.
+ * Returns NULL with errno set on failure.
+ */
+sbig_register_t *sbig_register_create (ushort height, ushort width);
+void sbig_register_destroy (sbig_register_t *reg);
+
+/* Set the frame others are measured against.  Only what is needed to
+ * correlate with it is kept.
+ */
+void sbig_register_set_reference (sbig_register_t *reg, const ushort *frame);
+bool sbig_register_has_reference (sbig_register_t *reg);
+
+/* Measure the shift of 'frame' such that frame(y + dy, x + dx) matches
+ * reference(y, x).  Returns -1 with errno set to EINVAL if there is no
+ * reference, or ENOENT if the frames do not correlate, e.g. under cloud.
+ */
+int sbig_register_measure (sbig_register_t *reg, const ushort *frame,
+                           double *dy, double *dx);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,404 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Live frame ring
+ *
+ * Layout of the shared memory object (host byte order):
+ *   header, padded to SBIG_RING_ALIGN
+ *   per slot: slot header + metadata, padded to SBIG_RING_ALIGN
+ *             up to height x width pixels, padded to SBIG_RING_ALIGN
+ * Frame N (from 1) goes in slot (N - 1) % nslots.  A slot's generation
+ * is 2N - 1 while frame N is being written and 2N once it is complete.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "sbigudrv.h"
+#include "ring.h"
+
+#define RING_MAGIC      "SBIGRNG"
+#define RING_VERSION    1
+#define RING_ORDER      0x01020304  /* reads back differently if swapped */
+
+struct ring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t height, width;
+    uint32_t nslots;
+    uint32_t closed;            /* set when the writer goes away */
+    uint64_t slot;
+    uint64_t head;              /* newest complete frame */
+    uint32_t futex;             /* bumped on each publish, for waiters */
+};
+
+struct slot_header {
+    uint64_t gen;
+    uint32_t height, width;
+    uint32_t metalen;
+};
+
+struct sbig_ring {
+    char name[NAME_MAX + 1];
+    bool writing;
+    char *map;
+    size_t len;
+    struct ring_header *hdr;
+};
+
+static size_t slot_size (ushort height, ushort width)
+{
+    return SBIG_RING_ALIGN
+         + roundup ((size_t)height * width * sizeof (ushort), SBIG_RING_ALIGN);
+}
+
+static struct slot_header *slot_header (sbig_ring_t *ring, uint64_t seq)
+{
+    return (struct slot_header *)(ring->map + SBIG_RING_ALIGN
+                        + ((seq - 1) % ring->hdr->nslots) * ring->hdr->slot);
+}
+
+static int futex (uint32_t *uaddr, int op, uint32_t val,
+                  const struct timespec *timeout)
+{
+    return syscall (SYS_futex, uaddr, op, val, timeout, NULL, 0);
+}
+
+/* shm_open() wants a leading slash.
+ */
+static int ring_name (sbig_ring_t *ring, const char *name)
+{
+    int n = snprintf (ring->name, sizeof (ring->name), "%s%s",
+                      name[0] == '/' ? "" : "/", name);
+    if (n >= sizeof (ring->name) || strchr (ring->name + 1, '/')) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static void ring_free (sbig_ring_t *ring)
+{
+    if (ring) {
+        int saved_errno = errno;
+        if (ring->map)
+            (void)munmap (ring->map, ring->len);
+        free (ring);
+        errno = saved_errno;
+    }
+}
+
+sbig_ring_t *sbig_ring_create (const char *name, ushort height, ushort width,
+                               int nslots)
+{
+    sbig_ring_t *ring;
+    struct ring_header *hdr;
+    int fd;
+
+    if (height == 0 || width == 0 || nslots < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(ring = calloc (1, sizeof (*ring))))
+        return NULL;
+    if (ring_name (ring, name) < 0)
+        goto error;
+    ring->writing = true;
+    ring->len = SBIG_RING_ALIGN + nslots * slot_size (height, width);
+
+    /* Readers of a ring left behind keep their mapping of the old object.
+     */
+    (void)shm_unlink (ring->name);
+    if ((fd = shm_open (ring->name, O_RDWR | O_CREAT | O_EXCL, 0666)) < 0)
+        goto error;
+    if (ftruncate (fd, ring->len) < 0)
+        goto error_unlink;
+    ring->map = mmap (NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        goto error_unlink;
+    }
+    (void)close (fd);
+
+    hdr = ring->hdr = (struct ring_header *)ring->map;
+    hdr->version = RING_VERSION;
+    hdr->order = RING_ORDER;
+    hdr->height = height;
+    hdr->width = width;
+    hdr->nslots = nslots;
+    hdr->slot = slot_size (height, width);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    memcpy (hdr->magic, RING_MAGIC, sizeof (hdr->magic));
+    return ring;
+error_unlink:
+    (void)shm_unlink (ring->name);
+    (void)close (fd);
+error:
+    ring_free (ring);
+    return NULL;
+}
+
+int sbig_ring_publish (sbig_ring_t *ring, const void *meta, size_t metalen,
+                       const ushort *data, ushort height, ushort width)
+{
+    struct ring_header *hdr = ring->hdr;
+    struct slot_header *sh;
+    uint64_t seq;
+
+    if (!ring->writing || metalen > SBIG_RING_META_MAX
+                       || height > hdr->height || width > hdr->width) {
+        errno = EINVAL;
+        return -1;
+    }
+    seq = hdr->head + 1;
+    sh = slot_header (ring, seq);
+
+    /* Readers that see an odd generation, or a different one after
+     * reading, know the slot changed under them.
+     */
+    __atomic_store_n (&sh->gen, 2 * seq - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+    sh->height = height;
+    sh->width = width;
+    sh->metalen = metalen;
+    memcpy ((char *)sh + sizeof (*sh), meta, metalen);
+    memcpy ((char *)sh + SBIG_RING_ALIGN, data,
+            (size_t)height * width * sizeof (ushort));
+    __atomic_store_n (&sh->gen, 2 * seq, __ATOMIC_RELEASE);
+
+    __atomic_store_n (&hdr->head, seq, __ATOMIC_RELEASE);
+    __atomic_fetch_add (&hdr->futex, 1, __ATOMIC_RELEASE);
+    (void)futex (&hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+    return 0;
+}
+
+sbig_ring_t *sbig_ring_open (const char *name)
+{
+    sbig_ring_t *ring;
+    struct ring_header *hdr;
+    struct stat sb;
+    int fd = -1;
+
+    if (!(ring = calloc (1, sizeof (*ring))))
+        return NULL;
+    if (ring_name (ring, name) < 0)
+        goto error;
+    if ((fd = shm_open (ring->name, O_RDONLY, 0)) < 0)
+        goto error;
+    if (fstat (fd, &sb) < 0)
+        goto error;
+    if (sb.st_size < SBIG_RING_ALIGN) {
+        errno = EPROTO;
+        goto error;
+    }
+    ring->len = sb.st_size;
+    ring->map = mmap (NULL, ring->len, PROT_READ, MAP_SHARED, fd, 0);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        goto error;
+    }
+    (void)close (fd);
+    fd = -1;
+
+    hdr = ring->hdr = (struct ring_header *)ring->map;
+    if (memcmp (hdr->magic, RING_MAGIC, sizeof (hdr->magic)) != 0) {
+        errno = EPROTO;
+        goto error;
+    }
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (hdr->version != RING_VERSION || hdr->order != RING_ORDER
+            || hdr->height == 0 || hdr->height > 65535
+            || hdr->width == 0 || hdr->width > 65535 || hdr->nslots == 0
+            || hdr->slot != slot_size (hdr->height, hdr->width)
+            || ring->len != SBIG_RING_ALIGN + hdr->nslots * hdr->slot) {
+        errno = EPROTO;
+        goto error;
+    }
+    return ring;
+error:
+    if (fd >= 0)
+        (void)close (fd);
+    ring_free (ring);
+    return NULL;
+}
+
+void sbig_ring_get_size (sbig_ring_t *ring, ushort *height, ushort *width)
+{
+    if (height)
+        *height = ring->hdr->height;
+    if (width)
+        *width = ring->hdr->width;
+}
+
+int sbig_ring_slots (sbig_ring_t *ring)
+{
+    return ring->hdr->nslots;
+}
+
+uint64_t sbig_ring_head (sbig_ring_t *ring)
+{
+    return __atomic_load_n (&ring->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+uint64_t sbig_ring_wait (sbig_ring_t *ring, uint64_t seq, double timeout)
+{
+    struct ring_header *hdr = ring->hdr;
+    struct timespec now, end, ts;
+    uint32_t val;
+    uint64_t head;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    end.tv_sec += (time_t)timeout;
+    end.tv_nsec += (timeout - (time_t)timeout) * 1E9;
+    if (end.tv_nsec >= 1000000000) {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+    for (;;) {
+        /* Sample the futex word first, so a publish after the head is
+         * read makes FUTEX_WAIT return at once instead of sleeping.
+         */
+        val = __atomic_load_n (&hdr->futex, __ATOMIC_ACQUIRE);
+        if ((head = sbig_ring_head (ring)) > seq)
+            return head;
+        if (__atomic_load_n (&hdr->closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return 0;
+        }
+        if (timeout >= 0) {
+            clock_gettime (CLOCK_MONOTONIC, &now);
+            ts.tv_sec = end.tv_sec - now.tv_sec;
+            ts.tv_nsec = end.tv_nsec - now.tv_nsec;
+            if (ts.tv_nsec < 0) {
+                ts.tv_sec--;
+                ts.tv_nsec += 1000000000;
+            }
+            if (ts.tv_sec < 0) {
+                errno = ETIMEDOUT;
+                return 0;
+            }
+        }
+        if (futex (&hdr->futex, FUTEX_WAIT, val, timeout >= 0 ? &ts : NULL) < 0
+                && errno == EINTR)
+            return 0;
+    }
+}
+
+const ushort *sbig_ring_peek (sbig_ring_t *ring, uint64_t seq,
+                              const void **metap, size_t *metalenp,
+                              ushort *height, ushort *width)
+{
+    struct slot_header *sh;
+
+    if (seq == 0 || seq > sbig_ring_head (ring))
+        goto noent;
+    sh = slot_header (ring, seq);
+    if (__atomic_load_n (&sh->gen, __ATOMIC_ACQUIRE) != 2 * seq)
+        goto noent;
+    /* Sizes are checked, since the slot may be overwritten even now.
+     */
+    if (sh->height > ring->hdr->height || sh->width > ring->hdr->width
+                                    || sh->metalen > SBIG_RING_META_MAX)
+        goto noent;
+    if (metap)
+        *metap = (char *)sh + sizeof (*sh);
+    if (metalenp)
+        *metalenp = sh->metalen;
+    if (height)
+        *height = sh->height;
+    if (width)
+        *width = sh->width;
+    return (const ushort *)((char *)sh + SBIG_RING_ALIGN);
+noent:
+    errno = ENOENT;
+    return NULL;
+}
+
+int sbig_ring_check (sbig_ring_t *ring, uint64_t seq)
+{
+    struct slot_header *sh = slot_header (ring, seq);
+
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&sh->gen, __ATOMIC_RELAXED) != 2 * seq) {
+        errno = ESTALE;
+        return -1;
+    }
+    return 0;
+}
+
+int sbig_ring_read (sbig_ring_t *ring, uint64_t seq, void *meta,
+                    size_t metalen, ushort *data,
+                    ushort *height, ushort *width)
+{
+    const ushort *p;
+    const void *m;
+    size_t len;
+    ushort h, w;
+
+    if (!(p = sbig_ring_peek (ring, seq, &m, &len, &h, &w)))
+        return -1;
+    memcpy (meta, m, MIN (metalen, len));
+    memcpy (data, p, (size_t)h * w * sizeof (ushort));
+    if (sbig_ring_check (ring, seq) < 0)
+        return -1;
+    if (height)
+        *height = h;
+    if (width)
+        *width = w;
+    return len;
+}
+
+void sbig_ring_destroy (sbig_ring_t *ring)
+{
+    if (ring) {
+        if (ring->writing) {
+            (void)shm_unlink (ring->name);
+            __atomic_store_n (&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+            __atomic_fetch_add (&ring->hdr->futex, 1, __ATOMIC_RELEASE);
+            (void)futex (&ring->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+        }
+        ring_free (ring);
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
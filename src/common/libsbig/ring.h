@@ -0,0 +1,88 @@
+#ifndef _SBIG_RING_H
+#define _SBIG_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sbigudrv.h"
+
+/* Live frame ring: a POSIX shared memory object holding the last few
+ * frames published by one writer (e.g. sbig snap --live), for any number
+ * of local readers such as viewers, guiders, or quick-look analysis.
+ * The writer never waits for readers.  Each slot has a generation count
+ * used as a seqlock, so a reader may use a frame in place and then check
+ * that it was not overwritten meanwhile.  Metadata records are opaque
+ * here (see sbfits_ring_publish()).
+ */
+
+#define SBIG_RING_ALIGN     4096
+#define SBIG_RING_META_MAX  (SBIG_RING_ALIGN - 32)
+#define SBIG_RING_SLOTS     4       /* default number of slots */
+#define SBIG_RING_NAME      "sbig"  /* default name, i.e. /dev/shm/sbig */
+
+typedef struct sbig_ring sbig_ring_t;
+
+/* Create shared memory object 'name' with 'nslots' slots for frames of up
+ * to 'height' x 'width' pixels, replacing any left behind by a writer
+ * that did not exit cleanly.  Returns NULL with errno set on failure.
+ */
+sbig_ring_t *sbig_ring_create (const char *name, ushort height, ushort width,
+                               int nslots);
+
+/* Publish a frame: 'metalen' bytes of metadata and 'height' x 'width'
+ * pixels, overwriting the oldest.  Frames are numbered from 1.
+ * Returns -1 with errno set on failure.
+ */
+int sbig_ring_publish (sbig_ring_t *ring, const void *meta, size_t metalen,
+                       const ushort *data, ushort height, ushort width);
+
+/* Open a ring for reading.  Returns NULL with errno set on failure.
+ */
+sbig_ring_t *sbig_ring_open (const char *name);
+
+/* Maximum frame size.
+ */
+void sbig_ring_get_size (sbig_ring_t *ring, ushort *height, ushort *width);
+int sbig_ring_slots (sbig_ring_t *ring);
+
+/* Number of the newest frame, or 0 if none has been published.
+ */
+uint64_t sbig_ring_head (sbig_ring_t *ring);
+
+/* Wait up to 'timeout' seconds (forever if negative) for a frame newer
+ * than 'seq'.  Returns the number of the newest frame, or 0 with errno
+ * set to ETIMEDOUT, EINTR, or EPIPE if the writer has gone away.
+ */
+uint64_t sbig_ring_wait (sbig_ring_t *ring, uint64_t seq, double timeout);
+
+/* Point at frame 'seq' in place: its metadata and pixels.  The writer
+ * may overwrite it at any time, so anything read from it must be
+ * validated with sbig_ring_check() afterwards.  Returns NULL with errno
+ * set to ENOENT if the frame is not in the ring.
+ */
+const ushort *sbig_ring_peek (sbig_ring_t *ring, uint64_t seq,
+                              const void **metap, size_t *metalenp,
+                              ushort *height, ushort *width);
+
+/* Returns 0 if frame 'seq' is still intact, or -1 with errno ESTALE.
+ */
+int sbig_ring_check (sbig_ring_t *ring, uint64_t seq);
+
+/* Copy frame 'seq': up to 'metalen' bytes of metadata to 'meta', and its
+ * pixels to 'data', which must have room for the maximum frame size.
+ * Returns the metadata length, or -1 with errno set to ENOENT or ESTALE.
+ */
+int sbig_ring_read (sbig_ring_t *ring, uint64_t seq, void *meta,
+                    size_t metalen, ushort *data,
+                    ushort *height, ushort *width);
+
+/* Unmap the ring.  The writer also removes the shared memory object and
+ * wakes waiting readers, which then get EPIPE.
+ */
+void sbig_ring_destroy (sbig_ring_t *ring);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -31,24 +31,39 @@
 #include "config.h"
 #endif
 #include <stdio.h>
+#include <stdarg.h>
 #include <libgen.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h> /* htonl */
 #include <sys/param.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <fitsio.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "sbig.h"
 #include "sbfits.h"
+#include "parallel.h"
 
 #include "src/common/libutil/xzmalloc.h"
 #include "src/common/libutil/bcd.h"
 #include "src/common/libutil/list.h"
+#include "src/common/libutil/bswap.h"
+#include "src/common/libutil/rice.h"
+
+#define FITS_BLOCK 2880         /* FITS logical record size */
+#define FITS_CARD  80           /* header card size */
+#define RICE_BLOCKSIZE 32       /* ZVAL1, as cfitsio */
 
 struct history {
     char *sw;             /* software that modified image */
@@ -58,7 +73,18 @@ struct history {
 struct sbfits {
     fitsfile *fptr;
     int status;
-    char error_string[31];       /* buffer for err str (<=30 chars per docs) */
+    int fd;                      /* file reserved by sbfits_create_file */
+    int errnum;                  /* errno value, if failed outside cfitsio */
+    bool no_mmap;                /* always write through cfitsio */
+    sbfits_compress_t compress;  /* tile compression type */
+    char *hdr;                   /* header cards, when writing directly */
+    char *mem;                   /* frame written by sbfits_write_mem() */
+    size_t mem_size;
+    const char *extname;         /* EXTNAME, when appended to a series */
+    struct spool_rec *spool;     /* strings, when read from a spool/file */
+    size_t hdr_len, hdr_size;
+    char error_string[80];       /* buffer for err str */
+    bool have_errstr;            /* error_string set directly */
     time_t t_create;             /* time of file creation */
     time_t t_obs;                /* time of observation */
     char filename[PATH_MAX];     /* full path of output file */
@@ -79,17 +105,22 @@ struct sbfits {
     sbfits_type_t image_type;    /* (opt) image type */
     double elevation;
     ushort *data;                /* image data */
+    ushort *data_copy;           /* owned copy of data, if any */
     ushort height, width;        /* size of image data */
+    bool image_created;          /* image HDU created by sbfits_write_rows */
     int top, left;               /* subframe origin */
     READOUT_BINNING_MODE readout_mode;
     GetCCDInfoResults0 info0;
-    GetCCDInfoResults2 info2;
     double focal_length;
     double aperture_diameter;
     double aperture_area;
     long cwhite, cblack;
     long pedestal;
     ushort datamax;
+    bool has_stats;
+    ushort pixmin, pixmax;
+    double pixmean, pixstdev;
+    long nsatpix, nhotpix;
 };
 
 const char *sbig_url = "http://diffractionlimited.com/wp-content/uploads/2016/11/sbfitsext_1r0.pdf";
@@ -109,6 +140,7 @@ sbfits_t *sbfits_create (void)
 {
     sbfits_t *sbf = xzmalloc (sizeof (*sbf));
     sbf->num_exposures = 1;
+    sbf->fd = -1;
     return sbf;
 }
 
@@ -117,6 +149,12 @@ void sbfits_destroy (sbfits_t *sbf)
     if (sbf) {
         if (sbf->history)
             list_destroy (sbf->history);
+        if (sbf->fd >= 0)
+            (void)close (sbf->fd);
+        free (sbf->data_copy);
+        free (sbf->hdr);
+        free (sbf->mem);
+        free (sbf->spool);
         free (sbf);
     }
 }
@@ -125,26 +163,101 @@ int sbfits_create_file (sbfits_t *sbf, const char *imagedir,
                                            const char *prefix)
 {
     char buf[64];
-    int n;
+    int n, seq = 0;
     int rc = -1;
 
+    /* Frames finished within the same second get a -N suffix rather
+     * than overwriting one another.  The file is created exclusively
+     * here to reserve the name; it is written by sbfits_write_file().
+     */
     sbf->t_create = time (NULL);
+    gmtime_str (sbf->t_create, buf, sizeof (buf));
     n = snprintf (sbf->filename, sizeof (sbf->filename),
-                  "%s/%s_%s.fits", imagedir, prefix,
-                  gmtime_str (sbf->t_create, buf, sizeof (buf)));
-    if (n >= sizeof (sbf->filename)) {
+                  "%s/%s_%s.fits", imagedir, prefix, buf);
+    while (n < sizeof (sbf->filename)) {
+        sbf->fd = open (sbf->filename, O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (sbf->fd >= 0 || errno != EEXIST)
+            break;
+        n = snprintf (sbf->filename, sizeof (sbf->filename),
+                      "%s/%s_%s-%d.fits", imagedir, prefix, buf, ++seq);
+    }
+    if (n >= sizeof (sbf->filename))
         errno = EINVAL;
+    if (sbf->fd < 0) {
+        sbf->errnum = errno;
         goto done;
     }
-    (void)unlink (sbf->filename);
-    fits_create_file (&sbf->fptr, sbf->filename, &sbf->status);
-    if (sbf->status)
-        goto done;
     rc = 0;
 done:
     return rc;
 }
 
+/* Hand the reserved file over to cfitsio, which replaces it ("!").
+ */
+static int open_fits (sbfits_t *sbf)
+{
+    char name[PATH_MAX + 1];
+
+    if (sbf->fptr)
+        return sbf->status ? -1 : 0;
+    snprintf (name, sizeof (name), "!%s", sbf->filename);
+    fits_create_file (&sbf->fptr, name, &sbf->status);
+    if (sbf->status)
+        return -1;
+    (void)close (sbf->fd);
+    sbf->fd = -1;
+    return 0;
+}
+
+void sbfits_set_mmap (sbfits_t *sbf, bool enable)
+{
+    sbf->no_mmap = !enable;
+}
+
+static struct {
+    const char *name;
+    sbfits_compress_t type;
+    int fits_type;
+} compress_tab[] = {
+    { "none",       SBFITS_COMPRESS_NONE,       0 },
+    { "rice",       SBFITS_COMPRESS_RICE,       RICE_1 },
+    { "hcompress",  SBFITS_COMPRESS_HCOMPRESS,  HCOMPRESS_1 },
+    { "gzip",       SBFITS_COMPRESS_GZIP,       GZIP_1 },
+};
+static const int compress_tab_len = sizeof (compress_tab)
+                                  / sizeof (compress_tab[0]);
+
+int sbfits_compress_parse (const char *s, sbfits_compress_t *typep)
+{
+    int i;
+
+    for (i = 0; i < compress_tab_len; i++) {
+        if (!strcasecmp (s, compress_tab[i].name)) {
+            *typep = compress_tab[i].type;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void sbfits_set_compress (sbfits_t *sbf, sbfits_compress_t type)
+{
+    sbf->compress = type;
+}
+
+/* Have cfitsio tile compress the image HDU created next.
+ */
+static void set_fits_compress (sbfits_t *sbf)
+{
+    int i;
+
+    for (i = 0; i < compress_tab_len; i++) {
+        if (compress_tab[i].type == sbf->compress && compress_tab[i].fits_type)
+            fits_set_compression_type (sbf->fptr, compress_tab[i].fits_type,
+                                       &sbf->status);
+    }
+}
+
 const char *sbfits_get_filename (sbfits_t *sbf)
 {
     return sbf->filename;
@@ -152,16 +265,32 @@ const char *sbfits_get_filename (sbfits_t *sbf)
 
 const char *sbfits_get_errstr (sbfits_t *sbf)
 {
-    fits_get_errstatus (sbf->status, sbf->error_string);
+    if (sbf->have_errstr)
+        ;
+    else if (sbf->errnum)
+        snprintf (sbf->error_string, sizeof (sbf->error_string), "%s",
+                  strerror (sbf->errnum));
+    else
+        fits_get_errstatus (sbf->status, sbf->error_string);
     return sbf->error_string;
 }
 
 int sbfits_close_file (sbfits_t *sbf)
 {
     int rc = -1;
-    fits_close_file (sbf->fptr, &sbf->status);
-    if (sbf->status)
-        goto done;
+    if (sbf->fptr) {
+        fits_close_file (sbf->fptr, &sbf->status);
+        sbf->fptr = NULL;
+        if (sbf->status)
+            goto done;
+    }
+    if (sbf->fd >= 0) {
+        if (close (sbf->fd) < 0)
+            sbf->errnum = errno;
+        sbf->fd = -1;
+        if (sbf->errnum)
+            goto done;
+    }
     rc = 0;
 done:
     return rc;
@@ -175,37 +304,16 @@ void sbfits_set_ccdinfo (sbfits_t *sbf, sbig_ccd_t *ccd)
     sbf->data          = sbig_ccd_get_data (ccd, &sbf->height, &sbf->width);
     (void)sbig_ccd_get_readout_mode (ccd, &sbf->readout_mode); /* FIXME */
     (void)sbig_ccd_get_info0 (ccd, &sbf->info0); /* FIXME */
-    (void)sbig_ccd_get_info2 (ccd, &sbf->info2); /* FIXME */
     (void)sbig_ccd_get_window (ccd, &top, &left, &height, &width);
     sbf->top = top;   /* need as int */
     sbf->left = left; /* need as int */
+    (void)sbig_ccd_get_datamax (ccd, &sbf->datamax);
+}
 
-    /* Ref: SBIG USB Camera manual rev 14, table 3.2, pp 37
-     *  provides info on ST7, ST8, ST9, ST10, ST2K
-     */
-    switch (sbf->info0.cameraType) {
-        case ST7_CAMERA:
-        case ST8_CAMERA:
-            if (sbf->readout_mode == RM_1X1 && sbf->info2.imagingABG)
-                sbf->datamax = 20000;
-            else if (sbf->readout_mode == RM_1X1 && !sbf->info2.imagingABG)
-                sbf->datamax = 40000;
-            else
-                sbf->datamax = 65000;
-            break;
-        case ST10_CAMERA:
-            if (sbf->readout_mode == RM_1X1)
-                sbf->datamax = 50000;
-            else
-                sbf->datamax = 65000;
-            break;
-        case ST9_CAMERA:
-        case ST2K_CAMERA:
-            sbf->datamax = 65000;
-            break;
-        default:
-            sbf->datamax = 65000;
-    }
+void sbfits_set_exposure (sbfits_t *sbf, time_t start, double exposure_time)
+{
+    sbf->t_obs = start;
+    sbf->exposure_time = exposure_time;
 }
 
 void sbfits_set_num_exposures (sbfits_t *sbf, ushort num_exposures)
@@ -268,6 +376,11 @@ void sbfits_set_imagetype (sbfits_t *sbf, sbfits_type_t image_type)
     sbf->image_type = image_type;
 }
 
+sbfits_type_t sbfits_get_imagetype (sbfits_t *sbf)
+{
+    return sbf->image_type;
+}
+
 void sbfits_set_annotation (sbfits_t *sbf, const char *str)
 {
     sbf->annotation = str;
@@ -304,15 +417,47 @@ void sbfits_set_contrast (sbfits_t *sbf, ulong cblack, ulong cwhite)
     sbf->cwhite = cwhite;
 }
 
+void sbfits_set_stats (sbfits_t *sbf, const sbig_frame_stats_t *st)
+{
+    sbig_stats_contrast (st, &sbf->cblack, &sbf->cwhite);
+    sbf->pixmin = st->min;
+    sbf->pixmax = st->max;
+    sbf->pixmean = st->mean;
+    sbf->pixstdev = st->stddev;
+    sbf->nsatpix = st->saturated;
+    sbf->nhotpix = st->hot;
+    sbf->has_stats = true;
+}
+
 void sbfits_set_pedestal (sbfits_t *sbf, ulong pedestal)
 {
     sbf->pedestal = pedestal;
 }
 
+int sbfits_write_rows (sbfits_t *sbf, ushort row, ushort count, ushort *data)
+{
+    long naxes[2] = { sbf->width, sbf->height };
+
+    if (open_fits (sbf) < 0)
+        return -1;
+    if (!sbf->image_created) {
+        set_fits_compress (sbf);
+        fits_create_img (sbf->fptr, USHORT_IMG, 2, naxes, &sbf->status);
+        sbf->image_created = true;
+    }
+    fits_write_img (sbf->fptr, TUSHORT, (LONGLONG)row * sbf->width + 1,
+                    (LONGLONG)count * sbf->width, data, &sbf->status);
+
+    return sbf->status ? -1 : 0;
+}
+
 static int sbfits_write_image (sbfits_t *sbf)
 {
     long naxes[2] = { sbf->width, sbf->height };
 
+    if (sbf->image_created)
+        return sbf->status ? -1 : 0;
+    set_fits_compress (sbf);
     fits_create_img (sbf->fptr, USHORT_IMG, 2, naxes, &sbf->status);
     fits_write_img (sbf->fptr, TUSHORT, 1,
                     sbf->height * sbf->width, sbf->data, &sbf->status);
@@ -331,44 +476,144 @@ static int lookup_readoutmode_index (sbfits_t *sbf)
     return -1;
 }
 
+/* Append one header card, blank padded to 80 columns.
+ */
+static void hdr_card (sbfits_t *sbf, const char *fmt, ...)
+{
+    char card[FITS_CARD + 1];
+    va_list ap;
+    int n;
+
+    va_start (ap, fmt);
+    n = vsnprintf (card, sizeof (card), fmt, ap);
+    va_end (ap);
+    if (n < 0)
+        n = 0;
+    else if (n > FITS_CARD)
+        n = FITS_CARD;
+    memset (card + n, ' ', FITS_CARD - n);
+    if (sbf->hdr_len + FITS_CARD > sbf->hdr_size) {
+        char *new = xzmalloc (sbf->hdr_size * 2);
+        memcpy (new, sbf->hdr, sbf->hdr_len);
+        free (sbf->hdr);
+        sbf->hdr = new;
+        sbf->hdr_size *= 2;
+    }
+    memcpy (sbf->hdr + sbf->hdr_len, card, FITS_CARD);
+    sbf->hdr_len += FITS_CARD;
+}
+
+/* Format a header card the way cfitsio would for the value types we use:
+ * fixed format, strings quoted from column 11, numbers right justified
+ * to column 30.
+ */
+static void hdr_key (sbfits_t *sbf, int type, const char *key, void *value,
+                     const char *comment)
+{
+    char val[FITS_CARD];
+    const char *p;
+    int n = 0;
+
+    switch (type) {
+        case TSTRING:
+            if (!strcmp (key, "COMMENT") || !strcmp (key, "HISTORY")) {
+                hdr_card (sbf, "%-8s%s", key, (char *)value);
+                return;
+            }
+            val[n++] = '\'';
+            for (p = value; *p && n < 68; p++) {
+                if (*p == '\'')
+                    val[n++] = '\'';
+                val[n++] = *p;
+            }
+            while (n < 9)
+                val[n++] = ' ';
+            val[n++] = '\'';
+            val[n] = '\0';
+            break;
+        case TLOGICAL:
+            snprintf (val, sizeof (val), "%s", *(int *)value ? "T" : "F");
+            break;
+        case TUSHORT:
+            snprintf (val, sizeof (val), "%hu", *(ushort *)value);
+            break;
+        case TINT:
+            snprintf (val, sizeof (val), "%d", *(int *)value);
+            break;
+        case TLONG:
+            snprintf (val, sizeof (val), "%ld", *(long *)value);
+            break;
+        case TDOUBLE: {
+            char *e;
+            snprintf (val, sizeof (val), "%.15G", *(double *)value);
+            if (!strpbrk (val, ".EN"))
+                strcat (val, ".");
+            else if (!strchr (val, '.') && (e = strchr (val, 'E'))) {
+                memmove (e + 1, e, strlen (e) + 1);
+                *e = '.';
+            }
+            break;
+        }
+        default:
+            return;
+    }
+    if (comment && *comment)
+        hdr_card (sbf, type == TSTRING ? "%-8.8s= %-20s / %s"
+                                       : "%-8.8s= %20s / %s",
+                  key, val, comment);
+    else
+        hdr_card (sbf, type == TSTRING ? "%-8.8s= %s" : "%-8.8s= %20s",
+                  key, val);
+}
+
+static void put_key (sbfits_t *sbf, int type, const char *key, void *value,
+                     const char *comment)
+{
+    if (sbf->hdr)
+        hdr_key (sbf, type, key, value, comment);
+    else
+        fits_write_key (sbf->fptr, type, (char *)key, value, (char *)comment,
+                        &sbf->status);
+}
+
 static int sbfits_write_header (sbfits_t *sbf)
 {
     char buf[128];
 
-    fits_write_key (sbf->fptr, TSTRING, "COMMENT",
+    put_key (sbf, TSTRING, "COMMENT",
                     "SBIG FITS header format per:",
-                    "", &sbf->status);
+                    "");
     snprintf (buf, sizeof (buf), " %s", sbig_url);
-    fits_write_key (sbf->fptr, TSTRING, "COMMENT",
-                    buf, "", &sbf->status);
-    fits_write_key(sbf->fptr, TSTRING, "SBSTDVER", "SBFITSEXT Version 1.0",
-                    "SBIG FITS extensions ver", &sbf->status);
+    put_key (sbf, TSTRING, "COMMENT",
+                    buf, "");
+    put_key (sbf, TSTRING, "SBSTDVER", "SBFITSEXT Version 1.0",
+                    "SBIG FITS extensions ver");
     if (sbf->annotation)
-        fits_write_key (sbf->fptr, TSTRING, "COMMENT", (char *)sbf->annotation,
-                        "", &sbf->status);
+        put_key (sbf, TSTRING, "COMMENT", (char *)sbf->annotation,
+                        "");
 
-    fits_write_key(sbf->fptr, TSTRING, "DATE",
+    put_key (sbf, TSTRING, "DATE",
                    gmtime_str (sbf->t_create, buf, sizeof (buf)),
-                   "GMT date when this file created", &sbf->status);
-    fits_write_key(sbf->fptr, TSTRING, "DATE-OBS",
+                   "GMT date when this file created");
+    put_key (sbf, TSTRING, "DATE-OBS",
                    gmtime_str (sbf->t_obs, buf, sizeof (buf)),
-                   "GMT start of exposure", &sbf->status);
-
-    fits_write_key (sbf->fptr, TDOUBLE, "EXPTIME", &sbf->exposure_time,
-                    "Exposure in seconds", &sbf->status);
-    fits_write_key (sbf->fptr, TDOUBLE, "CCD-TEMP", &sbf->temperature,
-                    "CCD temp in degress C", &sbf->status);
-    fits_write_key (sbf->fptr, TDOUBLE, "SET-TEMP", &sbf->setpoint,
-                    "Setpoint for CCD temp in degress C", &sbf->status);
-    fits_write_key (sbf->fptr, TSTRING, "IMAGETYP",
+                   "GMT start of exposure");
+
+    put_key (sbf, TDOUBLE, "EXPTIME", &sbf->exposure_time,
+                    "Exposure in seconds");
+    put_key (sbf, TDOUBLE, "CCD-TEMP", &sbf->temperature,
+                    "CCD temp in degress C");
+    put_key (sbf, TDOUBLE, "SET-TEMP", &sbf->setpoint,
+                    "Setpoint for CCD temp in degress C");
+    put_key (sbf, TSTRING, "IMAGETYP",
                     sbf->image_type == SBFITS_TYPE_LF ? "Light Frame"
                   : sbf->image_type == SBFITS_TYPE_DF ? "Dark Frame"
                   : sbf->image_type == SBFITS_TYPE_BF ? "Bias Frame"
                                                       : "Flat Field",
-                    "Type of image", &sbf->status);
+                    "Type of image");
     if (sbf->swcreate)
-        fits_write_key (sbf->fptr, TSTRING, "SWCREATE", (char *)sbf->swcreate,
-                        "Software that created this image", &sbf->status);
+        put_key (sbf, TSTRING, "SWCREATE", (char *)sbf->swcreate,
+                        "Software that created this image");
 
     if (sbf->history) {
         ListIterator itr;
@@ -376,42 +621,41 @@ static int sbfits_write_header (sbfits_t *sbf)
 
         itr = list_iterator_create (sbf->history);
         while ((h = list_next (itr))) {
-            fprintf (stderr, "Add '%s' '%s'\n", h->sw, h->hist);
-            fits_write_key (sbf->fptr, TSTRING, "SWMODIFY", h->sw,
-                            "Software that modified this image", &sbf->status);
-            fits_write_key (sbf->fptr, TSTRING, "HISTORY", h->hist,
-                            "How modified", &sbf->status);
+            put_key (sbf, TSTRING, "SWMODIFY", h->sw,
+                            "Software that modified this image");
+            put_key (sbf, TSTRING, "HISTORY", h->hist,
+                            "How modified");
         }
         list_iterator_destroy (itr);
     }
 
     if (sbf->sitename)
-        fits_write_key(sbf->fptr, TSTRING, "SITENAME", (char *)sbf->sitename,
-                       "Site name", &sbf->status);
-    fits_write_key(sbf->fptr, TDOUBLE, "SITEELEV", &sbf->elevation,
-                   "Site elevation in meters", &sbf->status);
+        put_key (sbf, TSTRING, "SITENAME", (char *)sbf->sitename,
+                       "Site name");
+    put_key (sbf, TDOUBLE, "SITEELEV", &sbf->elevation,
+                   "Site elevation in meters");
     if (sbf->latitude)
-        fits_write_key(sbf->fptr, TSTRING, "SITELAT", (char *)sbf->latitude,
-                       "Site latitude in degrees", &sbf->status);
+        put_key (sbf, TSTRING, "SITELAT", (char *)sbf->latitude,
+                       "Site latitude in degrees");
     if (sbf->longitude)
-        fits_write_key(sbf->fptr, TSTRING, "SITELONG", (char *)sbf->longitude,
-                       "Site longitude in degrees west of zero", &sbf->status);
+        put_key (sbf, TSTRING, "SITELONG", (char *)sbf->longitude,
+                       "Site longitude in degrees west of zero");
 
     if (sbf->object)
-        fits_write_key(sbf->fptr, TSTRING, "OBJECT", (char *)sbf->object,
-                       "Name of object imaged", &sbf->status);
+        put_key (sbf, TSTRING, "OBJECT", (char *)sbf->object,
+                       "Name of object imaged");
     if (sbf->telescope)
-        fits_write_key(sbf->fptr, TSTRING, "TELESCOP", (char *)sbf->telescope,
-                       "Telescope model", &sbf->status);
+        put_key (sbf, TSTRING, "TELESCOP", (char *)sbf->telescope,
+                       "Telescope model");
     if (sbf->filter)
-        fits_write_key(sbf->fptr, TSTRING, "FILTER", (char *)sbf->filter,
-                       "Optical filter name", &sbf->status);
+        put_key (sbf, TSTRING, "FILTER", (char *)sbf->filter,
+                       "Optical filter name");
     if (sbf->observer)
-        fits_write_key(sbf->fptr, TSTRING, "OBSERVER", (char *)sbf->observer,
-                       "Telescope operator", &sbf->status);
+        put_key (sbf, TSTRING, "OBSERVER", (char *)sbf->observer,
+                       "Telescope operator");
 
-    fits_write_key(sbf->fptr, TSTRING, "INSTRUME", sbf->info0.name,
-                   "Camera Model", &sbf->status);
+    put_key (sbf, TSTRING, "INSTRUME", sbf->info0.name,
+                   "Camera Model");
 
     int rm_index = lookup_readoutmode_index (sbf);
     if (rm_index != -1) {
@@ -436,55 +680,454 @@ static int sbfits_write_header (sbfits_t *sbf)
             case RM_NXN:
                 break; /* Not supported yet, and not allowed by sbig-snap */
         }
-        fits_write_key(sbf->fptr, TUSHORT, "XBINNING", &xbin,
-                       "Horizontal binning factor", &sbf->status);
-        fits_write_key(sbf->fptr, TUSHORT, "YBINNING", &ybin,
-                       "Vertical binning factor", &sbf->status);
+        put_key (sbf, TUSHORT, "XBINNING", &xbin,
+                       "Horizontal binning factor");
+        put_key (sbf, TUSHORT, "YBINNING", &ybin,
+                       "Vertical binning factor");
 
         double pixw = bcd6_2 (sbf->info0.readoutInfo[rm_index].pixelWidth);
         double pixh = bcd6_2 (sbf->info0.readoutInfo[rm_index].pixelHeight);
-        fits_write_key(sbf->fptr, TDOUBLE, "XPIXSZ", &pixw,
-                       "Pixel width in microns", &sbf->status);
-        fits_write_key(sbf->fptr, TDOUBLE, "YPIXSZ", &pixh,
-                       "Pixel height in microns", &sbf->status);
+        put_key (sbf, TDOUBLE, "XPIXSZ", &pixw,
+                       "Pixel width in microns");
+        put_key (sbf, TDOUBLE, "YPIXSZ", &pixh,
+                       "Pixel height in microns");
 
         double gain = bcd2_2 (sbf->info0.readoutInfo[rm_index].gain);
-        fits_write_key(sbf->fptr, TDOUBLE, "EGAIN", &gain,
-                       "Electrons per ADU", &sbf->status);
+        put_key (sbf, TDOUBLE, "EGAIN", &gain,
+                       "Electrons per ADU");
 
     }
-    fits_write_key(sbf->fptr, TINT, "XORGSUBF", &sbf->left,
-                   "Subframe origin x_pos", &sbf->status);
-    fits_write_key(sbf->fptr, TINT, "YORGSUBF", &sbf->top,
-                   "Subframe origin y_pos", &sbf->status);
-    fits_write_key(sbf->fptr, TUSHORT, "RESMODE", &sbf->readout_mode,
-                    "Resolution mode", &sbf->status);
-    fits_write_key(sbf->fptr, TUSHORT, "SNAPSHOT", &sbf->num_exposures,
-                    "Number images coadded", &sbf->status);
+    put_key (sbf, TINT, "XORGSUBF", &sbf->left,
+                   "Subframe origin x_pos");
+    put_key (sbf, TINT, "YORGSUBF", &sbf->top,
+                   "Subframe origin y_pos");
+    put_key (sbf, TUSHORT, "RESMODE", &sbf->readout_mode,
+                    "Resolution mode");
+    put_key (sbf, TUSHORT, "SNAPSHOT", &sbf->num_exposures,
+                    "Number images coadded");
 
     if (sbf->focal_length > 0)
-        fits_write_key(sbf->fptr, TDOUBLE, "FOCALLEN", &sbf->focal_length,
-                       "Focal length in mm", &sbf->status);
+        put_key (sbf, TDOUBLE, "FOCALLEN", &sbf->focal_length,
+                       "Focal length in mm");
     if (sbf->aperture_diameter > 0)
-        fits_write_key(sbf->fptr, TDOUBLE, "APTDIA", &sbf->aperture_diameter,
-                       "Aperture diameter in mm", &sbf->status);
+        put_key (sbf, TDOUBLE, "APTDIA", &sbf->aperture_diameter,
+                       "Aperture diameter in mm");
     if (sbf->aperture_area > 0)
-        fits_write_key(sbf->fptr, TDOUBLE, "APTAREA", &sbf->aperture_area,
-                       "Aperture area in sq-mm", &sbf->status);
-
-    fits_write_key(sbf->fptr, TLONG,   "CBLACK", &sbf->cblack,
-                   "Black ADU for display", &sbf->status);
-    fits_write_key(sbf->fptr, TLONG,   "CWHITE", &sbf->cwhite,
-                    "White ADU for display", &sbf->status);
-    fits_write_key(sbf->fptr, TLONG,   "PEDESTAL", &sbf->pedestal,
-                    "Add to ADU for 0-base", &sbf->status);
-    fits_write_key(sbf->fptr, TUSHORT, "DATAMAX", &sbf->datamax,
-                    "Saturation level", &sbf->status);
+        put_key (sbf, TDOUBLE, "APTAREA", &sbf->aperture_area,
+                       "Aperture area in sq-mm");
+
+    put_key (sbf, TLONG,   "CBLACK", &sbf->cblack,
+                   "Black ADU for display");
+    put_key (sbf, TLONG,   "CWHITE", &sbf->cwhite,
+                    "White ADU for display");
+    put_key (sbf, TLONG,   "PEDESTAL", &sbf->pedestal,
+                    "Add to ADU for 0-base");
+    put_key (sbf, TUSHORT, "DATAMAX", &sbf->datamax,
+                    "Saturation level");
+    if (sbf->has_stats) {
+        put_key (sbf, TUSHORT, "PIXMIN", &sbf->pixmin,
+                       "Minimum pixel value");
+        put_key (sbf, TUSHORT, "PIXMAX", &sbf->pixmax,
+                       "Maximum pixel value");
+        put_key (sbf, TDOUBLE, "PIXMEAN", &sbf->pixmean,
+                       "Mean pixel value");
+        put_key (sbf, TDOUBLE, "PIXSTDEV", &sbf->pixstdev,
+                       "Pixel value standard deviation");
+        put_key (sbf, TLONG,   "NSATPIX", &sbf->nsatpix,
+                       "Pixels at or above DATAMAX");
+        put_key (sbf, TLONG,   "NHOTPIX", &sbf->nhotpix,
+                       "Single pixel spikes (hot/cosmic)");
+    }
     return sbf->status ? -1 : 0;
 }
 
+static void hdr_fits_comment (sbfits_t *sbf)
+{
+    hdr_card (sbf, "COMMENT   FITS (Flexible Image Transport System) format"
+                   " is defined in 'Astronomy");
+    hdr_card (sbf, "COMMENT   and Astrophysics', volume 376, page 359;"
+                   " bibcode: 2001A&A...376..359H");
+}
+
+static void hdr_start (sbfits_t *sbf)
+{
+    sbf->hdr_size = FITS_BLOCK;
+    sbf->hdr = xzmalloc (sbf->hdr_size);
+    sbf->hdr_len = 0;
+}
+
+/* End an HDU's header and blank pad it to a whole block.
+ */
+static void hdr_end (sbfits_t *sbf)
+{
+    hdr_card (sbf, "END");
+    while (sbf->hdr_len % FITS_BLOCK)
+        hdr_card (sbf, "");
+}
+
+/* A mapping of part of the file, from the page containing 'off'.
+ */
+struct region {
+    void *map;
+    size_t len;
+    bool mem;                   /* in sbf->mem rather than a file */
+};
+
+/* Allocate 'size' bytes of the file at 'off' up front, so a full disk is
+ * an error here rather than SIGBUS later, then map them and copy in the
+ * header.  Returns a pointer to 'off' in the mapping.  With no file
+ * ('fd' < 0), the region is in sbf->mem instead.
+ */
+static char *map_region (sbfits_t *sbf, int fd, off_t off, size_t size,
+                         struct region *r)
+{
+    off_t base = off - off % sysconf (_SC_PAGESIZE);
+    char *p;
+
+    if (fd < 0) {
+        if (!(p = realloc (sbf->mem, off + size))) {
+            sbf->errnum = ENOMEM;
+            return NULL;
+        }
+        sbf->mem = p;
+        sbf->mem_size = off + size;
+        r->mem = true;
+        p += off;
+        memset (p, 0, size);
+        memcpy (p, sbf->hdr, sbf->hdr_len);
+        return p;
+    }
+    r->mem = false;
+    if ((sbf->errnum = posix_fallocate (fd, off, size)))
+        return NULL;
+    r->len = size + (off - base);
+    r->map = mmap (NULL, r->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+    if (r->map == MAP_FAILED) {
+        sbf->errnum = errno;
+        return NULL;
+    }
+    p = (char *)r->map + (off - base);
+    memcpy (p, sbf->hdr, sbf->hdr_len);
+    return p;
+}
+
+static int unmap_region (sbfits_t *sbf, struct region *r)
+{
+    if (r->mem)
+        return 0;
+    if (munmap (r->map, r->len) < 0) {
+        sbf->errnum = errno;
+        return -1;
+    }
+    return 0;
+}
+
+/* Whole frames in memory are written directly unless compressed with
+ * something other than Rice.
+ */
+static bool can_write_direct (sbfits_t *sbf)
+{
+    return !sbf->no_mmap && sbf->data
+        && (sbf->compress == SBFITS_COMPRESS_NONE
+         || sbf->compress == SBFITS_COMPRESS_RICE);
+}
+
+/* Fast path for a whole frame in memory: write the header cards and
+ * byte swapped pixels straight into a mapping of the file, bypassing
+ * cfitsio's buffers.  The HDU goes at 'off', as the primary HDU if that
+ * is the start of the file, otherwise as an IMAGE extension.  The end of
+ * the HDU is returned in 'endp'.
+ */
+static int write_direct (sbfits_t *sbf, int fd, off_t off, off_t *endp)
+{
+    size_t npix = (size_t)sbf->height * sbf->width;
+    size_t size;
+    struct region r;
+    char *p;
+    int naxis = 2, bitpix = 16, simple = 1, zero = 0;
+    int width = sbf->width, height = sbf->height;
+    long bzero = 32768, bscale = 1;
+    int rc = -1;
+
+    hdr_start (sbf);
+    if (off == 0)
+        hdr_key (sbf, TLOGICAL, "SIMPLE", &simple,
+                 "file does conform to FITS standard");
+    else
+        hdr_key (sbf, TSTRING, "XTENSION", "IMAGE", "IMAGE extension");
+    hdr_key (sbf, TINT, "BITPIX", &bitpix, "number of bits per data pixel");
+    hdr_key (sbf, TINT, "NAXIS", &naxis, "number of data axes");
+    hdr_key (sbf, TINT, "NAXIS1", &width, "length of data axis 1");
+    hdr_key (sbf, TINT, "NAXIS2", &height, "length of data axis 2");
+    if (off == 0) {
+        hdr_key (sbf, TLOGICAL, "EXTEND", &simple,
+                 "FITS dataset may contain extensions");
+        hdr_fits_comment (sbf);
+    } else {
+        hdr_key (sbf, TINT, "PCOUNT", &zero, "required keyword; must = 0");
+        hdr_key (sbf, TINT, "GCOUNT", &simple, "required keyword; must = 1");
+    }
+    hdr_key (sbf, TLONG, "BZERO", &bzero,
+             "offset data range to that of unsigned short");
+    hdr_key (sbf, TLONG, "BSCALE", &bscale, "default scaling factor");
+    if (sbf->extname)
+        hdr_key (sbf, TSTRING, "EXTNAME", (char *)sbf->extname,
+                 "extension name");
+    (void)sbfits_write_header (sbf);
+    hdr_end (sbf);
+
+    size = sbf->hdr_len + roundup (npix * sizeof (ushort), FITS_BLOCK);
+    if (!(p = map_region (sbf, fd, off, size, &r)))
+        goto done;
+    bswap_fits_ushort (sbf->data, (ushort *)(p + sbf->hdr_len), npix);
+    if (unmap_region (sbf, &r) < 0)
+        goto done;
+    if (endp)
+        *endp = off + size;
+    rc = 0;
+done:
+    free (sbf->hdr);
+    sbf->hdr = NULL;
+    return rc;
+}
+
+/* Rice compressed tiles of one row each, as cfitsio would choose.
+ */
+struct rice_arg {
+    sbfits_t *sbf;
+    size_t tilemax;             /* buffer size per tile */
+    unsigned char *buf;         /* 'tilemax' bytes per tile */
+    int *len;                   /* compressed size per tile, -1 = error */
+};
+
+static void rice_band (int index, int row0, int nrows, void *arg)
+{
+    struct rice_arg *a = arg;
+    int w = a->sbf->width;
+    short *tmp = xzmalloc (sizeof (*tmp) * w);
+    int row, i;
+
+    for (row = row0; row < row0 + nrows; row++) {
+        const ushort *in = a->sbf->data + (size_t)row * w;
+
+        for (i = 0; i < w; i++)
+            tmp[i] = in[i] ^ 0x8000; /* BZERO = 32768 */
+        a->len[row] = rice_encode16 (tmp, w, RICE_BLOCKSIZE,
+                                     a->buf + row * a->tilemax, a->tilemax);
+    }
+    free (tmp);
+}
+
+/* Write a whole frame as a tile compressed image (a BINTABLE extension
+ * per the FITS tiled image convention) with the tiles Rice compressed
+ * in parallel.  cfitsio's own tile compression runs in one thread.
+ * At the start of the file, an empty primary HDU is written first.
+ */
+static int write_rice (sbfits_t *sbf, int fd, off_t off, off_t *endp)
+{
+    struct rice_arg a = { .sbf = sbf };
+    int h = sbf->height, w = sbf->width;
+    long heap = 0, maxlen = 0;
+    size_t size, table = 8 * (size_t)h; /* 1PB descriptors */
+    struct region r;
+    char *p;
+    char tform[32];
+    int zero = 0, one = 1, eight = 8, two = 2, sixteen = 16;
+    int blocksize = RICE_BLOCKSIZE;
+    long bzero = 32768, bscale = 1;
+    int row, rc = -1;
+
+    a.tilemax = rice_bound (w, RICE_BLOCKSIZE);
+    a.buf = xzmalloc (a.tilemax * h);
+    a.len = xzmalloc (sizeof (a.len[0]) * h);
+    par_run (0, h, rice_band, &a);
+    for (row = 0; row < h; row++) {
+        if (a.len[row] < 0) {
+            sbf->errnum = EINVAL;
+            goto done;
+        }
+        heap += a.len[row];
+        if (a.len[row] > maxlen)
+            maxlen = a.len[row];
+    }
+
+    hdr_start (sbf);
+    if (off == 0) {
+        hdr_key (sbf, TLOGICAL, "SIMPLE", &one,
+                 "file does conform to FITS standard");
+        hdr_key (sbf, TINT, "BITPIX", &eight, "number of bits per data pixel");
+        hdr_key (sbf, TINT, "NAXIS", &zero, "number of data axes");
+        hdr_key (sbf, TLOGICAL, "EXTEND", &one,
+                 "FITS dataset may contain extensions");
+        hdr_fits_comment (sbf);
+        hdr_end (sbf);
+    }
+    hdr_key (sbf, TSTRING, "XTENSION", "BINTABLE", "binary table extension");
+    hdr_key (sbf, TINT, "BITPIX", &eight, "8-bit bytes");
+    hdr_key (sbf, TINT, "NAXIS", &two, "2-dimensional binary table");
+    hdr_key (sbf, TINT, "NAXIS1", &eight, "width of table in bytes");
+    hdr_key (sbf, TINT, "NAXIS2", &h, "number of rows in table");
+    hdr_key (sbf, TLONG, "PCOUNT", &heap, "size of special data area");
+    hdr_key (sbf, TINT, "GCOUNT", &one, "one data group (required keyword)");
+    hdr_key (sbf, TINT, "TFIELDS", &one, "number of fields in each row");
+    hdr_key (sbf, TSTRING, "TTYPE1", "COMPRESSED_DATA",
+             "label for field   1");
+    snprintf (tform, sizeof (tform), "1PB(%ld)", maxlen);
+    hdr_key (sbf, TSTRING, "TFORM1", tform,
+             "data format of field: variable length array");
+    hdr_key (sbf, TLOGICAL, "ZIMAGE", &one,
+             "extension contains compressed image");
+    hdr_key (sbf, TINT, "ZBITPIX", &sixteen, "data type of original image");
+    hdr_key (sbf, TINT, "ZNAXIS", &two, "dimension of original image");
+    hdr_key (sbf, TINT, "ZNAXIS1", &w, "length of original image axis");
+    hdr_key (sbf, TINT, "ZNAXIS2", &h, "length of original image axis");
+    hdr_key (sbf, TINT, "ZTILE1", &w, "size of tiles to be compressed");
+    hdr_key (sbf, TINT, "ZTILE2", &one, "size of tiles to be compressed");
+    hdr_key (sbf, TSTRING, "ZCMPTYPE", "RICE_1", "compression algorithm");
+    hdr_key (sbf, TSTRING, "ZNAME1", "BLOCKSIZE", "compression block size");
+    hdr_key (sbf, TINT, "ZVAL1", &blocksize, "pixels per block");
+    hdr_key (sbf, TSTRING, "ZNAME2", "BYTEPIX",
+             "bytes per pixel (1, 2, 4, or 8)");
+    hdr_key (sbf, TINT, "ZVAL2", &two, "bytes per pixel (1, 2, 4, or 8)");
+    hdr_key (sbf, TSTRING, "EXTNAME",
+             sbf->extname ? (char *)sbf->extname : "COMPRESSED_IMAGE",
+             "name of this binary table extension");
+    hdr_key (sbf, TLONG, "BZERO", &bzero,
+             "offset data range to that of unsigned short");
+    hdr_key (sbf, TLONG, "BSCALE", &bscale, "default scaling factor");
+    (void)sbfits_write_header (sbf);
+    hdr_end (sbf);
+
+    size = sbf->hdr_len + roundup (table + heap, FITS_BLOCK);
+    if (!(p = map_region (sbf, fd, off, size, &r)))
+        goto done;
+    for (row = 0, heap = 0; row < h; row++) {
+        uint32_t desc[2] = { htonl (a.len[row]), htonl (heap) };
+
+        memcpy (p + sbf->hdr_len + 8 * (size_t)row, desc, sizeof (desc));
+        memcpy (p + sbf->hdr_len + table + heap, a.buf + row * a.tilemax,
+                a.len[row]);
+        heap += a.len[row];
+    }
+    if (unmap_region (sbf, &r) < 0)
+        goto done;
+    if (endp)
+        *endp = off + size;
+    rc = 0;
+done:
+    free (a.buf);
+    free (a.len);
+    free (sbf->hdr);
+    sbf->hdr = NULL;
+    return rc;
+}
+
+static int write_hdu_direct (sbfits_t *sbf, int fd, off_t off, off_t *endp)
+{
+    if (sbf->compress == SBFITS_COMPRESS_RICE)
+        return write_rice (sbf, fd, off, endp);
+    return write_direct (sbf, fd, off, endp);
+}
+
+/* cfitsio can write to a growing memory buffer too, for the compression
+ * types that are not written directly.
+ */
+static int write_mem_fits (sbfits_t *sbf)
+{
+    LONGLONG headstart, datastart, dataend;
+
+    fits_create_memfile (&sbf->fptr, (void **)&sbf->mem, &sbf->mem_size,
+                         FITS_BLOCK * 16, realloc, &sbf->status);
+    if (sbf->status)
+        return -1;
+    if (sbfits_write_image (sbf) == 0 && sbfits_write_header (sbf) == 0) {
+        fits_flush_file (sbf->fptr, &sbf->status);
+        fits_get_hduaddrll (sbf->fptr, &headstart, &datastart, &dataend,
+                            &sbf->status);
+    }
+    fits_close_file (sbf->fptr, &sbf->status);
+    sbf->fptr = NULL;
+    if (sbf->status)
+        return -1;
+    if (dataend < sbf->mem_size) /* trim the buffer's unused tail */
+        sbf->mem_size = dataend;
+    return 0;
+}
+
+int sbfits_write_mem (sbfits_t *sbf, const void **bufp, size_t *lenp)
+{
+    if (!sbf->data || sbf->image_created || sbf->fptr || sbf->fd >= 0) {
+        sbf->errnum = EINVAL;
+        return -1;
+    }
+    if (!sbf->t_create)
+        sbf->t_create = time (NULL);
+    if (sbf->compress == SBFITS_COMPRESS_NONE
+                            || sbf->compress == SBFITS_COMPRESS_RICE) {
+        if (write_hdu_direct (sbf, -1, 0, NULL) < 0)
+            return -1;
+    } else if (write_mem_fits (sbf) < 0)
+        return -1;
+    *bufp = sbf->mem;
+    *lenp = sbf->mem_size;
+    return 0;
+}
+
+static int preview_fail (sbfits_t *sbf, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start (ap, fmt);
+    vsnprintf (sbf->error_string, sizeof (sbf->error_string), fmt, ap);
+    va_end (ap);
+    sbf->have_errstr = true;
+    return -1;
+}
+
+int sbfits_preview (sbfits_t *sbf)
+{
+    const void *buf;
+    size_t len;
+    FILE *f;
+    int status;
+
+    if (sbfits_write_mem (sbf, &buf, &len) < 0)
+        return -1;
+    if (!(f = popen ("xpaset ds9 fits", "w"))) {
+        sbf->errnum = errno;
+        return -1;
+    }
+    /* On EPIPE, xpaset's exit status says why.
+     */
+    if (fwrite (buf, 1, len, f) < len && errno != EPIPE) {
+        sbf->errnum = errno;
+        (void)pclose (f);
+        return -1;
+    }
+    if ((status = pclose (f)) < 0) {
+        sbf->errnum = errno;
+        return -1;
+    }
+    if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+        return preview_fail (sbf, "xpaset exited with rc=%d",
+                             WEXITSTATUS (status));
+    if (WIFSIGNALED (status))
+        return preview_fail (sbf, "xpaset killed by %s",
+                             strsignal (WTERMSIG (status)));
+    return 0;
+}
+
 int sbfits_write_file (sbfits_t *sbf)
 {
+    if (!sbf->image_created && sbf->fd >= 0 && can_write_direct (sbf)) {
+        if (write_hdu_direct (sbf, sbf->fd, 0, NULL) == 0)
+            return 0;
+        if (sbf->errnum != ENODEV)
+            return -1;
+        sbf->errnum = 0; /* filesystem can't mmap, fall back to cfitsio */
+    }
+    if (open_fits (sbf) < 0)
+        return -1;
     if (sbfits_write_image (sbf) < 0)
         return -1;
     if (sbfits_write_header (sbf) < 0)
@@ -492,6 +1135,709 @@ int sbfits_write_file (sbfits_t *sbf)
     return 0;
 }
 
+static int write_at (sbfits_t *sbf, int fd, const void *buf, size_t len,
+                     off_t off)
+{
+    ssize_t n = pwrite (fd, buf, len, off);
+
+    if (n < 0 || n < len) {
+        sbf->errnum = n < 0 ? errno : ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+struct sbfits_series {
+    sbfits_t *sbf;              /* the file: name, descriptor, errors */
+    off_t end;                  /* end of the last HDU written directly */
+    off_t nextend;              /* file offset of the NEXTEND card */
+    int count;                  /* number of extensions */
+};
+
+sbfits_series_t *sbfits_series_create (const char *imagedir,
+                                       const char *prefix)
+{
+    sbfits_series_t *ser = xzmalloc (sizeof (*ser));
+    sbfits_t *sbf;
+    char buf[64];
+    int one = 1, eight = 8, zero = 0;
+    int saved_errno;
+
+    ser->sbf = sbf = sbfits_create ();
+    if (sbfits_create_file (sbf, imagedir, prefix) < 0)
+        goto error;
+
+    /* Empty primary HDU, written directly whether or not the frames are.
+     */
+    hdr_start (sbf);
+    hdr_key (sbf, TLOGICAL, "SIMPLE", &one,
+             "file does conform to FITS standard");
+    hdr_key (sbf, TINT, "BITPIX", &eight, "number of bits per data pixel");
+    hdr_key (sbf, TINT, "NAXIS", &zero, "number of data axes");
+    hdr_key (sbf, TLOGICAL, "EXTEND", &one,
+             "FITS dataset may contain extensions");
+    hdr_fits_comment (sbf);
+    ser->nextend = sbf->hdr_len;
+    hdr_key (sbf, TINT, "NEXTEND", &zero, "number of extensions");
+    hdr_key (sbf, TSTRING, "DATE",
+             gmtime_str (sbf->t_create, buf, sizeof (buf)),
+             "GMT date when this file created");
+    hdr_end (sbf);
+    if (write_at (sbf, sbf->fd, sbf->hdr, sbf->hdr_len, 0) < 0) {
+        errno = sbf->errnum;
+        goto error_unlink;
+    }
+    ser->end = sbf->hdr_len;
+    free (sbf->hdr);
+    sbf->hdr = NULL;
+    return ser;
+error_unlink:
+    saved_errno = errno;
+    (void)unlink (sbf->filename);
+    errno = saved_errno;
+error:
+    saved_errno = errno;
+    sbfits_series_destroy (ser);
+    errno = saved_errno;
+    return NULL;
+}
+
+void sbfits_series_destroy (sbfits_series_t *ser)
+{
+    if (ser) {
+        sbfits_destroy (ser->sbf);
+        free (ser);
+    }
+}
+
+/* Switch the series over to cfitsio, which appends after the last HDU.
+ */
+static int series_open_fits (sbfits_series_t *ser)
+{
+    sbfits_t *sbf = ser->sbf;
+
+    if (sbf->fptr)
+        return sbf->status ? -1 : 0;
+    fits_open_file (&sbf->fptr, sbf->filename, READWRITE, &sbf->status);
+    if (sbf->status)
+        return -1;
+    (void)close (sbf->fd);
+    sbf->fd = -1;
+    return 0;
+}
+
+int sbfits_series_append (sbfits_series_t *ser, sbfits_t *sbf)
+{
+    char extname[32];
+    off_t end;
+    int rc = -1;
+
+    if (!sbf->data || sbf->image_created) {
+        ser->sbf->errnum = EINVAL;
+        return -1;
+    }
+    snprintf (extname, sizeof (extname), "FRAME%04d", ser->count + 1);
+    sbf->extname = extname;
+    if (!sbf->t_create)
+        sbf->t_create = time (NULL);
+
+    if (!ser->sbf->fptr && can_write_direct (sbf)) {
+        if (write_hdu_direct (sbf, ser->sbf->fd, ser->end, &end) == 0) {
+            ser->end = end;
+            goto append;
+        }
+        if (sbf->errnum != ENODEV)
+            goto done;
+        sbf->errnum = 0; /* filesystem can't mmap, fall back to cfitsio */
+        if (ftruncate (ser->sbf->fd, ser->end) < 0) {
+            sbf->errnum = errno;
+            goto done;
+        }
+    }
+    if (series_open_fits (ser) < 0)
+        goto done;
+    sbf->fptr = ser->sbf->fptr;
+    if (sbfits_write_image (sbf) == 0 && sbfits_write_header (sbf) == 0)
+        put_key (sbf, TSTRING, "EXTNAME", extname, "extension name");
+    sbf->fptr = NULL;
+    if (sbf->status)
+        goto done;
+append:
+    ser->count++;
+    rc = 0;
+done:
+    if (rc < 0) {
+        ser->sbf->errnum = sbf->errnum;
+        ser->sbf->status = sbf->status;
+    }
+    sbf->extname = NULL;
+    return rc;
+}
+
+int sbfits_series_close (sbfits_series_t *ser)
+{
+    sbfits_t *sbf = ser->sbf;
+
+    if (sbf->fptr) {
+        fits_movabs_hdu (sbf->fptr, 1, NULL, &sbf->status);
+        fits_update_key (sbf->fptr, TINT, "NEXTEND", &ser->count, NULL,
+                         &sbf->status);
+    } else if (sbf->fd >= 0) {
+        hdr_start (sbf);
+        hdr_key (sbf, TINT, "NEXTEND", &ser->count, "number of extensions");
+        (void)write_at (sbf, sbf->fd, sbf->hdr, FITS_CARD, ser->nextend);
+        free (sbf->hdr);
+        sbf->hdr = NULL;
+    }
+    if (sbfits_close_file (sbf) < 0 || sbf->errnum)
+        return -1;
+    return 0;
+}
+
+int sbfits_series_count (sbfits_series_t *ser)
+{
+    return ser->count;
+}
+
+const char *sbfits_series_get_filename (sbfits_series_t *ser)
+{
+    return sbfits_get_filename (ser->sbf);
+}
+
+const char *sbfits_series_get_errstr (sbfits_series_t *ser)
+{
+    return sbfits_get_errstr (ser->sbf);
+}
+
+/* Spooled frame metadata: everything sbfits_write_header() needs.
+ */
+#define SPOOL_STR       72
+#define SPOOL_HISTORY   8
+
+struct spool_rec {
+    int64_t t_obs;
+    double exposure_time;
+    double temperature, setpoint;
+    double focal_length, aperture_diameter, aperture_area;
+    double elevation;
+    double pixmean, pixstdev;
+    int64_t cblack, cwhite, pedestal;
+    int64_t nsatpix, nhotpix;
+    int32_t num_exposures;
+    int32_t image_type;
+    int32_t top, left;
+    int32_t readout_mode;
+    int32_t datamax;
+    int32_t has_stats, pixmin, pixmax;
+    int32_t nhistory;
+    char annotation[SPOOL_STR];
+    char object[SPOOL_STR];
+    char telescope[SPOOL_STR];
+    char filter[SPOOL_STR];
+    char observer[SPOOL_STR];
+    char latitude[SPOOL_STR];
+    char longitude[SPOOL_STR];
+    char sitename[SPOOL_STR];
+    char swcreate[SPOOL_STR];
+    char history[SPOOL_HISTORY][2][SPOOL_STR];
+    GetCCDInfoResults0 info0;
+};
+
+static void spool_str (char *dst, const char *src)
+{
+    snprintf (dst, SPOOL_STR, "%s", src ? src : "");
+}
+
+static const char *unspool_str (const char *s)
+{
+    return *s ? s : NULL;
+}
+
+/* Fill in a record for 'sbf', to be freed by the caller.
+ * Fails with EOVERFLOW rather than drop HISTORY that doesn't fit.
+ */
+static struct spool_rec *spool_rec_create (sbfits_t *sbf)
+{
+    struct spool_rec *r;
+
+    if (sbf->history && list_count (sbf->history) > SPOOL_HISTORY) {
+        sbf->errnum = EOVERFLOW;
+        return NULL;
+    }
+    r = xzmalloc (sizeof (*r));
+
+    r->t_obs = sbf->t_obs;
+    r->exposure_time = sbf->exposure_time;
+    r->temperature = sbf->temperature;
+    r->setpoint = sbf->setpoint;
+    r->focal_length = sbf->focal_length;
+    r->aperture_diameter = sbf->aperture_diameter;
+    r->aperture_area = sbf->aperture_area;
+    r->elevation = sbf->elevation;
+    r->pixmean = sbf->pixmean;
+    r->pixstdev = sbf->pixstdev;
+    r->cblack = sbf->cblack;
+    r->cwhite = sbf->cwhite;
+    r->pedestal = sbf->pedestal;
+    r->nsatpix = sbf->nsatpix;
+    r->nhotpix = sbf->nhotpix;
+    r->num_exposures = sbf->num_exposures;
+    r->image_type = sbf->image_type;
+    r->top = sbf->top;
+    r->left = sbf->left;
+    r->readout_mode = sbf->readout_mode;
+    r->datamax = sbf->datamax;
+    r->has_stats = sbf->has_stats;
+    r->pixmin = sbf->pixmin;
+    r->pixmax = sbf->pixmax;
+    spool_str (r->annotation, sbf->annotation);
+    spool_str (r->object, sbf->object);
+    spool_str (r->telescope, sbf->telescope);
+    spool_str (r->filter, sbf->filter);
+    spool_str (r->observer, sbf->observer);
+    spool_str (r->latitude, sbf->latitude);
+    spool_str (r->longitude, sbf->longitude);
+    spool_str (r->sitename, sbf->sitename);
+    spool_str (r->swcreate, sbf->swcreate);
+    if (sbf->history) {
+        ListIterator itr = list_iterator_create (sbf->history);
+        struct history *h;
+
+        while ((h = list_next (itr))) {
+            spool_str (r->history[r->nhistory][0], h->sw);
+            spool_str (r->history[r->nhistory][1], h->hist);
+            r->nhistory++;
+        }
+        list_iterator_destroy (itr);
+    }
+    r->info0 = sbf->info0;
+    return r;
+}
+
+int sbfits_spool_append (sbig_spool_t *sp, sbfits_t *sbf)
+{
+    struct spool_rec *r;
+    ushort height, width;
+    int rc = -1;
+
+    sbig_spool_get_size (sp, &height, &width);
+    if (!sbf->data || sbf->height != height || sbf->width != width) {
+        sbf->errnum = EINVAL;
+        return -1;
+    }
+    if (!(r = spool_rec_create (sbf)))
+        return -1;
+    if (sbig_spool_append (sp, r, sizeof (*r), sbf->data) < 0) {
+        sbf->errnum = errno;
+        goto done;
+    }
+    rc = 0;
+done:
+    free (r);
+    return rc;
+}
+
+/* Set up 'sbf' from record 'r', which it takes ownership of, so strings
+ * set from it remain valid as long as 'sbf'.
+ */
+static void unspool (sbfits_t *sbf, struct spool_rec *r)
+{
+    int i;
+
+    free (sbf->spool);
+    sbf->spool = r;
+
+    sbf->t_obs = r->t_obs;
+    sbf->exposure_time = r->exposure_time;
+    sbf->temperature = r->temperature;
+    sbf->setpoint = r->setpoint;
+    sbf->focal_length = r->focal_length;
+    sbf->aperture_diameter = r->aperture_diameter;
+    sbf->aperture_area = r->aperture_area;
+    sbf->elevation = r->elevation;
+    sbf->pixmean = r->pixmean;
+    sbf->pixstdev = r->pixstdev;
+    sbf->cblack = r->cblack;
+    sbf->cwhite = r->cwhite;
+    sbf->pedestal = r->pedestal;
+    sbf->nsatpix = r->nsatpix;
+    sbf->nhotpix = r->nhotpix;
+    sbf->num_exposures = r->num_exposures;
+    sbf->image_type = r->image_type;
+    sbf->top = r->top;
+    sbf->left = r->left;
+    sbf->readout_mode = r->readout_mode;
+    sbf->datamax = r->datamax;
+    sbf->has_stats = r->has_stats;
+    sbf->pixmin = r->pixmin;
+    sbf->pixmax = r->pixmax;
+    sbf->annotation = unspool_str (r->annotation);
+    sbf->object = unspool_str (r->object);
+    sbf->telescope = unspool_str (r->telescope);
+    sbf->filter = unspool_str (r->filter);
+    sbf->observer = unspool_str (r->observer);
+    sbf->latitude = unspool_str (r->latitude);
+    sbf->longitude = unspool_str (r->longitude);
+    sbf->sitename = unspool_str (r->sitename);
+    sbf->swcreate = unspool_str (r->swcreate);
+    for (i = 0; i < r->nhistory && i < SPOOL_HISTORY; i++)
+        sbfits_add_history (sbf, r->history[i][0], r->history[i][1]);
+    sbf->info0 = r->info0;
+}
+
+int sbfits_spool_read (sbig_spool_t *sp, int index, sbfits_t *sbf)
+{
+    struct spool_rec *r = xzmalloc (sizeof (*r));
+    ushort height, width;
+    ushort *data;
+    int n;
+
+    sbig_spool_get_size (sp, &height, &width);
+    data = xzmalloc ((size_t)height * width * sizeof (ushort));
+    if ((n = sbig_spool_read (sp, index, r, sizeof (*r), data)) < 0
+            || n != sizeof (*r)) {
+        sbf->errnum = n < 0 ? errno : EPROTO;
+        free (data);
+        free (r);
+        return -1;
+    }
+    free (sbf->data_copy);
+    sbf->data = sbf->data_copy = data;
+    sbf->height = height;
+    sbf->width = width;
+    unspool (sbf, r);
+    return 0;
+}
+
+int sbfits_ring_publish (sbig_ring_t *ring, sbfits_t *sbf)
+{
+    struct spool_rec *r;
+    int rc = 0;
+
+    if (!sbf->data) {
+        sbf->errnum = EINVAL;
+        return -1;
+    }
+    if (!(r = spool_rec_create (sbf)))
+        return -1;
+    if (sbig_ring_publish (ring, r, sizeof (*r), sbf->data, sbf->height,
+                           sbf->width) < 0) {
+        sbf->errnum = errno;
+        rc = -1;
+    }
+    free (r);
+    return rc;
+}
+
+int sbfits_ring_read (sbig_ring_t *ring, uint64_t seq, sbfits_t *sbf)
+{
+    struct spool_rec *r = xzmalloc (sizeof (*r));
+    ushort height, width;
+    ushort *data;
+    int n;
+
+    sbig_ring_get_size (ring, &height, &width);
+    data = xzmalloc ((size_t)height * width * sizeof (ushort));
+    if ((n = sbig_ring_read (ring, seq, r, sizeof (*r), data,
+                             &height, &width)) < 0 || n != sizeof (*r)) {
+        sbf->errnum = n < 0 ? errno : EPROTO;
+        free (data);
+        free (r);
+        return -1;
+    }
+    free (sbf->data_copy);
+    sbf->data = sbf->data_copy = data;
+    sbf->height = height;
+    sbf->width = width;
+    unspool (sbf, r);
+    return 0;
+}
+
+/* Read a header key if present, otherwise leave 'value' alone.
+ */
+static void read_key (sbfits_t *sbf, int type, const char *key, void *value)
+{
+    if (sbf->status)
+        return;
+    fits_read_key (sbf->fptr, type, (char *)key, value, NULL, &sbf->status);
+    if (sbf->status == KEY_NO_EXIST)
+        sbf->status = 0;
+}
+
+static sbfits_type_t parse_imagetype (const char *s)
+{
+    if (!strcmp (s, "Dark Frame"))
+        return SBFITS_TYPE_DF;
+    if (!strcmp (s, "Bias Frame"))
+        return SBFITS_TYPE_BF;
+    if (!strcmp (s, "Flat Field"))
+        return SBFITS_TYPE_FF;
+    return SBFITS_TYPE_LF;
+}
+
+int sbfits_open_file (sbfits_t *sbf, const char *path)
+{
+    struct spool_rec *r;
+    char imagetyp[FLEN_VALUE] = "";
+    char date[FLEN_VALUE] = "";
+    char instrume[FLEN_VALUE] = "";
+    long cblack = 0, cwhite = 0, pedestal = 0;
+    ushort mode = RM_1X1, snapshot = 1, datamax = 0;
+    double pixw = -1, pixh = -1, gain = 0;
+    int bitpix, naxis;
+    long naxes[2] = { 0, 0 };
+    struct tm tm;
+
+    if (sbf->fptr || sbf->fd >= 0) {
+        sbf->errnum = EBUSY;
+        return -1;
+    }
+    snprintf (sbf->filename, sizeof (sbf->filename), "%s", path);
+    if (fits_open_image (&sbf->fptr, path, READONLY, &sbf->status)) {
+        sbf->fptr = NULL;
+        return -1;
+    }
+    fits_get_img_param (sbf->fptr, 2, &bitpix, &naxis, naxes, &sbf->status);
+    if (sbf->status)
+        return -1;
+    if (naxis != 2 || naxes[0] < 1 || naxes[0] > 65535
+                   || naxes[1] < 1 || naxes[1] > 65535) {
+        sbf->errnum = EINVAL;
+        return -1;
+    }
+    r = xzmalloc (sizeof (*r));
+    read_key (sbf, TSTRING, "DATE-OBS", date);
+    read_key (sbf, TDOUBLE, "EXPTIME", &r->exposure_time);
+    read_key (sbf, TDOUBLE, "CCD-TEMP", &r->temperature);
+    read_key (sbf, TDOUBLE, "SET-TEMP", &r->setpoint);
+    read_key (sbf, TSTRING, "IMAGETYP", imagetyp);
+    read_key (sbf, TSTRING, "SWCREATE", r->swcreate);
+    read_key (sbf, TSTRING, "SITENAME", r->sitename);
+    read_key (sbf, TDOUBLE, "SITEELEV", &r->elevation);
+    read_key (sbf, TSTRING, "SITELAT", r->latitude);
+    read_key (sbf, TSTRING, "SITELONG", r->longitude);
+    read_key (sbf, TSTRING, "OBJECT", r->object);
+    read_key (sbf, TSTRING, "TELESCOP", r->telescope);
+    read_key (sbf, TSTRING, "FILTER", r->filter);
+    read_key (sbf, TSTRING, "OBSERVER", r->observer);
+    read_key (sbf, TSTRING, "INSTRUME", instrume);
+    read_key (sbf, TDOUBLE, "XPIXSZ", &pixw);
+    read_key (sbf, TDOUBLE, "YPIXSZ", &pixh);
+    read_key (sbf, TDOUBLE, "EGAIN", &gain);
+    read_key (sbf, TINT, "XORGSUBF", &r->left);
+    read_key (sbf, TINT, "YORGSUBF", &r->top);
+    read_key (sbf, TUSHORT, "RESMODE", &mode);
+    read_key (sbf, TUSHORT, "SNAPSHOT", &snapshot);
+    read_key (sbf, TDOUBLE, "FOCALLEN", &r->focal_length);
+    read_key (sbf, TDOUBLE, "APTDIA", &r->aperture_diameter);
+    read_key (sbf, TDOUBLE, "APTAREA", &r->aperture_area);
+    read_key (sbf, TLONG, "CBLACK", &cblack);
+    read_key (sbf, TLONG, "CWHITE", &cwhite);
+    read_key (sbf, TLONG, "PEDESTAL", &pedestal);
+    read_key (sbf, TUSHORT, "DATAMAX", &datamax);
+    if (sbf->status) {
+        free (r);
+        return -1;
+    }
+    memset (&tm, 0, sizeof (tm));
+    if (strptime (date, "%Y-%m-%dT%H:%M:%S", &tm))
+        r->t_obs = timegm (&tm);
+    r->image_type = parse_imagetype (imagetyp);
+    r->readout_mode = mode;
+    r->num_exposures = snapshot;
+    r->datamax = datamax;
+    r->cblack = cblack;
+    r->cwhite = cwhite;
+    r->pedestal = pedestal;
+
+    /* Enough of the camera's readout mode table to write XBINNING etc.
+     */
+    snprintf (r->info0.name, sizeof (r->info0.name), "%s", instrume);
+    if (pixw >= 0 && pixh >= 0) {
+        r->info0.readoutModes = 1;
+        r->info0.readoutInfo[0].mode = mode;
+        r->info0.readoutInfo[0].width = naxes[0];
+        r->info0.readoutInfo[0].height = naxes[1];
+        r->info0.readoutInfo[0].gain = dtobcd2_2 (gain);
+        r->info0.readoutInfo[0].pixelWidth = dtobcd6_2 (pixw);
+        r->info0.readoutInfo[0].pixelHeight = dtobcd6_2 (pixh);
+    }
+    sbf->width = naxes[0];
+    sbf->height = naxes[1];
+    sbf->data = NULL;
+    unspool (sbf, r);
+    return 0;
+}
+
+int sbfits_read_rows (sbfits_t *sbf, ushort row, ushort count, ushort *data)
+{
+    long fpixel[2] = { 1, row + 1 };
+
+    if (!sbf->fptr || row + count > sbf->height) {
+        sbf->errnum = EINVAL;
+        return -1;
+    }
+    fits_read_pix (sbf->fptr, TUSHORT, fpixel, (LONGLONG)count * sbf->width,
+                   NULL, data, NULL, &sbf->status);
+    return sbf->status ? -1 : 0;
+}
+
+void sbfits_get_size (sbfits_t *sbf, ushort *height, ushort *width)
+{
+    *height = sbf->height;
+    *width = sbf->width;
+}
+
+double sbfits_get_exposure_time (sbfits_t *sbf)
+{
+    return sbf->exposure_time;
+}
+
+void sbfits_get_temperature (sbfits_t *sbf, double *setpoint,
+                             double *temperature)
+{
+    *setpoint = sbf->setpoint;
+    *temperature = sbf->temperature;
+}
+
+long sbfits_get_pedestal (sbfits_t *sbf)
+{
+    return sbf->pedestal;
+}
+
+void sbfits_set_data (sbfits_t *sbf, ushort *data)
+{
+    sbf->data = data;
+}
+
+struct sbfits_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    List queue;                  /* sbfits_t waiting to be written */
+    int pending;                 /* queued + in progress */
+    int depth;
+    int errors;
+    bool shutdown;
+    int nthreads;
+    pthread_t *threads;
+    sbfits_writer_f cb;
+    void *arg;
+};
+
+static void *writer_thread (void *arg)
+{
+    sbfits_writer_t *w = arg;
+    sbfits_t *sbf;
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock (&w->lock);
+        while (list_is_empty (w->queue) && !w->shutdown)
+            pthread_cond_wait (&w->cond, &w->lock);
+        sbf = list_dequeue (w->queue);
+        pthread_mutex_unlock (&w->lock);
+        if (!sbf)
+            break;
+
+        rc = sbfits_write_file (sbf);
+        if (sbfits_close_file (sbf) < 0)
+            rc = -1;
+        if (w->cb)
+            w->cb (sbf, rc, w->arg);
+        sbfits_destroy (sbf);
+
+        pthread_mutex_lock (&w->lock);
+        if (rc < 0)
+            w->errors++;
+        w->pending--;
+        pthread_cond_broadcast (&w->cond);
+        pthread_mutex_unlock (&w->lock);
+    }
+    return NULL;
+}
+
+sbfits_writer_t *sbfits_writer_create (int nthreads, int depth,
+                                       sbfits_writer_f cb, void *arg)
+{
+    sbfits_writer_t *w = xzmalloc (sizeof (*w));
+    int i, e;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (!fits_is_reentrant ())
+        nthreads = 1;
+    if (depth < nthreads)
+        depth = nthreads;
+    w->nthreads = nthreads;
+    w->depth = depth;
+    w->cb = cb;
+    w->arg = arg;
+    w->queue = list_create (NULL);
+    pthread_mutex_init (&w->lock, NULL);
+    pthread_cond_init (&w->cond, NULL);
+    w->threads = xzmalloc (sizeof (w->threads[0]) * nthreads);
+    for (i = 0; i < nthreads; i++) {
+        if ((e = pthread_create (&w->threads[i], NULL, writer_thread, w))) {
+            w->nthreads = i;
+            sbfits_writer_destroy (w);
+            errno = e;
+            return NULL;
+        }
+    }
+    return w;
+}
+
+void sbfits_writer_destroy (sbfits_writer_t *w)
+{
+    int i;
+
+    if (!w)
+        return;
+    pthread_mutex_lock (&w->lock);
+    w->shutdown = true;
+    pthread_cond_broadcast (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+    for (i = 0; i < w->nthreads; i++)
+        (void)pthread_join (w->threads[i], NULL);
+    list_destroy (w->queue);
+    pthread_mutex_destroy (&w->lock);
+    pthread_cond_destroy (&w->cond);
+    free (w->threads);
+    free (w);
+}
+
+void sbfits_writer_submit (sbfits_writer_t *w, sbfits_t *sbf)
+{
+    /* Rows already streamed with sbfits_write_rows() are in the file,
+     * so only the header remains and there is nothing to copy.
+     */
+    if (!sbf->image_created && sbf->data && sbf->data != sbf->data_copy) {
+        size_t size = sizeof (ushort) * sbf->height * sbf->width;
+        sbf->data_copy = xzmalloc (size);
+        memcpy (sbf->data_copy, sbf->data, size);
+        sbf->data = sbf->data_copy;
+    }
+    pthread_mutex_lock (&w->lock);
+    while (w->pending >= w->depth)
+        pthread_cond_wait (&w->cond, &w->lock);
+    list_enqueue (w->queue, sbf);
+    w->pending++;
+    pthread_cond_broadcast (&w->cond);
+    pthread_mutex_unlock (&w->lock);
+}
+
+int sbfits_writer_flush (sbfits_writer_t *w)
+{
+    int errors;
+
+    pthread_mutex_lock (&w->lock);
+    while (w->pending > 0)
+        pthread_cond_wait (&w->cond, &w->lock);
+    errors = w->errors;
+    w->errors = 0;
+    pthread_mutex_unlock (&w->lock);
+    return errors;
+}
 
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
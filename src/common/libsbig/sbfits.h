@@ -12,12 +12,154 @@ void sbfits_destroy (sbfits_t *sbf);
 
 int sbfits_create_file (sbfits_t *sbf, const char *imagedir, const char *prefix);
 int sbfits_write_file (sbfits_t *sbf);
+
+/* Write the frame as a FITS file in memory instead, e.g. to pipe it to a
+ * previewer without touching disk.  No file may have been created.  The
+ * buffer belongs to 'sbf' and is valid until it is destroyed.
+ */
+int sbfits_write_mem (sbfits_t *sbf, const void **bufp, size_t *lenp);
+
+/* Write the frame in memory with sbfits_write_mem() and stream it to ds9
+ * on xpaset's stdin.  The caller should ignore SIGPIPE in case xpaset
+ * exits before reading it all.
+ */
+int sbfits_preview (sbfits_t *sbf);
+
+/* Enable/disable writing whole frames directly through a memory mapping
+ * of the file instead of through cfitsio (default: enabled).  Frames
+ * streamed with sbfits_write_rows() always go through cfitsio.
+ */
+void sbfits_set_mmap (sbfits_t *sbf, bool enable);
+
+/* Tile compressed output (default: none).  Rice compressed frames are
+ * written directly with tiles compressed in parallel; other types, and
+ * frames streamed with sbfits_write_rows(), use cfitsio's compression.
+ */
+typedef enum {
+    SBFITS_COMPRESS_NONE,
+    SBFITS_COMPRESS_RICE,
+    SBFITS_COMPRESS_HCOMPRESS,
+    SBFITS_COMPRESS_GZIP,
+} sbfits_compress_t;
+
+/* Parse "none", "rice", "hcompress", or "gzip".  Returns -1 if unknown.
+ */
+int sbfits_compress_parse (const char *s, sbfits_compress_t *typep);
+void sbfits_set_compress (sbfits_t *sbf, sbfits_compress_t type);
+
+/* Write 'count' rows of image data starting at 'row' ahead of
+ * sbfits_write_file(), e.g. from a readout row callback.
+ * sbfits_set_ccdinfo() must be called first to establish the image size.
+ * If any rows are written this way, sbfits_write_file() only writes the
+ * header, so the caller is responsible for writing every row.
+ */
+int sbfits_write_rows (sbfits_t *sbf, ushort row, ushort count, ushort *data);
 int sbfits_close_file (sbfits_t *sbf);
 
+/* Asynchronous writer: a pool of threads that write and close files
+ * queued with sbfits_writer_submit(), so a slow disk or NFS image
+ * directory does not stall the camera.
+ */
+typedef struct sbfits_writer sbfits_writer_t;
+
+/* Called from a writer thread when a file has been written and closed.
+ * 'rc' is 0 on success, -1 on failure (see sbfits_get_errstr()).
+ * 'sbf' is destroyed when the callback returns.
+ */
+typedef void (*sbfits_writer_f)(sbfits_t *sbf, int rc, void *arg);
+
+/* Create a pool of 'nthreads' writers.  At most 'depth' files may be
+ * queued or in progress; sbfits_writer_submit() blocks beyond that.
+ * If cfitsio was not built reentrant, only one thread is started.
+ * Returns NULL with errno set on failure.
+ */
+sbfits_writer_t *sbfits_writer_create (int nthreads, int depth,
+                                       sbfits_writer_f cb, void *arg);
+
+/* Drain the queue, then stop the threads.
+ */
+void sbfits_writer_destroy (sbfits_writer_t *w);
+
+/* Queue 'sbf' to be written and closed.  The image data is copied,
+ * so the ccd may be read out again as soon as this returns.  The writer
+ * takes ownership of 'sbf'.  Strings passed to sbfits_set_* must remain
+ * valid until the file is written.
+ */
+void sbfits_writer_submit (sbfits_writer_t *w, sbfits_t *sbf);
+
+/* Wait for all queued files to be written.
+ * Returns the number of files that failed since the last flush.
+ */
+int sbfits_writer_flush (sbfits_writer_t *w);
+
+/* Series: a multi-extension FITS file that frames are appended to, one
+ * extension each, so a burst of frames costs one file create.  Each
+ * extension carries the frame's full header (DATE-OBS, EXPTIME, CCD-TEMP,
+ * etc.) and is named FRAMEnnnn; the primary HDU holds no data.
+ */
+typedef struct sbfits_series sbfits_series_t;
+
+/* Create a file named as by sbfits_create_file() and write the primary HDU.
+ * Returns NULL with errno set on failure.
+ */
+sbfits_series_t *sbfits_series_create (const char *imagedir,
+                                       const char *prefix);
+void sbfits_series_destroy (sbfits_series_t *ser);
+
+/* Append the frame set up in 'sbf', which needs no file of its own.
+ * It is written directly, or through cfitsio as sbfits_write_file() would.
+ * Frames may not be streamed with sbfits_write_rows().
+ */
+int sbfits_series_append (sbfits_series_t *ser, sbfits_t *sbf);
+
+/* Record the number of extensions (NEXTEND) and close the file.
+ */
+int sbfits_series_close (sbfits_series_t *ser);
+
+int sbfits_series_count (sbfits_series_t *ser);
+const char *sbfits_series_get_filename (sbfits_series_t *ser);
+const char *sbfits_series_get_errstr (sbfits_series_t *ser);
+
+/* Append the frame set up in 'sbf', with everything that would go in its
+ * FITS header, to a raw spool (see spool.h).  No file or cfitsio is
+ * involved.  The spool's frame size must match.
+ */
+int sbfits_spool_append (sbig_spool_t *sp, sbfits_t *sbf);
+
+/* Set up 'sbf' from spooled frame 'index', ready for sbfits_create_file()
+ * and sbfits_write_file() as if the frame had just been taken.
+ */
+int sbfits_spool_read (sbig_spool_t *sp, int index, sbfits_t *sbf);
+
+/* Publish the frame set up in 'sbf' to a live frame ring (see ring.h),
+ * with the same metadata as sbfits_spool_append().
+ */
+int sbfits_ring_publish (sbig_ring_t *ring, sbfits_t *sbf);
+
+/* Set up 'sbf' from a copy of frame 'seq' of a ring, as
+ * sbfits_spool_read() would.  This fails if the frame is overwritten
+ * before it can be copied.
+ */
+int sbfits_ring_read (sbig_ring_t *ring, uint64_t seq, sbfits_t *sbf);
+
+/* Open a FITS file written by sbfits for reading, and set up 'sbf' from
+ * its header as sbfits_spool_read() would, except for frame statistics and
+ * history.  No pixels are read; use sbfits_read_rows().  After
+ * sbfits_close_file(), 'sbf' may be given data with sbfits_set_data() and
+ * written to a new file as usual.
+ */
+int sbfits_open_file (sbfits_t *sbf, const char *path);
+int sbfits_read_rows (sbfits_t *sbf, ushort row, ushort count, ushort *data);
+
 const char *sbfits_get_errstr (sbfits_t *sbf);
 const char *sbfits_get_filename (sbfits_t *sbf);
 
 void sbfits_set_ccdinfo (sbfits_t *sbf, sbig_ccd_t *ccd);
+
+/* Override the start (DATE-OBS) and length (EXPTIME) of the exposure
+ * taken from the ccd, e.g. for a co-added frame.
+ */
+void sbfits_set_exposure (sbfits_t *sbf, time_t start, double exposure_time);
 void sbfits_set_num_exposures (sbfits_t *sbf, ushort num_exposures);
 void sbfits_set_observer (sbfits_t *sbf, const char *observer);
 void sbfits_set_telescope (sbfits_t *sbf, const char *telescope);
@@ -32,8 +174,21 @@ void sbfits_set_site (sbfits_t *sbf, const char *name,
                       const char *lat, const char *lng, double elevation);
 void sbfits_set_swcreate (sbfits_t *sbf, const char *swcreate);
 void sbfits_set_imagetype (sbfits_t *sbf, sbfits_type_t type);
+sbfits_type_t sbfits_get_imagetype (sbfits_t *sbf);
+void sbfits_get_size (sbfits_t *sbf, ushort *height, ushort *width);
+double sbfits_get_exposure_time (sbfits_t *sbf);
+void sbfits_get_temperature (sbfits_t *sbf, double *setpoint,
+                             double *temperature);
+long sbfits_get_pedestal (sbfits_t *sbf);
+/* Replace the image data with 'data' of the same size, which must
+ * remain valid until the file is written.
+ */
+void sbfits_set_data (sbfits_t *sbf, ushort *data);
 void sbfits_add_history (sbfits_t *sbf, const char *swmodify, const char *str);
 void sbfits_set_contrast (sbfits_t *sbf, ulong cblack, ulong cwhite);
+/* Set CBLACK/CWHITE from frame statistics, and record them in the header.
+ */
+void sbfits_set_stats (sbfits_t *sbf, const sbig_frame_stats_t *st);
 void sbfits_set_pedestal (sbfits_t *sbf, ulong pedestal);
 
 /*
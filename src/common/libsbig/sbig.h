@@ -4,7 +4,17 @@
 #include "sbigudrv.h"
 #include "handle.h"
 #include "driver.h"
+#include "stats.h"
+#include "focus.h"
+#include "calib.h"
+#include "register.h"
+#include "coadd.h"
+#include "spool.h"
+#include "ring.h"
+#include "client.h"
 #include "camera.h"
+#include "darklib.h"
+#include "stack.h"
 #include "cfw.h"
 #include "ao.h"
 #include "temp.h"
@@ -0,0 +1,337 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Raw frame spool
+ *
+ * Layout (host byte order):
+ *   header, padded to SBIG_SPOOL_ALIGN
+ *   per frame: record header + metadata, padded to SBIG_SPOOL_ALIGN
+ *              height x width pixels, padded to SBIG_SPOOL_ALIGN
+ * Every frame occupies the same size slot, so frame N is found directly.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "sbigudrv.h"
+#include "spool.h"
+
+#define SPOOL_MAGIC     "SBIGSPL"
+#define SPOOL_VERSION   1
+#define SPOOL_ORDER     0x01020304  /* reads back differently if swapped */
+#define FRAME_MAGIC     0x53424652  /* "SBFR" */
+
+struct spool_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t height, width;
+    uint64_t slot;
+};
+
+struct frame_header {
+    uint32_t magic;
+    uint32_t metalen;
+};
+
+struct sbig_spool {
+    int fd;
+    bool writing;
+    ushort height, width;
+    size_t slot;                /* bytes per frame */
+    int count;                  /* frames written/readable */
+    int alloc;                  /* frames preallocated */
+    int grow;                   /* frames to preallocate at a time */
+    char *buf;                  /* aligned slot buffer, for O_DIRECT */
+};
+
+static size_t slot_size (ushort height, ushort width)
+{
+    return SBIG_SPOOL_ALIGN
+         + roundup ((size_t)height * width * sizeof (ushort), SBIG_SPOOL_ALIGN);
+}
+
+static off_t slot_offset (sbig_spool_t *sp, int index)
+{
+    return SBIG_SPOOL_ALIGN + (off_t)index * sp->slot;
+}
+
+static int write_all (int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t n = pwrite (fd, buf, len, off);
+
+    if (n < 0)
+        return -1;
+    if (n < len) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+static int read_all (int fd, void *buf, size_t len, off_t off)
+{
+    ssize_t n = pread (fd, buf, len, off);
+
+    if (n < 0)
+        return -1;
+    if (n < len) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+/* Preallocation only saves the filesystem work during capture, so
+ * filesystems that can't do it are tolerated.  A full disk is not.
+ */
+static int prealloc (sbig_spool_t *sp, int nframes)
+{
+    int e = posix_fallocate (sp->fd, slot_offset (sp, sp->alloc),
+                             (off_t)nframes * sp->slot);
+    if (e != 0 && e != EINVAL && e != EOPNOTSUPP) {
+        errno = e;
+        return -1;
+    }
+    sp->alloc += nframes;
+    return 0;
+}
+
+static void spool_free (sbig_spool_t *sp)
+{
+    if (sp) {
+        int saved_errno = errno;
+        if (sp->fd >= 0)
+            (void)close (sp->fd);
+        free (sp->buf);
+        free (sp);
+        errno = saved_errno;
+    }
+}
+
+static sbig_spool_t *spool_alloc (ushort height, ushort width)
+{
+    sbig_spool_t *sp;
+
+    if (!(sp = calloc (1, sizeof (*sp))))
+        return NULL;
+    sp->fd = -1;
+    sp->height = height;
+    sp->width = width;
+    sp->slot = slot_size (height, width);
+    if ((errno = posix_memalign ((void **)&sp->buf, SBIG_SPOOL_ALIGN,
+                                 SBIG_SPOOL_ALIGN))) {
+        free (sp);
+        return NULL;
+    }
+    return sp;
+}
+
+sbig_spool_t *sbig_spool_create (const char *path, ushort height,
+                                 ushort width, int nframes)
+{
+    sbig_spool_t *sp;
+    struct spool_header hdr;
+    void *buf;
+
+    if (height == 0 || width == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!(sp = spool_alloc (height, width)))
+        return NULL;
+    sp->writing = true;
+    sp->grow = nframes > 0 ? nframes : 1;
+
+    /* The slot buffer is only needed for writing, so is sized here.
+     */
+    if ((errno = posix_memalign (&buf, SBIG_SPOOL_ALIGN, sp->slot)))
+        goto error;
+    free (sp->buf);
+    sp->buf = buf;
+
+    sp->fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_DIRECT, 0666);
+    if (sp->fd < 0 && errno == EINVAL) /* e.g. tmpfs */
+        sp->fd = open (path, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (sp->fd < 0)
+        goto error;
+    if (prealloc (sp, sp->grow) < 0)
+        goto error_unlink;
+
+    memset (&hdr, 0, sizeof (hdr));
+    memcpy (hdr.magic, SPOOL_MAGIC, sizeof (hdr.magic));
+    hdr.version = SPOOL_VERSION;
+    hdr.order = SPOOL_ORDER;
+    hdr.height = height;
+    hdr.width = width;
+    hdr.slot = sp->slot;
+    memset (sp->buf, 0, SBIG_SPOOL_ALIGN);
+    memcpy (sp->buf, &hdr, sizeof (hdr));
+    if (write_all (sp->fd, sp->buf, SBIG_SPOOL_ALIGN, 0) < 0)
+        goto error_unlink;
+    return sp;
+error_unlink:
+    (void)unlink (path);
+error:
+    spool_free (sp);
+    return NULL;
+}
+
+int sbig_spool_append (sbig_spool_t *sp, const void *meta, size_t metalen,
+                       const ushort *data)
+{
+    struct frame_header fh = { .magic = FRAME_MAGIC, .metalen = metalen };
+    size_t len = (size_t)sp->height * sp->width * sizeof (ushort);
+
+    if (!sp->writing || metalen > SBIG_SPOOL_META_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (sp->count == sp->alloc && prealloc (sp, sp->grow) < 0)
+        return -1;
+    memcpy (sp->buf, &fh, sizeof (fh));
+    memcpy (sp->buf + sizeof (fh), meta, metalen);
+    memset (sp->buf + sizeof (fh) + metalen, 0,
+            SBIG_SPOOL_ALIGN - sizeof (fh) - metalen);
+    memcpy (sp->buf + SBIG_SPOOL_ALIGN, data, len);
+    memset (sp->buf + SBIG_SPOOL_ALIGN + len, 0,
+            sp->slot - SBIG_SPOOL_ALIGN - len);
+    if (write_all (sp->fd, sp->buf, sp->slot, slot_offset (sp, sp->count)) < 0)
+        return -1;
+    sp->count++;
+    return 0;
+}
+
+sbig_spool_t *sbig_spool_open (const char *path)
+{
+    sbig_spool_t *sp = NULL;
+    struct spool_header hdr;
+    struct frame_header fh;
+    struct stat sb;
+    int fd, n;
+
+    if ((fd = open (path, O_RDONLY)) < 0)
+        return NULL;
+    if (read_all (fd, &hdr, sizeof (hdr), 0) < 0)
+        goto error;
+    if (memcmp (hdr.magic, SPOOL_MAGIC, sizeof (hdr.magic)) != 0
+            || hdr.version != SPOOL_VERSION || hdr.order != SPOOL_ORDER
+            || hdr.height == 0 || hdr.height > 65535
+            || hdr.width == 0 || hdr.width > 65535
+            || hdr.slot != slot_size (hdr.height, hdr.width)) {
+        errno = EPROTO;
+        goto error;
+    }
+    if (!(sp = spool_alloc (hdr.height, hdr.width)))
+        goto error;
+    sp->fd = fd;
+
+    /* Count frames up to the first slot that was never written.
+     */
+    if (fstat (fd, &sb) < 0)
+        goto error;
+    n = sb.st_size < SBIG_SPOOL_ALIGN ? 0
+      : (sb.st_size - SBIG_SPOOL_ALIGN) / sp->slot;
+    while (sp->count < n) {
+        if (read_all (fd, &fh, sizeof (fh), slot_offset (sp, sp->count)) < 0)
+            goto error;
+        if (fh.magic != FRAME_MAGIC)
+            break;
+        sp->count++;
+    }
+    return sp;
+error:
+    if (sp)
+        spool_free (sp);
+    else
+        (void)close (fd);
+    return NULL;
+}
+
+void sbig_spool_get_size (sbig_spool_t *sp, ushort *height, ushort *width)
+{
+    if (height)
+        *height = sp->height;
+    if (width)
+        *width = sp->width;
+}
+
+int sbig_spool_count (sbig_spool_t *sp)
+{
+    return sp->count;
+}
+
+int sbig_spool_read (sbig_spool_t *sp, int index, void *meta, size_t metalen,
+                     ushort *data)
+{
+    struct frame_header fh;
+    off_t off;
+
+    if (sp->writing || index < 0 || index >= sp->count) {
+        errno = EINVAL;
+        return -1;
+    }
+    off = slot_offset (sp, index);
+    if (read_all (sp->fd, sp->buf, SBIG_SPOOL_ALIGN, off) < 0)
+        return -1;
+    memcpy (&fh, sp->buf, sizeof (fh));
+    if (fh.magic != FRAME_MAGIC || fh.metalen > SBIG_SPOOL_META_MAX) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy (meta, sp->buf + sizeof (fh), MIN (metalen, fh.metalen));
+    if (read_all (sp->fd, data, (size_t)sp->height * sp->width
+                                            * sizeof (ushort),
+                  off + SBIG_SPOOL_ALIGN) < 0)
+        return -1;
+    return fh.metalen;
+}
+
+int sbig_spool_close (sbig_spool_t *sp)
+{
+    int rc = 0;
+
+    if (sp) {
+        if (sp->writing && ftruncate (sp->fd, slot_offset (sp, sp->count)) < 0)
+            rc = -1;
+        if (close (sp->fd) < 0)
+            rc = -1;
+        sp->fd = -1;
+        spool_free (sp);
+    }
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
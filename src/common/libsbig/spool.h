@@ -0,0 +1,58 @@
+#ifndef _SBIG_SPOOL_H
+#define _SBIG_SPOOL_H
+
+#include <stddef.h>
+
+#include "sbigudrv.h"
+
+/* Raw frame spool: a fixed header, then per frame a metadata record and
+ * the frame's rows, each padded to SBIG_SPOOL_ALIGN, so frames can be
+ * appended with sequential O_DIRECT writes.  Metadata records are opaque
+ * here (see sbfits_spool_append()).  Spools are in host byte order,
+ * meant to be read back on the machine that wrote them.
+ */
+
+#define SBIG_SPOOL_ALIGN    4096
+#define SBIG_SPOOL_META_MAX (SBIG_SPOOL_ALIGN - 8)
+
+typedef struct sbig_spool sbig_spool_t;
+
+/* Create a spool for frames of 'height' x 'width' pixels, preallocating
+ * space for 'nframes' (more may be appended).  O_DIRECT is used if the
+ * filesystem supports it.  Returns NULL with errno set on failure.
+ */
+sbig_spool_t *sbig_spool_create (const char *path, ushort height,
+                                 ushort width, int nframes);
+
+/* Append a frame: 'metalen' bytes of metadata and height x width pixels.
+ * Returns -1 with errno set on failure.
+ */
+int sbig_spool_append (sbig_spool_t *sp, const void *meta, size_t metalen,
+                       const ushort *data);
+
+/* Open a spool for reading.  A spool whose writer did not close it is
+ * readable up to the last complete frame.
+ * Returns NULL with errno set on failure.
+ */
+sbig_spool_t *sbig_spool_open (const char *path);
+
+void sbig_spool_get_size (sbig_spool_t *sp, ushort *height, ushort *width);
+int sbig_spool_count (sbig_spool_t *sp);
+
+/* Read frame 'index' (0 based).  Up to 'metalen' bytes of metadata are
+ * copied to 'meta', and its actual length is returned, or -1 with errno
+ * set on failure.  'data' must have room for height x width pixels.
+ */
+int sbig_spool_read (sbig_spool_t *sp, int index, void *meta, size_t metalen,
+                     ushort *data);
+
+/* Close the spool, trimming unused preallocated space if writing.
+ * 'sp' is freed even on failure.
+ */
+int sbig_spool_close (sbig_spool_t *sp);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,260 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Combine a stack of frames into a master, a block of rows at a time
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "sbigudrv.h"
+#include "stack.h"
+#include "parallel.h"
+
+#include "src/common/libutil/xzmalloc.h"
+
+/* One block of rows from every frame: frame f's rows are at
+ * buf + f * nrows * width.
+ */
+struct block {
+    int row0, nrows;
+    ushort *buf;
+};
+
+struct combine_arg {
+    int nframes;
+    int width;
+    sbig_stack_method_t method;
+    double sigma;
+    struct block *b;
+    ushort *out;                /* master */
+    ushort *scratch;            /* nframes values per band */
+};
+
+static const struct {
+    const char *name;
+    sbig_stack_method_t method;
+} method_tab[] = {
+    { "median",     SBIG_STACK_MEDIAN },
+    { "clip",       SBIG_STACK_CLIP },
+};
+static const int method_tab_len = sizeof (method_tab) / sizeof (method_tab[0]);
+
+int sbig_stack_method_parse (const char *s, sbig_stack_method_t *methodp)
+{
+    int i;
+
+    for (i = 0; i < method_tab_len; i++) {
+        if (!strcasecmp (s, method_tab[i].name)) {
+            *methodp = method_tab[i].method;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Partially sort v[0..n-1] so that v[k] is in sorted position, with no
+ * larger value before it and no smaller value after it.
+ */
+static ushort select_nth (ushort *v, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+
+    while (lo < hi) {
+        ushort pivot = v[lo + (hi - lo) / 2];
+        int i = lo, j = hi;
+
+        while (i <= j) {
+            while (v[i] < pivot)
+                i++;
+            while (v[j] > pivot)
+                j--;
+            if (i <= j) {
+                ushort t = v[i];
+                v[i++] = v[j];
+                v[j--] = t;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+    return v[k];
+}
+
+static ushort median (ushort *v, int n)
+{
+    int k = (n - 1) / 2;
+    ushort lo = select_nth (v, n, k);
+    ushort hi;
+    int i;
+
+    if (n % 2)
+        return lo;
+    hi = v[k + 1];
+    for (i = k + 2; i < n; i++) {
+        if (v[i] < hi)
+            hi = v[i];
+    }
+    return (lo + hi + 1) / 2;
+}
+
+/* Mean after repeatedly rejecting values more than 'sigma' standard
+ * deviations from the median.
+ */
+static ushort clip_mean (ushort *v, int n, double sigma)
+{
+    double sum, sumsq, mean, limit;
+    ushort center;
+    int i, m, iter;
+
+    for (iter = 0; ; iter++) {
+        sum = sumsq = 0;
+        for (i = 0; i < n; i++) {
+            sum += v[i];
+            sumsq += (double)v[i] * v[i];
+        }
+        mean = sum / n;
+        if (n < 3 || iter == SBIG_STACK_ITERATIONS)
+            break;
+        limit = sigma * sqrt (fmax (0, (sumsq - sum * mean) / (n - 1)));
+        center = median (v, n);
+        for (i = m = 0; i < n; i++) {
+            if (fabs ((double)v[i] - center) <= limit)
+                v[m++] = v[i];
+        }
+        if (m == n)
+            break;
+        n = m;
+    }
+    return mean >= 65535 ? 65535 : (ushort)(mean + 0.5);
+}
+
+static void combine_band (int index, int row0, int nrows, void *arg)
+{
+    struct combine_arg *a = arg;
+    ushort *v = a->scratch + (size_t)index * a->nframes;
+    size_t plane = (size_t)a->b->nrows * a->width;
+    ushort *out = a->out + (size_t)a->b->row0 * a->width;
+    size_t off, end = (size_t)(row0 + nrows) * a->width;
+    int f;
+
+    for (off = (size_t)row0 * a->width; off < end; off++) {
+        for (f = 0; f < a->nframes; f++)
+            v[f] = a->b->buf[f * plane + off];
+        if (a->method == SBIG_STACK_MEDIAN)
+            out[off] = median (v, a->nframes);
+        else
+            out[off] = clip_mean (v, a->nframes, a->sigma);
+    }
+}
+
+static void *combine_block (void *arg)
+{
+    struct combine_arg *a = arg;
+
+    par_run (0, a->b->nrows, combine_band, a);
+    return NULL;
+}
+
+int sbig_stack_frames (int nframes, ushort height, ushort width,
+                       sbig_stack_method_t method, double sigma,
+                       sbig_stack_read_f read, void *arg, ushort *out)
+{
+    struct block blk[2];
+    struct combine_arg a[2];
+    size_t rowbytes = (size_t)nframes * width * sizeof (ushort);
+    int rows, nbands, i, f, row;
+    pthread_t t;
+    bool running = false;
+    int rc = 0;
+
+    if (nframes < 1 || height == 0 || width == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    rows = SBIG_STACK_BLOCK_BYTES / rowbytes;
+    if (rows < 1)
+        rows = 1;
+    if (rows > height)
+        rows = height;
+    nbands = par_nbands (0, rows);
+    for (i = 0; i < 2; i++) {
+        blk[i].buf = xzmalloc (rows * rowbytes);
+        a[i].nframes = nframes;
+        a[i].width = width;
+        a[i].method = method;
+        a[i].sigma = sigma;
+        a[i].b = &blk[i];
+        a[i].out = out;
+    }
+    a[0].scratch = a[1].scratch = xzmalloc (nbands * nframes
+                                            * sizeof (ushort));
+
+    /* Read each block while the one before it is combined.
+     */
+    for (row = 0, i = 0; row < height; row += rows, i ^= 1) {
+        struct block *b = &blk[i];
+
+        b->row0 = row;
+        b->nrows = height - row < rows ? height - row : rows;
+        for (f = 0; f < nframes && rc == 0; f++) {
+            if (read (f, row, b->nrows,
+                      b->buf + (size_t)f * b->nrows * width, arg) < 0)
+                rc = -1;
+        }
+        if (running) {
+            pthread_join (t, NULL);
+            running = false;
+        }
+        if (rc < 0)
+            break;
+        if (pthread_create (&t, NULL, combine_block, &a[i]) == 0)
+            running = true;
+        else
+            combine_block (&a[i]);
+    }
+    if (running)
+        pthread_join (t, NULL);
+
+    free (a[0].scratch);
+    free (blk[0].buf);
+    free (blk[1].buf);
+    return rc;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,43 @@
+#ifndef _SBIG_STACK_H
+#define _SBIG_STACK_H
+
+#include "sbigudrv.h"
+
+/* Combine a stack of bias, dark, or flat frames pixel by pixel into a
+ * master.  Frames are read a block of rows at a time, so only one block
+ * of each (two while the next is read) is in memory at once.
+ */
+
+#define SBIG_STACK_BLOCK_BYTES  (32*1024*1024)  /* rows of all frames */
+#define SBIG_STACK_SIGMA        3.0     /* default clipping limit */
+#define SBIG_STACK_ITERATIONS   5       /* maximum clipping passes */
+
+typedef enum {
+    SBIG_STACK_MEDIAN,
+    SBIG_STACK_CLIP,                    /* sigma clipped mean */
+} sbig_stack_method_t;
+
+/* Parse "median" or "clip".  Returns -1 if unknown.
+ */
+int sbig_stack_method_parse (const char *s, sbig_stack_method_t *methodp);
+
+/* Read 'count' rows of frame 'frame' starting at 'row' into 'data'.
+ * Return -1 with errno set on failure.
+ */
+typedef int (*sbig_stack_read_f)(int frame, ushort row, ushort count,
+                                 ushort *data, void *arg);
+
+/* Combine 'nframes' frames of height x width pixels into 'out'.  Each
+ * block is combined across all CPUs while the next block is read.
+ * For SBIG_STACK_CLIP, values more than 'sigma' standard deviations from
+ * the median are rejected before averaging.  Returns -1 if 'read' fails.
+ */
+int sbig_stack_frames (int nframes, ushort height, ushort width,
+                       sbig_stack_method_t method, double sigma,
+                       sbig_stack_read_f read, void *arg, ushort *out);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
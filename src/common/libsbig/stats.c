@@ -0,0 +1,158 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <math.h>
+
+#include "sbigudrv.h"
+#include "stats.h"
+
+void sbig_stats_init (sbig_frame_stats_t *st, ushort saturation,
+                      ushort hot_delta)
+{
+    memset (st, 0, sizeof (*st));
+    st->saturation = saturation;
+    st->hot_delta = hot_delta;
+    st->min = 65535;
+}
+
+void sbig_stats_add_row (sbig_frame_stats_t *st, const ushort *data,
+                         int width)
+{
+    unsigned long long sum = 0, sumsq = 0;
+    ulong saturated = 0, hot = 0;
+    ushort min = st->min, max = st->max;
+    ulong *hist = st->hist;
+    int i;
+
+    for (i = 0; i < width; i++) {
+        ushort v = data[i];
+
+        if (v < min)
+            min = v;
+        if (v > max)
+            max = v;
+        sum += v;
+        sumsq += (ulong)v * v;
+        hist[v >> 4]++;
+        if (v >= st->saturation)
+            saturated++;
+        if (i > 0 && i < width - 1) {
+            ushort n = data[i - 1] > data[i + 1] ? data[i - 1] : data[i + 1];
+            if (v > 2UL * n + st->hot_delta)
+                hot++;
+        }
+    }
+    st->min = min;
+    st->max = max;
+    st->sum += sum;
+    st->sumsq += sumsq;
+    st->saturated += saturated;
+    st->hot += hot;
+    st->npix += width;
+}
+
+void sbig_stats_merge (sbig_frame_stats_t *st, const sbig_frame_stats_t *part)
+{
+    int i;
+
+    if (part->npix == 0)
+        return;
+    if (part->min < st->min)
+        st->min = part->min;
+    if (part->max > st->max)
+        st->max = part->max;
+    st->sum += part->sum;
+    st->sumsq += part->sumsq;
+    st->saturated += part->saturated;
+    st->hot += part->hot;
+    st->npix += part->npix;
+    for (i = 0; i < SBIG_STATS_BINS; i++)
+        st->hist[i] += part->hist[i];
+}
+
+void sbig_stats_finish (sbig_frame_stats_t *st)
+{
+    double var;
+
+    if (st->npix == 0) {
+        st->min = st->max = 0;
+        st->mean = st->stddev = 0;
+        return;
+    }
+    st->mean = (double)st->sum / st->npix;
+    var = (double)st->sumsq / st->npix - st->mean * st->mean;
+    st->stddev = var > 0 ? sqrt (var) : 0;
+}
+
+/* Borrowed from CSBIGImg::AutoBackgroundAndRange() (sdk/app).
+ */
+void sbig_stats_contrast (const sbig_frame_stats_t *st,
+                          long *cblack, long *cwhite)
+{
+    ulong histSum, s20, s99;
+    ushort p20, p99;
+    long back, range;
+    int i;
+
+    // integrate the histogram and find the 20% and 99% points
+    s20 = (20 * st->npix) / 100;
+    s99 = (99 * st->npix) / 100;
+    histSum = 0;
+    p20 = p99 = 65535;
+    for (i = 0; i < SBIG_STATS_BINS; i++) {
+            histSum += st->hist[i];
+            if (histSum >= s20 && p20 == 65535)
+                    p20 = i;
+            if (histSum >= s99 && p99 == 65535)
+                    p99 = i;
+    }
+
+    // set the range to 110% of the difference between
+    // the 99% and 20% histogram points, not letting
+    // it be too low or overflow unsigned short
+    range = (16L * (p99 - p20) * 11) / 10;
+    if (range < 64)
+            range = 64;
+    else if (range > 65536)
+            range = 65536;
+
+    // set the background to the 20% point lowered
+    // by 10% of the range so it's not completely
+    // black.  Also check for overrange and don't
+    // let a saturated image show up a black
+    back = 16L * p20 - range / 10;
+    if (p20 >= 4080)        // saturated image?
+            back = 16L * 4080 - range;
+
+    *cblack = back;
+    *cwhite = back + range;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
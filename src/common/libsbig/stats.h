@@ -0,0 +1,54 @@
+#ifndef _SBIG_STATS_H
+#define _SBIG_STATS_H
+
+#include "sbigudrv.h"
+
+/* Frame statistics, accumulated a row at a time in a single pass so
+ * they can be gathered while the frame is read out.
+ */
+
+#define SBIG_STATS_BINS     4096    /* histogram bin is pixel value >> 4 */
+#define SBIG_STATS_HOT_DELTA 256    /* default hot pixel threshold, ADU */
+
+typedef struct {
+    /* limits, set by sbig_stats_init() */
+    ushort saturation;  /* pixels >= saturation are counted as saturated */
+    ushort hot_delta;   /* pixels > 2x brighter row neighbor + hot_delta
+                           are counted as hot (single pixel spikes) */
+    /* results, valid after sbig_stats_finish() */
+    ulong npix;
+    ushort min, max;
+    double mean, stddev;
+    ulong saturated;
+    ulong hot;
+    ulong hist[SBIG_STATS_BINS];
+    /* running sums */
+    unsigned long long sum, sumsq;
+} sbig_frame_stats_t;
+
+void sbig_stats_init (sbig_frame_stats_t *st, ushort saturation,
+                      ushort hot_delta);
+
+/* Accumulate one row of 'width' pixels.
+ */
+void sbig_stats_add_row (sbig_frame_stats_t *st, const ushort *data,
+                         int width);
+
+/* Fold partial statistics 'part' (e.g. from another band of rows) into 'st'.
+ */
+void sbig_stats_merge (sbig_frame_stats_t *st, const sbig_frame_stats_t *part);
+
+/* Compute mean and stddev from the running sums.
+ */
+void sbig_stats_finish (sbig_frame_stats_t *st);
+
+/* Calculate CBLACK and CWHITE display limits from the histogram.
+ */
+void sbig_stats_contrast (const sbig_frame_stats_t *st,
+                          long *cblack, long *cwhite);
+
+#endif
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
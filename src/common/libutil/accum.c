@@ -0,0 +1,107 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Widening accumulation of 16-bit frames into 32-bit sums, for co-adding.
+ * The vector kernels zero extend 8 or 16 pixels at a time and add them
+ * to the sums in place.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+
+#include "accum.h"
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void (*accum_f)(uint32_t *acc, const ushort *data, size_t n);
+
+static void accum_scalar (uint32_t *acc, const ushort *data, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        acc[i] += data[i];
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void accum_sse2 (uint32_t *acc, const ushort *data, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i d = _mm_loadu_si128 ((const __m128i *)(data + i));
+        __m128i lo = _mm_loadu_si128 ((const __m128i *)(acc + i));
+        __m128i hi = _mm_loadu_si128 ((const __m128i *)(acc + i + 4));
+        lo = _mm_add_epi32 (lo, _mm_unpacklo_epi16 (d, zero));
+        hi = _mm_add_epi32 (hi, _mm_unpackhi_epi16 (d, zero));
+        _mm_storeu_si128 ((__m128i *)(acc + i), lo);
+        _mm_storeu_si128 ((__m128i *)(acc + i + 4), hi);
+    }
+    accum_scalar (acc + i, data + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void accum_avx2 (uint32_t *acc, const ushort *data, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i d0 = _mm_loadu_si128 ((const __m128i *)(data + i));
+        __m128i d1 = _mm_loadu_si128 ((const __m128i *)(data + i + 8));
+        __m256i lo = _mm256_loadu_si256 ((const __m256i *)(acc + i));
+        __m256i hi = _mm256_loadu_si256 ((const __m256i *)(acc + i + 8));
+        lo = _mm256_add_epi32 (lo, _mm256_cvtepu16_epi32 (d0));
+        hi = _mm256_add_epi32 (hi, _mm256_cvtepu16_epi32 (d1));
+        _mm256_storeu_si256 ((__m256i *)(acc + i), lo);
+        _mm256_storeu_si256 ((__m256i *)(acc + i + 8), hi);
+    }
+    accum_scalar (acc + i, data + i, n - i);
+}
+#endif
+
+/* Indexed by cpu_level ().
+ */
+static const accum_f kernels[CPU_LEVELS] = {
+    [CPU_SCALAR] = accum_scalar,
+#if HAVE_X86_SIMD
+    [CPU_SSE2] = accum_sse2,
+    [CPU_AVX2] = accum_avx2,
+#endif
+};
+
+void accum_ushort (uint32_t *acc, const ushort *data, size_t n)
+{
+    kernels[cpu_level ()] (acc, data, n);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,18 @@
+#ifndef _UTIL_ACCUM_H
+#define _UTIL_ACCUM_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Add 'n' pixels of 'data' to the 32-bit sums in 'acc':
+ *   acc[i] += data[i]
+ * At most 65537 frames can be summed without overflow.
+ */
+void accum_ushort (uint32_t *acc, const ushort *data, size_t n);
+
+#endif /* _UTIL_ACCUM_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
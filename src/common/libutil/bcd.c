@@ -49,6 +49,29 @@ double bcd6_2 (ulong i)
           + 1E5 * ((i >> 28) & 0xf);
 }
 
+static ulong dtobcd (double d, int digits)
+{
+    ulong v = d > 0 ? (ulong)(d * 100 + 0.5) : 0;
+    ulong i = 0;
+    int n;
+
+    for (n = 0; n < digits; n++) {
+        i |= (v % 10) << (4 * n);
+        v /= 10;
+    }
+    return i;
+}
+
+ushort dtobcd2_2 (double d)
+{
+    return dtobcd (d, 4);
+}
+
+ulong dtobcd6_2 (double d)
+{
+    return dtobcd (d, 8);
+}
+
 void bcd4str (ushort i, char *buf, int len)
 {
     snprintf (buf, len, "%2.2f", bcd2_2 (i));
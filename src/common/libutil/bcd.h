@@ -7,6 +7,11 @@ void bcd4str (ushort i, char *buf, int len);
 double bcd2_2 (ushort i);
 double bcd6_2 (ulong i);
 
+/* Inverses of bcd2_2() and bcd6_2(), for values read back from FITS.
+ */
+ushort dtobcd2_2 (double d);
+ulong dtobcd6_2 (double d);
+
 #endif /* !_UTIL_BCD_H */
 
 /*
@@ -0,0 +1,103 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+
+#include "bswap.h"
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void (*bswap_f)(const ushort *in, ushort *out, size_t n);
+
+static void bswap_scalar (const ushort *in, ushort *out, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        out[i] = in[i] ^ 0x8000;
+#else
+        out[i] = __builtin_bswap16 (in[i] ^ 0x8000);
+#endif
+    }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void bswap_sse2 (const ushort *in, ushort *out, size_t n)
+{
+    const __m128i sign = _mm_set1_epi16 ((short)0x8000);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *)(in + i));
+        v = _mm_xor_si128 (v, sign);
+        v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+        _mm_storeu_si128 ((__m128i *)(out + i), v);
+    }
+    bswap_scalar (in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bswap_avx2 (const ushort *in, ushort *out, size_t n)
+{
+    const __m256i sign = _mm256_set1_epi16 ((short)0x8000);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *)(in + i));
+        v = _mm256_xor_si256 (v, sign);
+        v = _mm256_or_si256 (_mm256_slli_epi16 (v, 8),
+                             _mm256_srli_epi16 (v, 8));
+        _mm256_storeu_si256 ((__m256i *)(out + i), v);
+    }
+    bswap_scalar (in + i, out + i, n - i);
+}
+#endif
+
+/* Indexed by cpu_level ().
+ */
+static const bswap_f kernels[CPU_LEVELS] = {
+    [CPU_SCALAR] = bswap_scalar,
+#if HAVE_X86_SIMD
+    [CPU_SSE2] = bswap_sse2,
+    [CPU_AVX2] = bswap_avx2,
+#endif
+};
+
+void bswap_fits_ushort (const ushort *in, ushort *out, size_t n)
+{
+    kernels[cpu_level ()] (in, out, n);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,17 @@
+#ifndef _UTIL_BSWAP_H
+#define _UTIL_BSWAP_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Convert 'n' host order unsigned 16-bit pixels to the FITS BITPIX=16
+ * representation with BZERO=32768: subtract 32768 (flip the sign bit)
+ * and store big-endian.  'in' and 'out' may be the same buffer.
+ */
+void bswap_fits_ushort (const ushort *in, ushort *out, size_t n);
+
+#endif /* _UTIL_BSWAP_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
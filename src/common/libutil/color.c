@@ -24,7 +24,188 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+
 #include "color.h"
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Interior kernel: compute 'n' output pixels from the rows above,
+ * at and below, each pointer positioned at the first output column
+ * (so ptr[-1] and ptr[n] are valid).  The weights sum to 14, so the
+ * result is sum / 14 and never needs clamping.
+ *
+ * The SIMD kernels divide in single precision and truncate.  This is
+ * exact: sum < 2^20 converts exactly, IEEE division is correctly rounded,
+ * and a non-multiple of 14 lies at least 1/14 from an integer, far more
+ * than the rounding error for quotients up to 65535.
+ */
+typedef void (*interior_f)(const ushort *up, const ushort *mid,
+                           const ushort *dn, ushort *out, int n);
+
+/* Separable form: vertical sums of the outer rows are carried across
+ * the row in a sliding window, so each input pixel is loaded once.
+ */
+static void interior_scalar (const ushort *up, const ushort *mid,
+                             const ushort *dn, ushort *out, int n)
+{
+    unsigned int vl = up[-1] + dn[-1];
+    unsigned int vc = up[0] + dn[0];
+    unsigned int ml = mid[-1];
+    unsigned int mc = mid[0];
+    unsigned int vr, mr;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        vr = up[i + 1] + dn[i + 1];
+        mr = mid[i + 1];
+        out[i] = (vl + vc + vr + 2 * (ml + mr) + 4 * mc) / 14;
+        vl = vc;
+        vc = vr;
+        ml = mc;
+        mc = mr;
+    }
+}
+
+#if HAVE_X86_SIMD
+/* Sum one half of the 16-bit lanes, widened to 32 bits with UNPACK.
+ */
+#define SSE2_KSUM(UNPACK) \
+    _mm_add_epi32 ( \
+        _mm_add_epi32 ( \
+            _mm_add_epi32 (UNPACK (ul, z), _mm_add_epi32 (UNPACK (uc, z), \
+                                                          UNPACK (ur, z))), \
+            _mm_add_epi32 (UNPACK (dl, z), _mm_add_epi32 (UNPACK (dc, z), \
+                                                          UNPACK (dr, z)))), \
+        _mm_add_epi32 ( \
+            _mm_slli_epi32 (_mm_add_epi32 (UNPACK (ml, z), UNPACK (mr, z)), 1), \
+            _mm_slli_epi32 (UNPACK (mc, z), 2)))
+
+__attribute__((target("sse2")))
+static void interior_sse2 (const ushort *up, const ushort *mid,
+                           const ushort *dn, ushort *out, int n)
+{
+    const __m128i z = _mm_setzero_si128 ();
+    const __m128 div = _mm_set1_ps (14.0f);
+    const __m128i bias32 = _mm_set1_epi32 (0x8000);
+    const __m128i bias16 = _mm_set1_epi16 ((short)0x8000);
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i ul = _mm_loadu_si128 ((const __m128i *)(up + i - 1));
+        __m128i uc = _mm_loadu_si128 ((const __m128i *)(up + i));
+        __m128i ur = _mm_loadu_si128 ((const __m128i *)(up + i + 1));
+        __m128i ml = _mm_loadu_si128 ((const __m128i *)(mid + i - 1));
+        __m128i mc = _mm_loadu_si128 ((const __m128i *)(mid + i));
+        __m128i mr = _mm_loadu_si128 ((const __m128i *)(mid + i + 1));
+        __m128i dl = _mm_loadu_si128 ((const __m128i *)(dn + i - 1));
+        __m128i dc = _mm_loadu_si128 ((const __m128i *)(dn + i));
+        __m128i dr = _mm_loadu_si128 ((const __m128i *)(dn + i + 1));
+        __m128i lo = SSE2_KSUM (_mm_unpacklo_epi16);
+        __m128i hi = SSE2_KSUM (_mm_unpackhi_epi16);
+
+        lo = _mm_cvttps_epi32 (_mm_div_ps (_mm_cvtepi32_ps (lo), div));
+        hi = _mm_cvttps_epi32 (_mm_div_ps (_mm_cvtepi32_ps (hi), div));
+
+        /* SSE2 has no unsigned 32->16 pack: shift into signed range,
+         * pack (never saturates), then flip the sign bit back.
+         */
+        lo = _mm_sub_epi32 (lo, bias32);
+        hi = _mm_sub_epi32 (hi, bias32);
+        _mm_storeu_si128 ((__m128i *)(out + i),
+                          _mm_xor_si128 (_mm_packs_epi32 (lo, hi), bias16));
+    }
+    interior_scalar (up + i, mid + i, dn + i, out + i, n - i);
+}
+
+#define AVX2_KSUM(UNPACK) \
+    _mm256_add_epi32 ( \
+        _mm256_add_epi32 ( \
+            _mm256_add_epi32 (UNPACK (ul, z), \
+                              _mm256_add_epi32 (UNPACK (uc, z), UNPACK (ur, z))), \
+            _mm256_add_epi32 (UNPACK (dl, z), \
+                              _mm256_add_epi32 (UNPACK (dc, z), UNPACK (dr, z)))), \
+        _mm256_add_epi32 ( \
+            _mm256_slli_epi32 (_mm256_add_epi32 (UNPACK (ml, z), \
+                                                 UNPACK (mr, z)), 1), \
+            _mm256_slli_epi32 (UNPACK (mc, z), 2)))
+
+/* AVX2 unpack and pack both work within 128-bit lanes, so unpacking
+ * lo/hi and packing the results back restores the original pixel order.
+ */
+__attribute__((target("avx2")))
+static void interior_avx2 (const ushort *up, const ushort *mid,
+                           const ushort *dn, ushort *out, int n)
+{
+    const __m256i z = _mm256_setzero_si256 ();
+    const __m256 div = _mm256_set1_ps (14.0f);
+    int i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i ul = _mm256_loadu_si256 ((const __m256i *)(up + i - 1));
+        __m256i uc = _mm256_loadu_si256 ((const __m256i *)(up + i));
+        __m256i ur = _mm256_loadu_si256 ((const __m256i *)(up + i + 1));
+        __m256i ml = _mm256_loadu_si256 ((const __m256i *)(mid + i - 1));
+        __m256i mc = _mm256_loadu_si256 ((const __m256i *)(mid + i));
+        __m256i mr = _mm256_loadu_si256 ((const __m256i *)(mid + i + 1));
+        __m256i dl = _mm256_loadu_si256 ((const __m256i *)(dn + i - 1));
+        __m256i dc = _mm256_loadu_si256 ((const __m256i *)(dn + i));
+        __m256i dr = _mm256_loadu_si256 ((const __m256i *)(dn + i + 1));
+        __m256i lo = AVX2_KSUM (_mm256_unpacklo_epi16);
+        __m256i hi = AVX2_KSUM (_mm256_unpackhi_epi16);
+
+        lo = _mm256_cvttps_epi32 (_mm256_div_ps (_mm256_cvtepi32_ps (lo), div));
+        hi = _mm256_cvttps_epi32 (_mm256_div_ps (_mm256_cvtepi32_ps (hi), div));
+
+        _mm256_storeu_si256 ((__m256i *)(out + i),
+                             _mm256_packus_epi32 (lo, hi));
+    }
+    interior_scalar (up + i, mid + i, dn + i, out + i, n - i);
+}
+#endif /* HAVE_X86_SIMD */
+
+/* Indexed by cpu_level ().
+ */
+static const interior_f kernels[CPU_LEVELS] = {
+    [CPU_SCALAR] = interior_scalar,
+#if HAVE_X86_SIMD
+    [CPU_SSE2] = interior_sse2,
+    [CPU_AVX2] = interior_avx2,
+#endif
+};
+
+static int kernel_level = -1; /* -1 for cpu_level () */
+
+static cpu_level_t kernel_get (void)
+{
+    return kernel_level < 0 ? cpu_level () : kernel_level;
+}
+
+int color_set_kernel (const char *name)
+{
+    int i;
+
+    if (!name || !strcmp (name, "auto")) {
+        kernel_level = -1;
+        return 0;
+    }
+    for (i = 0; i <= cpu_level (); i++) {
+        if (!strcmp (cpu_level_name (i), name)) {
+            kernel_level = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *color_get_kernel (void)
+{
+    return cpu_level_name (kernel_get ());
+}
 
 static void addcell (ushort *frame, int width, int height,
                     int row, int col, int weight,
@@ -36,35 +217,71 @@ static void addcell (ushort *frame, int width, int height,
     }
 }
 
-void color_bayer_to_mono (ushort *in, ushort *out, int width, int height)
+static ushort bayer_pixel (ushort *in, int width, int height, int row, int col)
+{
+    int count = 0;
+    int val = 0;
+
+    addcell (in, width, height, row - 1, col - 1, 1, &val, &count);
+    addcell (in, width, height, row - 1, col + 0, 1, &val, &count);
+    addcell (in, width, height, row - 1, col + 1, 1, &val, &count);
+
+    addcell (in, width, height, row + 0, col - 1, 2, &val, &count);
+    addcell (in, width, height, row + 0, col + 0, 4, &val, &count);
+    addcell (in, width, height, row + 0, col + 1, 2, &val, &count);
+
+    addcell (in, width, height, row + 1, col - 1, 1, &val, &count);
+    addcell (in, width, height, row + 1, col + 0, 1, &val, &count);
+    addcell (in, width, height, row + 1, col + 1, 1, &val, &count);
+
+    val /= count;
+    if (val < 0 || val > 65535)
+        val = 65535;
+    return (ushort)val;
+}
+
+void color_bayer_to_mono_ref (ushort *in, ushort *out, int width, int height)
 {
     int row, col;
 
     for (row = 0; row < height;  row++) {
-        for (col = 0; col < width; col++) {
-            int count = 0;
-            int val = 0;
-
-            addcell (in, width, height, row - 1, col - 1, 1, &val, &count);
-            addcell (in, width, height, row - 1, col + 0, 1, &val, &count);
-            addcell (in, width, height, row - 1, col + 1, 1, &val, &count);
-
-            addcell (in, width, height, row + 0, col - 1, 2, &val, &count);
-            addcell (in, width, height, row + 0, col + 0, 4, &val, &count);
-            addcell (in, width, height, row + 0, col + 1, 2, &val, &count);
-
-            addcell (in, width, height, row + 1, col - 1, 1, &val, &count);
-            addcell (in, width, height, row + 1, col + 0, 1, &val, &count);
-            addcell (in, width, height, row + 1, col + 1, 1, &val, &count);
-
-            val /= count;
-            if (val < 0 || val > 65535)
-                val = 65535;
-            out[(row * width) + col] = (ushort)val;
-         }
+        for (col = 0; col < width; col++)
+            out[(row * width) + col] = bayer_pixel (in, width, height, row, col);
+    }
+}
+
+void color_bayer_to_mono_rows (ushort *in, ushort *out, int width, int height,
+                               int row0, int nrows)
+{
+    interior_f interior;
+    int row, col;
+
+    interior = kernels[kernel_get ()];
+
+    for (row = row0; row < row0 + nrows; row++) {
+        ushort *o = out + row * width;
+
+        /* Border pass: first and last row and column use the bounds
+         * checked reference, which renormalizes by the weights in range.
+         */
+        if (row == 0 || row == height - 1 || width < 3) {
+            for (col = 0; col < width; col++)
+                o[col] = bayer_pixel (in, width, height, row, col);
+            continue;
+        }
+        o[0] = bayer_pixel (in, width, height, row, 0);
+        o[width - 1] = bayer_pixel (in, width, height, row, width - 1);
+
+        interior (in + (row - 1) * width + 1, in + row * width + 1,
+                  in + (row + 1) * width + 1, o + 1, width - 2);
     }
 }
 
+void color_bayer_to_mono (ushort *in, ushort *out, int width, int height)
+{
+    color_bayer_to_mono_rows (in, out, width, height, 0, height);
+}
+
 /*
  * vi:tabstop=4 shiftwidth=4 expandtab
  */
@@ -12,6 +12,23 @@
  */
 void color_bayer_to_mono (ushort *in, ushort *out, int width, int height);
 
+/* Convert only rows [row0, row0 + nrows) of the output.  The whole
+ * input image must be available, since border rows read their neighbors.
+ */
+void color_bayer_to_mono_rows (ushort *in, ushort *out, int width, int height,
+                               int row0, int nrows);
+
+/* Straightforward bounds checked implementation of the above, kept as the
+ * reference that the optimized kernels must match bit for bit.
+ */
+void color_bayer_to_mono_ref (ushort *in, ushort *out, int width, int height);
+
+/* Select the interior kernel: "auto" (best supported, the default),
+ * "avx2", "sse2", or "scalar".  Returns -1 if unknown or unsupported.
+ */
+int color_set_kernel (const char *name);
+const char *color_get_kernel (void);
+
 
 #endif /* _UTIL_COLOR_H */
 
@@ -0,0 +1,66 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+
+#include "cpu.h"
+
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+static cpu_level_t level = CPU_SCALAR;
+
+static void level_init (void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init ();
+    if (__builtin_cpu_supports ("avx2"))
+        level = CPU_AVX2;
+    else if (__builtin_cpu_supports ("sse2"))
+        level = CPU_SSE2;
+#endif
+}
+
+cpu_level_t cpu_level (void)
+{
+    pthread_once (&level_once, level_init);
+    return level;
+}
+
+const char *cpu_level_name (cpu_level_t level)
+{
+    switch (level) {
+        case CPU_AVX2:
+            return "avx2";
+        case CPU_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,49 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+#ifndef _UTIL_CPU_H
+#define _UTIL_CPU_H
+
+/* SIMD instruction sets the pixel kernels are built for, in order, so a
+ * kernel may be used if its level is <= cpu_level ().
+ */
+typedef enum {
+    CPU_SCALAR = 0,
+    CPU_SSE2 = 1,
+    CPU_AVX2 = 2,
+} cpu_level_t;
+
+#define CPU_LEVELS 3
+
+/* Best level this CPU supports, probed on the first call.
+ */
+cpu_level_t cpu_level (void);
+
+/* "scalar", "sse2", or "avx2".
+ */
+const char *cpu_level_name (cpu_level_t level);
+
+#endif /* _UTIL_CPU_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,113 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Saturating dark subtraction.  Written as light - (dark - pedestal), one
+ * of whose two saturating 16-bit steps is a no-op per pixel, the vector
+ * kernels give exactly the clamped result without widening to 32 bits:
+ *   dark >= pedestal:  out = light -sat (dark - pedestal)
+ *   dark <  pedestal:  out = light +sat (pedestal - dark)
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdbool.h>
+
+#include "darksub.h"
+#include "cpu.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+typedef void (*darksub_f)(const ushort *light, const ushort *dark,
+                          ushort pedestal, ushort *out, size_t n);
+
+static void darksub_scalar (const ushort *light, const ushort *dark,
+                            ushort pedestal, ushort *out, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        int v = (int)light[i] - dark[i] + pedestal;
+        out[i] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+    }
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void darksub_sse2 (const ushort *light, const ushort *dark,
+                          ushort pedestal, ushort *out, size_t n)
+{
+    const __m128i ped = _mm_set1_epi16 ((short)pedestal);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i l = _mm_loadu_si128 ((const __m128i *)(light + i));
+        __m128i d = _mm_loadu_si128 ((const __m128i *)(dark + i));
+        l = _mm_subs_epu16 (l, _mm_subs_epu16 (d, ped));
+        l = _mm_adds_epu16 (l, _mm_subs_epu16 (ped, d));
+        _mm_storeu_si128 ((__m128i *)(out + i), l);
+    }
+    darksub_scalar (light + i, dark + i, pedestal, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void darksub_avx2 (const ushort *light, const ushort *dark,
+                          ushort pedestal, ushort *out, size_t n)
+{
+    const __m256i ped = _mm256_set1_epi16 ((short)pedestal);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i l = _mm256_loadu_si256 ((const __m256i *)(light + i));
+        __m256i d = _mm256_loadu_si256 ((const __m256i *)(dark + i));
+        l = _mm256_subs_epu16 (l, _mm256_subs_epu16 (d, ped));
+        l = _mm256_adds_epu16 (l, _mm256_subs_epu16 (ped, d));
+        _mm256_storeu_si256 ((__m256i *)(out + i), l);
+    }
+    darksub_scalar (light + i, dark + i, pedestal, out + i, n - i);
+}
+#endif
+
+/* Indexed by cpu_level ().
+ */
+static const darksub_f kernels[CPU_LEVELS] = {
+    [CPU_SCALAR] = darksub_scalar,
+#if HAVE_X86_SIMD
+    [CPU_SSE2] = darksub_sse2,
+    [CPU_AVX2] = darksub_avx2,
+#endif
+};
+
+void darksub_ushort (const ushort *light, const ushort *dark,
+                     ushort pedestal, ushort *out, size_t n)
+{
+    kernels[cpu_level ()] (light, dark, pedestal, out, n);
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,18 @@
+#ifndef _UTIL_DARKSUB_H
+#define _UTIL_DARKSUB_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/* Subtract a dark frame with pedestal, saturating:
+ *   out = clamp (light - dark + pedestal, 0, 65535)
+ * over 'n' pixels.  'out' may be the same buffer as 'light'.
+ */
+void darksub_ushort (const ushort *light, const ushort *dark,
+                     ushort pedestal, ushort *out, size_t n);
+
+#endif /* _UTIL_DARKSUB_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,124 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Iterative decimation in time FFT: bit reverse the input, then log2(n)
+ * passes of butterflies with precomputed twiddle factors.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+
+#include "fft.h"
+#include "xzmalloc.h"
+
+struct fft_plan {
+    int n;
+    int *rev;                   /* bit reversal permutation */
+    float complex *w;           /* exp(-2 pi i k / n), k < n / 2 */
+};
+
+fft_plan_t *fft_plan_create (int n)
+{
+    fft_plan_t *plan;
+    int i, j, bits;
+
+    if (n < 2 || (n & (n - 1))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    plan = xzmalloc (sizeof (*plan));
+    plan->n = n;
+    plan->rev = xzmalloc (n * sizeof (plan->rev[0]));
+    plan->w = xzmalloc ((n / 2) * sizeof (plan->w[0]));
+    for (bits = 0; (1 << bits) < n; bits++)
+        ;
+    for (i = 0; i < n; i++) {
+        int r = 0;
+        for (j = 0; j < bits; j++)
+            if (i & (1 << j))
+                r |= 1 << (bits - 1 - j);
+        plan->rev[i] = r;
+    }
+    for (i = 0; i < n / 2; i++) {
+        double a = -2 * M_PI * i / n;
+        plan->w[i] = cos (a) + I * sin (a);
+    }
+    return plan;
+}
+
+void fft_plan_destroy (fft_plan_t *plan)
+{
+    if (plan) {
+        free (plan->rev);
+        free (plan->w);
+        free (plan);
+    }
+}
+
+int fft_plan_size (fft_plan_t *plan)
+{
+    return plan->n;
+}
+
+void fft_1d (fft_plan_t *plan, float complex *x, int stride, bool inverse)
+{
+    int n = plan->n;
+    int i, j, k, len;
+
+    for (i = 0; i < n; i++) {
+        j = plan->rev[i];
+        if (i < j) {
+            float complex t = x[i * stride];
+            x[i * stride] = x[j * stride];
+            x[j * stride] = t;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len / 2;
+        int step = n / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; k++) {
+                float complex w = plan->w[k * step];
+                float complex *a = &x[(i + k) * stride];
+                float complex *b = &x[(i + k + half) * stride];
+                float wr = crealf (w);
+                float wi = inverse ? -cimagf (w) : cimagf (w);
+                float br = crealf (*b), bi = cimagf (*b);
+                /* w * b, written out to avoid the NaN handling of a
+                 * complex multiply */
+                float complex t = (wr * br - wi * bi) + I * (wr * bi + wi * br);
+
+                *b = *a - t;
+                *a = *a + t;
+            }
+        }
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
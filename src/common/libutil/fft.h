@@ -0,0 +1,31 @@
+#ifndef _UTIL_FFT_H
+#define _UTIL_FFT_H
+
+#include <stdbool.h>
+#include <complex.h>
+
+/* In-place radix-2 complex FFT of single precision data.  A plan holds
+ * the twiddle factors and bit reversal permutation for one length, and
+ * may be shared by threads transforming different arrays.
+ */
+
+typedef struct fft_plan fft_plan_t;
+
+/* Create a plan for transforms of length 'n', a power of two.
+ * Returns NULL with errno set on failure.
+ */
+fft_plan_t *fft_plan_create (int n);
+void fft_plan_destroy (fft_plan_t *plan);
+
+int fft_plan_size (fft_plan_t *plan);
+
+/* Transform the 'n' elements x[0], x[stride], ... x[(n - 1) * stride].
+ * The inverse transform is unnormalized, i.e. it scales by 'n'.
+ */
+void fft_1d (fft_plan_t *plan, float complex *x, int stride, bool inverse);
+
+#endif /* _UTIL_FFT_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,159 @@
+/*****************************************************************************\
+ *  Copyright (c) 2017 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+
+/* Rice coding, per R. White's implementation in cfitsio (ricecomp.c):
+ * the first pixel is stored verbatim, then each block of pixel
+ * differences (folded to unsigned: 0, -1, 1, -2, ...) is coded with a
+ * 4 bit split code 'fs', followed by, for each difference, its high bits
+ * in unary (that many 0 bits then a 1) and its low 'fs' bits in binary.
+ * Code 0 marks a block of all zero differences, and code fs = 15 a block
+ * stored as raw 16 bit values.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rice.h"
+
+#define FSBITS  4
+#define FSMAX   14
+#define BBITS   16
+
+/* MSB first bit writer.  Fewer than 32 bits are ever pending, so up to
+ * 32 bits can be added at once; whole 32 bit words are flushed.
+ */
+struct bitbuf {
+    unsigned char *p, *end;
+    uint64_t acc;               /* pending bits, right aligned */
+    int nacc;                   /* number of pending bits */
+    int overflow;
+};
+
+static inline void put_bits (struct bitbuf *b, uint32_t v, int nbits)
+{
+    b->acc = (b->acc << nbits) | v;
+    b->nacc += nbits;
+    if (b->nacc >= 32) {
+        b->nacc -= 32;
+        if (b->end - b->p >= 4) {
+            uint32_t w = b->acc >> b->nacc;
+            b->p[0] = w >> 24;
+            b->p[1] = w >> 16;
+            b->p[2] = w >> 8;
+            b->p[3] = w;
+            b->p += 4;
+        } else
+            b->overflow = 1;
+        b->acc &= ((uint64_t)1 << b->nacc) - 1;
+    }
+}
+
+static void flush_bits (struct bitbuf *b)
+{
+    while (b->nacc > 0) {
+        int n = b->nacc >= 8 ? 8 : b->nacc;
+
+        b->nacc -= n;
+        if (b->p < b->end)
+            *b->p++ = (b->acc >> b->nacc) << (8 - n);
+        else
+            b->overflow = 1;
+    }
+}
+
+size_t rice_bound (int n, int blocksize)
+{
+    /* first pixel + per block a code and raw values, plus a partial word */
+    return 2 + ((size_t)n * BBITS
+              + (size_t)((n + blocksize - 1) / blocksize) * FSBITS) / 8 + 4;
+}
+
+int rice_encode16 (const short *in, int n, int blocksize,
+                   unsigned char *out, size_t outlen)
+{
+    struct bitbuf b = { .p = out, .end = out + outlen };
+    uint32_t diff[blocksize > 0 ? blocksize : 1];
+    short lastpix;
+    int i, j, thisblock;
+
+    if (n <= 0 || blocksize <= 0)
+        return -1;
+    put_bits (&b, (unsigned short)in[0], BBITS);
+    lastpix = in[0];
+    for (i = 0; i < n; i += blocksize) {
+        uint32_t pixelsum = 0, psum;
+        int fs;
+
+        thisblock = n - i < blocksize ? n - i : blocksize;
+        for (j = 0; j < thisblock; j++) {
+            short pdiff = in[i + j] - lastpix;
+            diff[j] = (pdiff < 0 ? ~((uint32_t)pdiff << 1)
+                                 : (uint32_t)pdiff << 1) & 0xffff;
+            pixelsum += diff[j];
+            lastpix = in[i + j];
+        }
+
+        /* choose the split so the low bits carry about the mean
+         * (integer form of cfitsio's double precision calculation)
+         */
+        psum = pixelsum > (uint32_t)(thisblock / 2) ?
+               (pixelsum - thisblock / 2 - 1) / thisblock : 0;
+        psum = (psum & 0xffff) >> 1;
+        for (fs = 0; psum > 0; fs++)
+            psum >>= 1;
+
+        if (fs >= FSMAX) {
+            put_bits (&b, FSMAX + 1, FSBITS);
+            for (j = 0; j < thisblock; j++)
+                put_bits (&b, diff[j], BBITS);
+        } else if (fs == 0 && pixelsum == 0) {
+            put_bits (&b, 0, FSBITS);
+        } else {
+            uint32_t fsmask = (1U << fs) - 1;
+
+            put_bits (&b, fs + 1, FSBITS);
+            for (j = 0; j < thisblock; j++) {
+                uint32_t top = diff[j] >> fs;
+
+                /* 'top' 0 bits, a 1 bit, then the low 'fs' bits */
+                while (top + 1 + fs > 32) {
+                    put_bits (&b, 0, 16);
+                    top -= 16;
+                }
+                put_bits (&b, (1U << fs) | (diff[j] & fsmask), top + 1 + fs);
+            }
+        }
+    }
+    flush_bits (&b);
+    if (b.overflow)
+        return -1;
+    return b.p - out;
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
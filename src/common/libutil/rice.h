@@ -0,0 +1,21 @@
+#ifndef _UTIL_RICE_H
+#define _UTIL_RICE_H
+
+#include <stddef.h>
+
+/* Rice compress 'n' 16-bit signed integers as in the FITS tiled image
+ * compression convention (ZCMPTYPE = 'RICE_1', BYTEPIX = 2), bit for bit
+ * compatible with cfitsio's fits_rcomp_short().  'blocksize' is normally
+ * 32 (ZVAL1).  Returns the number of bytes written to 'out', or -1 if
+ * 'outlen' is too small; rice_bound() bytes are always enough.
+ */
+int rice_encode16 (const short *in, int n, int blocksize,
+                   unsigned char *out, size_t outlen);
+
+size_t rice_bound (int n, int blocksize);
+
+#endif /* _UTIL_RICE_H */
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */
@@ -0,0 +1,752 @@
+/*****************************************************************************\
+ *  Copyright (c) 2014 Jim Garlick All rights reserved.
+ *
+ *  This file is part of the sbig-util.
+ *  For details, see https://github.com/garlick/sbig-util.
+ *
+ *  This program is free software; you can redistribute it and/or modify it
+ *  under the terms of the GNU General Public License as published by the Free
+ *  Software Foundation; either version 3 of the license, or (at your option)
+ *  any later version.
+ *
+ *  sbig-util is distributed in the hope that it will be useful, but WITHOUT
+ *  ANY WARRANTY; without even the IMPLIED WARRANTY OF MERCHANTABILITY or
+ *  FITNESS FOR A PARTICULAR PURPOSE.  See the terms and conditions of the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  59 Temple Place, Suite 330, Boston, MA 02111-1307 USA.
+ *  See also:  http://www.gnu.org/licenses/
+\*****************************************************************************/
+
+/* Simulated SBIG universal driver.
+ *
+ * Implements enough of SBIGUnivDrvCommand() for the sbig-util tools to
+ * run without a camera:  link/info queries, exposures, line readout,
+ * TE cooler and filter wheel.  Point SBIG_UDRV (or --sbig-udrv) at the
+ * installed sbigsim.so.  The simulated camera is configured with
+ * environment variables:
+ *
+ *   SBIGSIM_WIDTH, SBIGSIM_HEIGHT  unbinned imaging sensor size (1530x1020)
+ *   SBIGSIM_PIXEL_SIZE             pixel size in microns (9.0)
+ *   SBIGSIM_ROW_USEC               readout latency per line in usec (100)
+ *   SBIGSIM_STARS                  number of stars in the field (100)
+ *   SBIGSIM_FWHM                   star FWHM in unbinned pixels (2.5)
+ *   SBIGSIM_SEED                   random seed for star field and noise (1)
+ *   SBIGSIM_DRIFT_X, SBIGSIM_DRIFT_Y  field drift, unbinned pixels/s (0)
+ *   SBIGSIM_BAYER                  if nonzero, one-shot color sensor (0)
+ *   SBIGSIM_ESHUTTER               if nonzero, e-shutter/ms exposures (0)
+ *   SBIGSIM_CFW_SLOTS              filter wheel positions, 0 for none (5)
+ *
+ * Pixel values are bias + dark current + sky + stars + read noise,
+ * clipped at 65535.  Dark frames (shutter closed) omit sky and stars.
+ */
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+
+#include "sbigudrv.h"
+
+#define SIM_BIAS            1000.0  /* ADU */
+#define SIM_DARK_RATE       2.0     /* ADU/s */
+#define SIM_SKY_RATE        20.0    /* ADU/s */
+#define SIM_READ_NOISE      8.0     /* ADU (approximate RMS) */
+#define SIM_STAR_PEAK_MAX   20000.0 /* brightest star peak, ADU/s */
+#define SIM_AMBIENT         20.0    /* degrees C */
+#define SIM_COOL_TAU        60.0    /* cooler time constant, seconds */
+#define SIM_CFW_MOVE_TIME   0.5     /* seconds per filter move */
+
+#define SIM_TRACK_WIDTH     657
+#define SIM_TRACK_HEIGHT    495
+
+struct star {
+    double x, y;                    /* unbinned sensor coordinates */
+    double peak;                    /* peak ADU/s */
+};
+
+struct chip {
+    int width, height;              /* unbinned */
+    bool exposing;
+    struct timespec exp_start;
+    double exp_time;                /* seconds */
+    bool shutter_open;
+    /* readout state */
+    int ro_mode, ro_top, ro_left, ro_height, ro_width;
+    int ro_line;                    /* next line to be read */
+    double ro_exp_time;
+    bool ro_shutter_open;
+    double ro_drift_x, ro_drift_y;  /* field offset at end of exposure */
+};
+
+struct sim {
+    bool driver_open;
+    bool device_open;
+    bool link;
+    CAMERA_TYPE camera_type;
+    double pixel_size;
+    long row_usec;
+    bool bayer;
+    bool eshutter;
+    double sigma;                   /* star gaussian sigma, unbinned pixels */
+    int nstars;
+    struct star *stars;
+    double drift_x, drift_y;        /* unbinned pixels/s, as if unguided */
+    struct timespec start;
+    unsigned long long rng;
+    struct chip imaging;
+    struct chip tracking;
+    struct timespec row_deadline;
+    /* cooler */
+    bool cooling;
+    double setpoint;
+    double temp_start;
+    struct timespec cool_start;
+    /* cfw */
+    int cfw_slots;
+    int cfw_position;
+    struct timespec cfw_done;
+};
+
+static struct sim sim;
+static bool sim_initialized = false;
+
+static double getenv_double (const char *name, double dflt)
+{
+    const char *s = getenv (name);
+    return s ? strtod (s, NULL) : dflt;
+}
+
+static double timespec_since (struct timespec *t0)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec) + 1E-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+/* xorshift64* - fast, deterministic for a given SBIGSIM_SEED
+ */
+static unsigned long long rng_next (void)
+{
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return sim.rng * 2685821657736338717ULL;
+}
+
+static double rng_uniform (void)
+{
+    return (rng_next () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Approximately normal, unit variance (Irwin-Hall with n=4).
+ */
+static double rng_gauss (void)
+{
+    unsigned long long r = rng_next ();
+    int sum = (r & 0xffff) + ((r >> 16) & 0xffff)
+            + ((r >> 32) & 0xffff) + ((r >> 48) & 0xffff);
+    return (sum - 2 * 65535.5) / (65536.0 * 0.57735);
+}
+
+/* Encode a non-negative value as BCD with two decimal places.
+ */
+static ulong bcd_encode (double val)
+{
+    ulong n = (ulong)(val * 100.0 + 0.5);
+    ulong bcd = 0;
+    int shift = 0;
+
+    while (n > 0 && shift < 32) {
+        bcd |= (n % 10) << shift;
+        n /= 10;
+        shift += 4;
+    }
+    return bcd;
+}
+
+static void sim_init (void)
+{
+    int i;
+
+    memset (&sim, 0, sizeof (sim));
+    sim.camera_type = ST8_CAMERA;
+    sim.imaging.width = getenv_double ("SBIGSIM_WIDTH", 1530);
+    sim.imaging.height = getenv_double ("SBIGSIM_HEIGHT", 1020);
+    if (sim.imaging.width < 16 || sim.imaging.width > 16384)
+        sim.imaging.width = 1530;
+    if (sim.imaging.height < 16 || sim.imaging.height > 16384)
+        sim.imaging.height = 1020;
+    sim.tracking.width = SIM_TRACK_WIDTH;
+    sim.tracking.height = SIM_TRACK_HEIGHT;
+    sim.pixel_size = getenv_double ("SBIGSIM_PIXEL_SIZE", 9.0);
+    sim.row_usec = getenv_double ("SBIGSIM_ROW_USEC", 100);
+    sim.nstars = getenv_double ("SBIGSIM_STARS", 100);
+    sim.sigma = getenv_double ("SBIGSIM_FWHM", 2.5) / 2.3548;
+    if (sim.sigma < 0.1)
+        sim.sigma = 0.1;
+    sim.bayer = getenv_double ("SBIGSIM_BAYER", 0) != 0;
+    sim.eshutter = getenv_double ("SBIGSIM_ESHUTTER", 0) != 0;
+    sim.cfw_slots = getenv_double ("SBIGSIM_CFW_SLOTS", 5);
+    sim.cfw_position = sim.cfw_slots > 0 ? 1 : 0;
+    sim.rng = (unsigned long long)getenv_double ("SBIGSIM_SEED", 1) + 1;
+    sim.drift_x = getenv_double ("SBIGSIM_DRIFT_X", 0);
+    sim.drift_y = getenv_double ("SBIGSIM_DRIFT_Y", 0);
+    clock_gettime (CLOCK_MONOTONIC, &sim.start);
+    sim.temp_start = SIM_AMBIENT;
+
+    if (sim.nstars < 0)
+        sim.nstars = 0;
+    if (sim.nstars > 0) {
+        if (!(sim.stars = calloc (sim.nstars, sizeof (sim.stars[0]))))
+            sim.nstars = 0;
+    }
+    /* Brightness follows a steep power law, so a few bright stars
+     * and many faint ones, as in a real field.
+     */
+    for (i = 0; i < sim.nstars; i++) {
+        sim.stars[i].x = rng_uniform () * sim.imaging.width;
+        sim.stars[i].y = rng_uniform () * sim.imaging.height;
+        sim.stars[i].peak = SIM_STAR_PEAK_MAX * pow (rng_uniform (), 4) + 20;
+    }
+    sim_initialized = true;
+}
+
+static struct chip *get_chip (ushort ccd)
+{
+    switch (ccd & 0xff) {
+        case CCD_IMAGING:
+            return &sim.imaging;
+        case CCD_TRACKING:
+            return &sim.tracking;
+        default:
+            return NULL;
+    }
+}
+
+static int binning (int mode)
+{
+    switch (mode) {
+        case RM_1X1:
+            return 1;
+        case RM_2X2:
+            return 2;
+        case RM_3X3:
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+static double ccd_temperature (void)
+{
+    double target = sim.cooling ? sim.setpoint : SIM_AMBIENT;
+    double t = timespec_since (&sim.cool_start);
+
+    return target + (sim.temp_start - target) * exp (-t / SIM_COOL_TAU);
+}
+
+/* Pace readout at row_usec per line against an absolute deadline,
+ * so that sleep granularity does not accumulate.
+ */
+static void row_delay (void)
+{
+    struct timespec now;
+
+    if (sim.row_usec <= 0)
+        return;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    sim.row_deadline.tv_nsec += sim.row_usec * 1000;
+    while (sim.row_deadline.tv_nsec >= 1000000000) {
+        sim.row_deadline.tv_nsec -= 1000000000;
+        sim.row_deadline.tv_sec++;
+    }
+    if (sim.row_deadline.tv_sec < now.tv_sec
+            || (sim.row_deadline.tv_sec == now.tv_sec
+                && sim.row_deadline.tv_nsec < now.tv_nsec))
+        sim.row_deadline = now;
+    else
+        clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &sim.row_deadline, NULL);
+}
+
+/* Render 'len' binned pixels of binned row 'row' starting at binned
+ * column 'start'.
+ */
+static void render_line (struct chip *c, int row, int start, int len,
+                         ushort *buf)
+{
+    int bin = binning (c->ro_mode);
+    double t = c->ro_exp_time;
+    double base = SIM_BIAS + bin * bin * SIM_DARK_RATE * t;
+    double y = (row + 0.5) * bin;
+    double reach = 5 * sim.sigma;
+    int i, j;
+
+    if (c->ro_shutter_open)
+        base += bin * bin * SIM_SKY_RATE * t;
+    for (i = 0; i < len; i++) {
+        double val = base + SIM_READ_NOISE * rng_gauss ();
+        if (sim.bayer && c == &sim.imaging) {
+            int col = start + i;
+            if ((row & 1) == 0 && (col & 1) == 0)
+                val *= 0.8;     /* blue */
+            else if ((row & 1) == 1 && (col & 1) == 1)
+                val *= 1.1;     /* red */
+        }
+        if (val < 0)
+            val = 0;
+        buf[i] = val > 65535 ? 65535 : (ushort)val;
+    }
+    if (!c->ro_shutter_open || c != &sim.imaging)
+        return;
+    for (j = 0; j < sim.nstars; j++) {
+        struct star *s = &sim.stars[j];
+        double sx = s->x + c->ro_drift_x;
+        double dy = y - (s->y + c->ro_drift_y);
+        double ry, amp;
+        int x0, x1;
+
+        if (fabs (dy) > reach + bin)
+            continue;
+        ry = exp (-(dy * dy) / (2 * sim.sigma * sim.sigma));
+        amp = s->peak * t * bin * bin * ry;
+        x0 = floor ((sx - reach) / bin) - start;
+        x1 = floor ((sx + reach) / bin) - start + 1;
+        if (x0 < 0)
+            x0 = 0;
+        if (x1 > len)
+            x1 = len;
+        for (i = x0; i < x1; i++) {
+            double dx = ((start + i) + 0.5) * bin - sx;
+            double val = buf[i] + amp * exp (-(dx * dx)
+                                             / (2 * sim.sigma * sim.sigma));
+            buf[i] = val > 65535 ? 65535 : (ushort)val;
+        }
+    }
+}
+
+static void fill_readout_info (READOUT_INFO *ri, int mode, int width,
+                               int height)
+{
+    int bin = binning (mode);
+
+    ri->mode = mode;
+    ri->width = width / bin;
+    ri->height = height / bin;
+    ri->gain = bcd_encode (2.3);
+    ri->pixelWidth = bcd_encode (sim.pixel_size * bin);
+    ri->pixelHeight = bcd_encode (sim.pixel_size * bin);
+}
+
+static short get_ccd_info (GetCCDInfoParams *in, void *out)
+{
+    switch (in->request) {
+        case CCD_INFO_IMAGING:
+        case CCD_INFO_TRACKING: {
+            GetCCDInfoResults0 *r = out;
+            struct chip *c = in->request == CCD_INFO_IMAGING ? &sim.imaging
+                                                             : &sim.tracking;
+            int i;
+            memset (r, 0, sizeof (*r));
+            r->firmwareVersion = 0x0100;
+            r->cameraType = sim.camera_type;
+            snprintf (r->name, sizeof (r->name), "SBIG Simulated %s Camera",
+                      sim.bayer ? "Color" : "Mono");
+            r->readoutModes = 3;
+            for (i = 0; i < 3; i++)
+                fill_readout_info (&r->readoutInfo[i], RM_1X1 + i,
+                                   c->width, c->height);
+            return CE_NO_ERROR;
+        }
+        case CCD_INFO_EXTENDED: {
+            GetCCDInfoResults2 *r = out;
+            memset (r, 0, sizeof (*r));
+            r->imagingABG = ABG_NOT_PRESENT;
+            snprintf (r->serialNumber, sizeof (r->serialNumber), "SIM00001");
+            return CE_NO_ERROR;
+        }
+        case CCD_INFO_EXTENDED2_IMAGING:
+        case CCD_INFO_EXTENDED2_TRACKING: {
+            GetCCDInfoResults4 *r = out;
+            memset (r, 0, sizeof (*r));
+            if (sim.eshutter && in->request == CCD_INFO_EXTENDED2_IMAGING)
+                r->capabilitiesBits |= CB_CCD_ESHUTTER_YES;
+            r->capabilitiesBits |= CB_REQUIRES_STARTEXP2_YES;
+            return CE_NO_ERROR;
+        }
+        case CCD_INFO_EXTENDED3: {
+            GetCCDInfoResults6 *r = out;
+            memset (r, 0, sizeof (*r));
+            if (sim.eshutter)
+                r->cameraBits |= 2; /* no mechanical shutter */
+            if (sim.bayer)
+                r->ccdBits |= 1;
+            return CE_NO_ERROR;
+        }
+        default:
+            return CE_BAD_PARAMETER;
+    }
+}
+
+static short start_exposure (StartExposureParams2 *in)
+{
+    struct chip *c = get_chip (in->ccd);
+    ulong t = in->exposureTime & EXP_TIME_MASK;
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    if (c->exposing)
+        return CE_EXPOSURE_IN_PROGRESS;
+    if (binning (in->readoutMode) == 0)
+        return CE_BAD_PARAMETER;
+    c->exp_time = (in->exposureTime & EXP_MS_EXPOSURE) ? 1E-3 * t : 1E-2 * t;
+    c->shutter_open = (in->openShutter != SC_CLOSE_SHUTTER);
+    c->exposing = true;
+    clock_gettime (CLOCK_MONOTONIC, &c->exp_start);
+    return CE_NO_ERROR;
+}
+
+static short end_exposure (EndExposureParams *in)
+{
+    struct chip *c = get_chip (in->ccd);
+
+    if (!c)
+        return CE_BAD_PARAMETER;
+    if (c->exposing && !(in->ccd & ABORT_DONT_END)) {
+        /* Latch what was integrated for the following readout.
+         */
+        double elapsed = timespec_since (&c->exp_start);
+        c->ro_exp_time = elapsed < c->exp_time ? elapsed : c->exp_time;
+        c->ro_shutter_open = c->shutter_open;
+        c->ro_drift_x = sim.drift_x * timespec_since (&sim.start);
+        c->ro_drift_y = sim.drift_y * timespec_since (&sim.start);
+    }
+    c->exposing = false;
+    return CE_NO_ERROR;
+}
+
+static ushort chip_status (struct chip *c)
+{
+    if (!c->exposing)
+        return CS_IDLE;
+    if (timespec_since (&c->exp_start) < c->exp_time)
+        return CS_INTEGRATING;
+    return CS_INTEGRATION_COMPLETE;
+}
+
+static short query_command_status (QueryCommandStatusParams *in,
+                                   QueryCommandStatusResults *out)
+{
+    switch (in->command) {
+        case CC_START_EXPOSURE:
+        case CC_START_EXPOSURE2:
+        case CC_END_EXPOSURE:
+            out->status = chip_status (&sim.imaging)
+                        | (chip_status (&sim.tracking) << 2);
+            break;
+        default:
+            out->status = 0;
+            break;
+    }
+    return CE_NO_ERROR;
+}
+
+static short start_readout (StartReadoutParams *in)
+{
+    struct chip *c = get_chip (in->ccd);
+    int bin;
+
+    if (!c || (bin = binning (in->readoutMode)) == 0)
+        return CE_BAD_PARAMETER;
+    if (in->left + in->width > c->width / bin
+                            || in->top + in->height > c->height / bin)
+        return CE_BAD_PARAMETER;
+    c->ro_mode = in->readoutMode;
+    c->ro_top = in->top;
+    c->ro_left = in->left;
+    c->ro_height = in->height;
+    c->ro_width = in->width;
+    c->ro_line = 0;
+    clock_gettime (CLOCK_MONOTONIC, &sim.row_deadline);
+    return CE_NO_ERROR;
+}
+
+static short readout_line (ReadoutLineParams *in, ushort *buf, bool subtract)
+{
+    struct chip *c = get_chip (in->ccd);
+    int bin;
+
+    if (!c || (bin = binning (in->readoutMode)) == 0)
+        return CE_BAD_PARAMETER;
+    if (in->pixelStart + in->pixelLength > c->width / bin)
+        return CE_BAD_PARAMETER;
+    if (c->ro_line >= c->ro_height)
+        return CE_BAD_PARAMETER;
+    c->ro_mode = in->readoutMode;
+    row_delay ();
+    if (subtract) {
+        ushort *tmp;
+        int i;
+        if (!(tmp = malloc (in->pixelLength * sizeof (*tmp))))
+            return CE_MEMORY_ERROR;
+        render_line (c, c->ro_top + c->ro_line, in->pixelStart,
+                     in->pixelLength, tmp);
+        /* Like the real driver: light - dark + 100, clipped at 0.
+         */
+        for (i = 0; i < in->pixelLength; i++) {
+            int val = (int)tmp[i] - (int)buf[i] + 100;
+            buf[i] = val < 0 ? 0 : val > 65535 ? 65535 : val;
+        }
+        free (tmp);
+    } else
+        render_line (c, c->ro_top + c->ro_line, in->pixelStart,
+                     in->pixelLength, buf);
+    c->ro_line++;
+    return CE_NO_ERROR;
+}
+
+static short temperature_regulation (SetTemperatureRegulationParams2 *in)
+{
+    switch (in->regulation) {
+        case REGULATION_ON:
+        case REGULATION_OFF:
+            sim.temp_start = ccd_temperature ();
+            clock_gettime (CLOCK_MONOTONIC, &sim.cool_start);
+            sim.cooling = (in->regulation == REGULATION_ON);
+            if (sim.cooling)
+                sim.setpoint = in->ccdSetpoint;
+            return CE_NO_ERROR;
+        case REGULATION_OVERRIDE:
+        case REGULATION_FREEZE:
+        case REGULATION_UNFREEZE:
+        case REGULATION_ENABLE_AUTOFREEZE:
+        case REGULATION_DISABLE_AUTOFREEZE:
+            return CE_NO_ERROR;
+        default:
+            return CE_BAD_PARAMETER;
+    }
+}
+
+static short query_temperature (QueryTemperatureStatusParams *in,
+                                QueryTemperatureStatusResults2 *out)
+{
+    double temp = ccd_temperature ();
+
+    if (in->request != TEMP_STATUS_ADVANCED2)
+        return CE_BAD_PARAMETER;
+    memset (out, 0, sizeof (*out));
+    out->coolingEnabled = sim.cooling;
+    out->fanEnabled = FS_AUTOCONTROL;
+    out->ccdSetpoint = sim.cooling ? sim.setpoint : SIM_AMBIENT;
+    out->imagingCCDTemperature = temp;
+    out->trackingCCDTemperature = temp;
+    out->externalTrackingCCDTemperature = temp;
+    out->trackingCCDSetpoint = out->ccdSetpoint;
+    out->ambientTemperature = SIM_AMBIENT;
+    out->heatsinkTemperature = SIM_AMBIENT + (sim.cooling ? 5 : 0);
+    out->imagingCCDPower = sim.cooling ? 50 : 0;
+    out->fanPower = sim.cooling ? 60 : 0;
+    out->fanSpeed = sim.cooling ? 3000 : 0;
+    return CE_NO_ERROR;
+}
+
+static short cfw (CFWParams *in, CFWResults *out)
+{
+    bool busy = sim.cfw_slots > 0 && timespec_since (&sim.cfw_done) < 0;
+
+    memset (out, 0, sizeof (*out));
+    if (sim.cfw_slots == 0) {
+        out->cfwError = CFWE_BAD_MODEL;
+        return CE_CFW_ERROR;
+    }
+    out->cfwModel = CFWSEL_CFW8;
+    switch (in->cfwCommand) {
+        case CFWC_QUERY:
+            out->cfwStatus = busy ? CFWS_BUSY : CFWS_IDLE;
+            out->cfwPosition = busy ? CFWP_UNKNOWN : sim.cfw_position;
+            break;
+        case CFWC_GOTO:
+            if (in->cfwParam1 < 1 || in->cfwParam1 > sim.cfw_slots) {
+                out->cfwError = CFWE_BAD_COMMAND;
+                return CE_CFW_ERROR;
+            }
+            /* cfw_done is a deadline in the future while moving
+             */
+            clock_gettime (CLOCK_MONOTONIC, &sim.cfw_done);
+            sim.cfw_done.tv_nsec += SIM_CFW_MOVE_TIME * 1E9;
+            while (sim.cfw_done.tv_nsec >= 1000000000) {
+                sim.cfw_done.tv_nsec -= 1000000000;
+                sim.cfw_done.tv_sec++;
+            }
+            sim.cfw_position = in->cfwParam1;
+            out->cfwStatus = CFWS_BUSY;
+            break;
+        case CFWC_INIT:
+        case CFWC_OPEN_DEVICE:
+        case CFWC_CLOSE_DEVICE:
+            break;
+        case CFWC_GET_INFO:
+            out->cfwResult1 = 0x0100;
+            out->cfwResult2 = sim.cfw_slots;
+            break;
+        default:
+            out->cfwError = CFWE_BAD_COMMAND;
+            return CE_CFW_ERROR;
+    }
+    return CE_NO_ERROR;
+}
+
+static short get_error_string (GetErrorStringParams *in,
+                               GetErrorStringResults *out)
+{
+    const char *s;
+
+    switch (in->errorNo) {
+        case CE_NO_ERROR:
+            s = "No error";
+            break;
+        case CE_CAMERA_NOT_FOUND:
+            s = "Camera not found";
+            break;
+        case CE_EXPOSURE_IN_PROGRESS:
+            s = "Exposure in progress";
+            break;
+        case CE_UNKNOWN_COMMAND:
+            s = "Unknown command";
+            break;
+        case CE_BAD_PARAMETER:
+            s = "Bad parameter";
+            break;
+        case CE_DRIVER_NOT_OPEN:
+            s = "Driver not open";
+            break;
+        case CE_DEVICE_NOT_OPEN:
+            s = "Device not open";
+            break;
+        case CE_CFW_ERROR:
+            s = "CFW error";
+            break;
+        case CE_OS_ERROR:
+            s = "OS error";
+            break;
+        default:
+            s = NULL;
+            break;
+    }
+    if (s)
+        snprintf (out->errorString, sizeof (out->errorString), "%s", s);
+    else
+        snprintf (out->errorString, sizeof (out->errorString),
+                  "Simulated error %d", in->errorNo);
+    return CE_NO_ERROR;
+}
+
+short SBIGUnivDrvCommand (short command, void *params, void *results)
+{
+    if (!sim_initialized)
+        sim_init ();
+
+    /* Commands that need no open driver/device.
+     */
+    switch (command) {
+        case CC_OPEN_DRIVER:
+            sim.driver_open = true;
+            return CE_NO_ERROR;
+        case CC_CLOSE_DRIVER:
+            sim.driver_open = false;
+            return CE_NO_ERROR;
+        case CC_GET_ERROR_STRING:
+            return get_error_string (params, results);
+        case CC_GET_DRIVER_INFO: {
+            GetDriverInfoResults0 *r = results;
+            memset (r, 0, sizeof (*r));
+            r->version = 0x0100;
+            snprintf (r->name, sizeof (r->name), "SBIG simulated driver");
+            r->maxRequest = CC_LAST_COMMAND;
+            return CE_NO_ERROR;
+        }
+    }
+    if (!sim.driver_open)
+        return CE_DRIVER_NOT_OPEN;
+
+    switch (command) {
+        case CC_OPEN_DEVICE:
+            sim.device_open = true;
+            return CE_NO_ERROR;
+        case CC_CLOSE_DEVICE:
+            sim.device_open = false;
+            sim.link = false;
+            return CE_NO_ERROR;
+        case CC_QUERY_USB: {
+            QueryUSBResults *r = results;
+            memset (r, 0, sizeof (*r));
+            r->camerasFound = 1;
+            r->usbInfo[0].cameraFound = 1;
+            r->usbInfo[0].cameraType = sim.camera_type;
+            snprintf (r->usbInfo[0].name, sizeof (r->usbInfo[0].name),
+                      "SBIG Simulated Camera");
+            snprintf (r->usbInfo[0].serialNumber,
+                      sizeof (r->usbInfo[0].serialNumber), "SIM00001");
+            return CE_NO_ERROR;
+        }
+        case CC_QUERY_ETHERNET: {
+            QueryEthernetResults *r = results;
+            memset (r, 0, sizeof (*r));
+            return CE_NO_ERROR;
+        }
+    }
+    if (!sim.device_open)
+        return CE_DEVICE_NOT_OPEN;
+
+    switch (command) {
+        case CC_ESTABLISH_LINK: {
+            EstablishLinkResults *r = results;
+            sim.link = true;
+            r->cameraType = sim.camera_type;
+            return CE_NO_ERROR;
+        }
+    }
+    if (!sim.link)
+        return CE_CAMERA_NOT_FOUND;
+
+    switch (command) {
+        case CC_GET_CCD_INFO:
+            return get_ccd_info (params, results);
+        case CC_START_EXPOSURE2:
+            return start_exposure (params);
+        case CC_END_EXPOSURE:
+            return end_exposure (params);
+        case CC_QUERY_COMMAND_STATUS:
+            return query_command_status (params, results);
+        case CC_START_READOUT:
+            return start_readout (params);
+        case CC_READOUT_LINE:
+            return readout_line (params, results, false);
+        case CC_READ_SUBTRACT_LINE:
+            return readout_line (params, results, true);
+        case CC_END_READOUT:
+            return CE_NO_ERROR;
+        case CC_SET_TEMPERATURE_REGULATION2:
+            return temperature_regulation (params);
+        case CC_QUERY_TEMPERATURE_STATUS:
+            return query_temperature (params, results);
+        case CC_CFW:
+            return cfw (params, results);
+        default:
+            return CE_UNKNOWN_COMMAND;
+    }
+}
+
+/*
+ * vi:tabstop=4 shiftwidth=4 expandtab
+ */